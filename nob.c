@@ -5,7 +5,20 @@
 static char* c_files[] = {
     "src/fuse.c",
     "src/block.c",
+    "src/bitmap.c",
+    "src/alloc.c",
+    "src/extent.c",
     "src/fact.c",
+    "src/cache.c",
+    "src/stats.c",
+    "src/ctl.c",
+    "src/defrag.c",
+    "src/uring.c",
+    "src/lz.c",
+    "src/dedup.c",
+    "src/readahead.c",
+    "src/base64.c",
+    "src/pack.c",
 
     "src/lib/cJSON.c",
 };
@@ -18,7 +31,10 @@ void log_usage(Log_Level log_level, const char* program) {
     nob_log(log_level, "    mount       Build the program and mount the specified file at build/mnt.");
     nob_log(log_level, "                If a filesystem is already mounted at build/mnt, it is unmounted.");
     nob_log(log_level, "                If no mount point is provided, /dev/zero is used.");
+    nob_log(log_level, "                Any arguments after the file are passed to ewsfs_fuse, e.g. `-o backend=mmap`.");
     nob_log(log_level, "    umount      Unmount the filesystem mounted using the mount command.");
+    nob_log(log_level, "    test        Build the program and run test_blockdev.sh, which mounts it on a loop device.");
+    nob_log(log_level, "                Without the rights to set up a loop device, an image file is used instead.");
     nob_log(log_level, "    help        Show this message.");
 }
 
@@ -30,7 +46,10 @@ int main(int argc, char** argv) {
     const char* program = shift(argv, argc);
 
     bool should_mount = false;
+    bool should_test = false;
     char* mount_path = NULL;
+    char** mount_args = NULL;
+    int mount_args_count = 0;
     if (argc > 0) {
         const char* command = shift(argv, argc);
         if (strcmp(command, "build") == 0) {
@@ -40,6 +59,10 @@ int main(int argc, char** argv) {
 
             if (argc > 0)
                 mount_path = shift(argv, argc);
+            mount_args = argv;
+            mount_args_count = argc;
+        } else if (strcmp(command, "test") == 0) {
+            should_test = true;
         } else if (strcmp(command, "umount") == 0) {
             cmd_append(&cmd, "fusermount", "-u", "build/mnt");
             if (!cmd_run_sync_and_reset(&cmd)) return 1;
@@ -66,6 +89,11 @@ int main(int argc, char** argv) {
     cmd_append(&cmd, "-lfuse");
     if (!cmd_run_sync_and_reset(&cmd)) return 1;
 
+    if (should_test) {
+        cmd_append(&cmd, "sh", "test_blockdev.sh", "build/ewsfs_fuse");
+        if (!cmd_run_sync_and_reset(&cmd)) return 1;
+    }
+
     if (should_mount) {
         nob_mkdir_if_not_exists("build/mnt");
 
@@ -76,6 +104,9 @@ int main(int argc, char** argv) {
         nob_log(INFO, "");
 
         cmd_append(&cmd, "./build/ewsfs_fuse", mount_path ? mount_path : "/dev/zero", "build/mnt");
+        for (int i = 0; i < mount_args_count; ++i) {
+            cmd_append(&cmd, mount_args[i]);
+        }
         if (!cmd_run_sync_and_reset(&cmd)) return 1;
     }
 
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include "alloc.h"
+
+// Images are split into at most this many groups, and groups are never smaller than ALLOC_GROUP_MIN_BLOCKS,
+// so small images are a single group and large ones don't get thousands of tiny groups
+#define ALLOC_MAX_GROUPS 64
+#define ALLOC_GROUP_MIN_BLOCKS 1024
+
+bool ewsfs_alloc_init(ewsfs_allocator_t* allocator, uint64_t block_count) {
+    *allocator = (ewsfs_allocator_t) {0};
+    allocator->block_count = block_count;
+    uint64_t group_size = (block_count + ALLOC_MAX_GROUPS - 1) / ALLOC_MAX_GROUPS;
+    if (group_size < ALLOC_GROUP_MIN_BLOCKS)
+        group_size = ALLOC_GROUP_MIN_BLOCKS;
+    allocator->group_size = group_size;
+    allocator->group_count = block_count > 0 ? (block_count + group_size - 1) / group_size : 1;
+
+    allocator->groups = calloc(allocator->group_count, sizeof(*allocator->groups));
+    if (!allocator->groups)
+        return false;
+    for (size_t i = 0; i < allocator->group_count; ++i) {
+        ewsfs_alloc_group_t* group = &allocator->groups[i];
+        group->from = i*group_size;
+        uint64_t size = block_count - group->from < group_size ? block_count - group->from : group_size;
+        if (!ewsfs_bitmap_init(&group->bitmap, block_count > 0 ? size : 0)) {
+            ewsfs_alloc_uninit(allocator);
+            return false;
+        }
+        pthread_mutex_init(&group->lock, NULL);
+    }
+    return true;
+}
+
+void ewsfs_alloc_uninit(ewsfs_allocator_t* allocator) {
+    for (size_t i = 0; allocator->groups && i < allocator->group_count; ++i) {
+        if (!allocator->groups[i].bitmap.words)
+            continue;
+        ewsfs_bitmap_uninit(&allocator->groups[i].bitmap);
+        pthread_mutex_destroy(&allocator->groups[i].lock);
+    }
+    free(allocator->groups);
+    *allocator = (ewsfs_allocator_t) {0};
+}
+
+void ewsfs_alloc_clear(ewsfs_allocator_t* allocator) {
+    for (size_t i = 0; i < allocator->group_count; ++i) {
+        pthread_mutex_lock(&allocator->groups[i].lock);
+        ewsfs_bitmap_clear(&allocator->groups[i].bitmap);
+        pthread_mutex_unlock(&allocator->groups[i].lock);
+    }
+}
+
+bool ewsfs_alloc_grow(ewsfs_allocator_t* allocator, uint64_t block_count) {
+    if (block_count <= allocator->block_count)
+        return block_count == allocator->block_count;
+    uint64_t group_size = allocator->group_size;
+    size_t group_count = (block_count + group_size - 1) / group_size;
+    ewsfs_alloc_group_t* last = &allocator->groups[allocator->group_count - 1];
+    uint64_t last_size = block_count - last->from < group_size ? block_count - last->from : group_size;
+    if (!ewsfs_bitmap_grow(&last->bitmap, last_size))
+        return false;
+    allocator->block_count = last->from + last->bitmap.bit_count;
+    if (group_count == allocator->group_count)
+        return true;
+
+    ewsfs_alloc_group_t* groups = calloc(group_count, sizeof(*groups));
+    if (!groups)
+        return false;
+    // The locks are made again instead of being moved
+    for (size_t i = 0; i < allocator->group_count; ++i) {
+        groups[i].from = allocator->groups[i].from;
+        groups[i].bitmap = allocator->groups[i].bitmap;
+        pthread_mutex_init(&groups[i].lock, NULL);
+        pthread_mutex_destroy(&allocator->groups[i].lock);
+    }
+    free(allocator->groups);
+    allocator->groups = groups;
+    for (size_t i = allocator->group_count; i < group_count; ++i) {
+        ewsfs_alloc_group_t* group = &groups[i];
+        group->from = i*group_size;
+        uint64_t size = block_count - group->from < group_size ? block_count - group->from : group_size;
+        if (!ewsfs_bitmap_init(&group->bitmap, size))
+            return false;
+        pthread_mutex_init(&group->lock, NULL);
+        allocator->group_count = i + 1;
+        allocator->block_count = group->from + size;
+    }
+    return true;
+}
+
+static bool alloc_set_range(ewsfs_allocator_t* allocator, uint64_t from, uint64_t length, bool used) {
+    if (from > allocator->block_count || length > allocator->block_count - from)
+        return false;
+    uint64_t to = from + length;
+    while (from < to) {
+        ewsfs_alloc_group_t* group = &allocator->groups[from / allocator->group_size];
+        uint64_t group_to = group->from + group->bitmap.bit_count < to ? group->from + group->bitmap.bit_count : to;
+        pthread_mutex_lock(&group->lock);
+        if (used)
+            ewsfs_bitmap_set_used(&group->bitmap, from - group->from, group_to - from);
+        else
+            ewsfs_bitmap_set_free(&group->bitmap, from - group->from, group_to - from);
+        pthread_mutex_unlock(&group->lock);
+        from = group_to;
+    }
+    return true;
+}
+
+bool ewsfs_alloc_set_used(ewsfs_allocator_t* allocator, uint64_t from, uint64_t length) {
+    return alloc_set_range(allocator, from, length, true);
+}
+
+bool ewsfs_alloc_set_free(ewsfs_allocator_t* allocator, uint64_t from, uint64_t length) {
+    return alloc_set_range(allocator, from, length, false);
+}
+
+// Take a free run from one group; with `whole` set, only a run of `wanted` blocks is taken
+static bool alloc_from_group(ewsfs_alloc_group_t* group, uint64_t wanted, bool whole, uint64_t* from, uint64_t* length) {
+    pthread_mutex_lock(&group->lock);
+    // The summary lets full groups, and groups that are too empty for the whole run, be skipped without scanning
+    bool found = group->bitmap.free_count > 0 && (!whole || group->bitmap.free_count >= wanted)
+        && ewsfs_bitmap_find_free_run(&group->bitmap, wanted, from, length) && (!whole || *length == wanted);
+    if (found) {
+        ewsfs_bitmap_set_used(&group->bitmap, *from, *length);
+        *from += group->from;
+    }
+    pthread_mutex_unlock(&group->lock);
+    return found;
+}
+
+bool ewsfs_alloc_extent(ewsfs_allocator_t* allocator, uint64_t hint, uint64_t wanted, uint64_t* from, uint64_t* length) {
+    if (wanted == 0)
+        return false;
+    size_t first_group = hint % allocator->group_count;
+    // A run can't be longer than a group, so don't look for one that is
+    bool whole = wanted <= allocator->group_size;
+    for (int pass = whole ? 0 : 1; pass < 2; ++pass) {
+        for (size_t i = 0; i < allocator->group_count; ++i) {
+            ewsfs_alloc_group_t* group = &allocator->groups[(first_group + i) % allocator->group_count];
+            if (alloc_from_group(group, wanted, pass == 0, from, length))
+                return true;
+        }
+    }
+    return false;
+}
+
+bool ewsfs_alloc_extend(ewsfs_allocator_t* allocator, uint64_t from, uint64_t wanted, uint64_t* length) {
+    if (wanted == 0 || from >= allocator->block_count)
+        return false;
+    ewsfs_alloc_group_t* group = &allocator->groups[from / allocator->group_size];
+    uint64_t index = from - group->from;
+    uint64_t end = group->bitmap.bit_count - index < wanted ? group->bitmap.bit_count : index + wanted;
+    pthread_mutex_lock(&group->lock);
+    uint64_t to = index;
+    while (to < end && !ewsfs_bitmap_is_used(&group->bitmap, to))
+        ++to;
+    if (to > index)
+        ewsfs_bitmap_set_used(&group->bitmap, index, to - index);
+    pthread_mutex_unlock(&group->lock);
+    *length = to - index;
+    return *length > 0;
+}
+
+uint64_t ewsfs_alloc_get_free_count(ewsfs_allocator_t* allocator) {
+    uint64_t free_count = 0;
+    for (size_t i = 0; i < allocator->group_count; ++i) {
+        pthread_mutex_lock(&allocator->groups[i].lock);
+        free_count += allocator->groups[i].bitmap.free_count;
+        pthread_mutex_unlock(&allocator->groups[i].lock);
+    }
+    return free_count;
+}
+
+bool ewsfs_alloc_is_used(ewsfs_allocator_t* allocator, uint64_t block_index) {
+    if (block_index >= allocator->block_count)
+        return true;
+    ewsfs_alloc_group_t* group = &allocator->groups[block_index / allocator->group_size];
+    pthread_mutex_lock(&group->lock);
+    bool used = ewsfs_bitmap_is_used(&group->bitmap, block_index - group->from);
+    pthread_mutex_unlock(&group->lock);
+    return used;
+}
+
+uint64_t ewsfs_alloc_hint_for_block(const ewsfs_allocator_t* allocator, uint64_t block_index) {
+    return block_index / allocator->group_size;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "bitmap.h"
+
+// A part of the image with its own free-space bitmap and lock, so writers in different groups don't contend.
+// The bitmap's free count is the group's free-space summary.
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t from;
+    ewsfs_bitmap_t bitmap;
+} ewsfs_alloc_group_t;
+
+typedef struct {
+    ewsfs_alloc_group_t* groups;
+    size_t group_count;
+    uint64_t group_size;
+    uint64_t block_count;
+} ewsfs_allocator_t;
+
+bool ewsfs_alloc_init(ewsfs_allocator_t* allocator, uint64_t block_count);
+void ewsfs_alloc_uninit(ewsfs_allocator_t* allocator);
+// Mark every block as free
+void ewsfs_alloc_clear(ewsfs_allocator_t* allocator);
+// Add free blocks at the end of the image, up to `block_count` blocks. The last group is filled up first, the rest
+// gets new groups of the same size, so the blocks that are there already aren't touched.
+// Nothing else may use the allocator meanwhile.
+bool ewsfs_alloc_grow(ewsfs_allocator_t* allocator, uint64_t block_count);
+// Mark a range of blocks as used or free, which may span several groups. Returns false if the range is outside of the image.
+bool ewsfs_alloc_set_used(ewsfs_allocator_t* allocator, uint64_t from, uint64_t length);
+bool ewsfs_alloc_set_free(ewsfs_allocator_t* allocator, uint64_t from, uint64_t length);
+// Allocate up to `wanted` consecutive blocks, starting in the group `hint` maps to. A group with a run of `wanted`
+// free blocks is preferred; if there is none, the longest run of the first group with free blocks is allocated,
+// so `length` can be less than `wanted`.
+bool ewsfs_alloc_extent(ewsfs_allocator_t* allocator, uint64_t hint, uint64_t wanted, uint64_t* from, uint64_t* length);
+// Allocate up to `wanted` free blocks that start exactly at `from`, so an extent that ends there can grow in place.
+// Stops at the first used block or at the end of the group. Returns false if `from` itself isn't free.
+bool ewsfs_alloc_extend(ewsfs_allocator_t* allocator, uint64_t from, uint64_t wanted, uint64_t* length);
+uint64_t ewsfs_alloc_get_free_count(ewsfs_allocator_t* allocator);
+// Whether a block is in use. Blocks outside of the image count as used.
+bool ewsfs_alloc_is_used(ewsfs_allocator_t* allocator, uint64_t block_index);
+// The hint that keeps allocations in the group of `block_index`
+uint64_t ewsfs_alloc_hint_for_block(const ewsfs_allocator_t* allocator, uint64_t block_index);
@@ -0,0 +1,64 @@
+#include "base64.h"
+
+static const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t ewsfs_base64_encoded_size(size_t size) {
+    return (size + 2) / 3 * 4;
+}
+
+size_t ewsfs_base64_max_decoded_size(size_t length) {
+    return length / 4 * 3;
+}
+
+void ewsfs_base64_encode(const uint8_t* data, size_t size, char* text) {
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3) {
+        uint32_t group = (uint32_t) data[i] << 16 | (uint32_t) data[i + 1] << 8 | data[i + 2];
+        *text++ = base64_alphabet[group >> 18];
+        *text++ = base64_alphabet[(group >> 12) & 63];
+        *text++ = base64_alphabet[(group >> 6) & 63];
+        *text++ = base64_alphabet[group & 63];
+    }
+    if (i < size) {
+        uint32_t group = (uint32_t) data[i] << 16 | (i + 1 < size ? (uint32_t) data[i + 1] << 8 : 0);
+        *text++ = base64_alphabet[group >> 18];
+        *text++ = base64_alphabet[(group >> 12) & 63];
+        *text++ = i + 1 < size ? base64_alphabet[(group >> 6) & 63] : '=';
+        *text++ = '=';
+    }
+    *text = '\0';
+}
+
+static int ewsfs_base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+bool ewsfs_base64_decode(const char* text, size_t length, uint8_t* data, size_t* size) {
+    *size = 0;
+    if (length % 4 != 0)
+        return false;
+    for (size_t i = 0; i < length; i += 4) {
+        // Padding can only be at the end of the last group
+        size_t padding = text[i + 3] == '=' ? (text[i + 2] == '=' ? 2 : 1) : 0;
+        if (padding > 0 && i + 4 != length)
+            return false;
+        uint32_t group = 0;
+        for (size_t j = 0; j < 4 - padding; ++j) {
+            int value = ewsfs_base64_value(text[i + j]);
+            if (value < 0)
+                return false;
+            group |= (uint32_t) value << (18 - 6*j);
+        }
+        data[(*size)++] = group >> 16;
+        if (padding < 2)
+            data[(*size)++] = (group >> 8) & 0xFF;
+        if (padding < 1)
+            data[(*size)++] = group & 0xFF;
+    }
+    return true;
+}
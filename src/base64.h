@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Base64 with padding (RFC 4648), for file data that's kept in the FACT
+
+// The length of the text for `size` bytes, without the terminating zero
+size_t ewsfs_base64_encoded_size(size_t size);
+// The most bytes `length` characters of text can decode to
+size_t ewsfs_base64_max_decoded_size(size_t length);
+// Encode `size` bytes into `text`, which needs room for ewsfs_base64_encoded_size(size) + 1 characters
+void ewsfs_base64_encode(const uint8_t* data, size_t size, char* text);
+// Decode `length` characters of text into `data`, which needs room for ewsfs_base64_max_decoded_size(length) bytes.
+// Returns false if the text isn't valid base64.
+bool ewsfs_base64_decode(const char* text, size_t length, uint8_t* data, size_t* size);
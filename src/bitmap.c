@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include "bitmap.h"
+
+#define BITMAP_WORD_BITS 64
+
+static uint64_t bitmap_word_count(uint64_t bit_count) {
+    return (bit_count + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+// The bits from `from` up to `to` within one word, with 0 <= from < to <= 64
+static uint64_t bitmap_word_mask(uint64_t from, uint64_t to) {
+    uint64_t high = to == BITMAP_WORD_BITS ? ~0ull : (1ull << to) - 1;
+    return high & ~((1ull << from) - 1);
+}
+
+bool ewsfs_bitmap_init(ewsfs_bitmap_t* bitmap, uint64_t bit_count) {
+    *bitmap = (ewsfs_bitmap_t) {0};
+    bitmap->words = malloc((bitmap_word_count(bit_count) > 0 ? bitmap_word_count(bit_count) : 1)*sizeof(*bitmap->words));
+    if (!bitmap->words)
+        return false;
+    bitmap->bit_count = bit_count;
+    ewsfs_bitmap_clear(bitmap);
+    return true;
+}
+
+void ewsfs_bitmap_uninit(ewsfs_bitmap_t* bitmap) {
+    free(bitmap->words);
+    *bitmap = (ewsfs_bitmap_t) {0};
+}
+
+void ewsfs_bitmap_clear(ewsfs_bitmap_t* bitmap) {
+    uint64_t word_count = bitmap_word_count(bitmap->bit_count);
+    for (uint64_t i = 0; i < word_count; ++i)
+        bitmap->words[i] = 0;
+    // The bits past the end of the last word are marked as used, so the search never has to check for them
+    if (bitmap->bit_count % BITMAP_WORD_BITS != 0)
+        bitmap->words[word_count - 1] = bitmap_word_mask(bitmap->bit_count % BITMAP_WORD_BITS, BITMAP_WORD_BITS);
+    bitmap->free_count = bitmap->bit_count;
+    bitmap->cursor = 0;
+}
+
+bool ewsfs_bitmap_grow(ewsfs_bitmap_t* bitmap, uint64_t bit_count) {
+    if (bit_count <= bitmap->bit_count)
+        return bit_count == bitmap->bit_count;
+    uint64_t old_word_count = bitmap_word_count(bitmap->bit_count);
+    uint64_t word_count = bitmap_word_count(bit_count);
+    uint64_t* words = realloc(bitmap->words, word_count*sizeof(*words));
+    if (!words)
+        return false;
+    bitmap->words = words;
+    // The padding of the old last word becomes free bits, and the new last word gets its own padding
+    if (bitmap->bit_count % BITMAP_WORD_BITS != 0)
+        words[old_word_count - 1] &= ~bitmap_word_mask(bitmap->bit_count % BITMAP_WORD_BITS, BITMAP_WORD_BITS);
+    for (uint64_t i = old_word_count; i < word_count; ++i)
+        words[i] = 0;
+    if (bit_count % BITMAP_WORD_BITS != 0)
+        words[word_count - 1] |= bitmap_word_mask(bit_count % BITMAP_WORD_BITS, BITMAP_WORD_BITS);
+    bitmap->free_count += bit_count - bitmap->bit_count;
+    bitmap->bit_count = bit_count;
+    return true;
+}
+
+bool ewsfs_bitmap_is_used(const ewsfs_bitmap_t* bitmap, uint64_t index) {
+    if (index >= bitmap->bit_count)
+        return true;
+    return (bitmap->words[index / BITMAP_WORD_BITS] >> (index % BITMAP_WORD_BITS)) & 1;
+}
+
+// Set or clear a range of bits a word at a time, keeping free_count up to date
+static bool bitmap_set_range(ewsfs_bitmap_t* bitmap, uint64_t from, uint64_t length, bool used) {
+    if (from > bitmap->bit_count || length > bitmap->bit_count - from)
+        return false;
+    uint64_t to = from + length;
+    while (from < to) {
+        uint64_t word_index = from / BITMAP_WORD_BITS;
+        uint64_t word_end = (word_index + 1)*BITMAP_WORD_BITS < to ? (word_index + 1)*BITMAP_WORD_BITS : to;
+        uint64_t mask = bitmap_word_mask(from % BITMAP_WORD_BITS, word_end - word_index*BITMAP_WORD_BITS);
+        uint64_t* word = &bitmap->words[word_index];
+        if (used) {
+            bitmap->free_count -= __builtin_popcountll(mask & ~*word);
+            *word |= mask;
+        } else {
+            bitmap->free_count += __builtin_popcountll(mask & *word);
+            *word &= ~mask;
+        }
+        from = word_end;
+    }
+    return true;
+}
+
+bool ewsfs_bitmap_set_used(ewsfs_bitmap_t* bitmap, uint64_t from, uint64_t length) {
+    return bitmap_set_range(bitmap, from, length, true);
+}
+
+bool ewsfs_bitmap_set_free(ewsfs_bitmap_t* bitmap, uint64_t from, uint64_t length) {
+    return bitmap_set_range(bitmap, from, length, false);
+}
+
+bool ewsfs_bitmap_find_free(ewsfs_bitmap_t* bitmap, uint64_t* index) {
+    if (bitmap->free_count == 0)
+        return false;
+    uint64_t word_count = bitmap_word_count(bitmap->bit_count);
+    uint64_t start_word = bitmap->cursor / BITMAP_WORD_BITS;
+    // The word with the cursor is checked twice: first the bits from the cursor onwards, and after wrapping around the rest
+    for (uint64_t i = 0; i <= word_count; ++i) {
+        uint64_t word_index = (start_word + i) % word_count;
+        uint64_t free_bits = ~bitmap->words[word_index];
+        if (i == 0)
+            free_bits &= bitmap_word_mask(bitmap->cursor % BITMAP_WORD_BITS, BITMAP_WORD_BITS);
+        if (free_bits == 0)
+            continue;
+        *index = word_index*BITMAP_WORD_BITS + __builtin_ctzll(free_bits);
+        bitmap->cursor = *index + 1 < bitmap->bit_count ? *index + 1 : 0;
+        return true;
+    }
+    return false;
+}
+
+// The index of the first bit at or after `start` and before `end` that is free (or used, if `used` is set), or `end` if there is none
+static uint64_t bitmap_scan(const ewsfs_bitmap_t* bitmap, uint64_t start, uint64_t end, bool used) {
+    while (start < end) {
+        uint64_t word_index = start / BITMAP_WORD_BITS;
+        uint64_t bits = used ? bitmap->words[word_index] : ~bitmap->words[word_index];
+        bits &= bitmap_word_mask(start % BITMAP_WORD_BITS, BITMAP_WORD_BITS);
+        if (bits != 0) {
+            uint64_t index = word_index*BITMAP_WORD_BITS + __builtin_ctzll(bits);
+            return index < end ? index : end;
+        }
+        start = (word_index + 1)*BITMAP_WORD_BITS;
+    }
+    return end;
+}
+
+bool ewsfs_bitmap_find_free_run(ewsfs_bitmap_t* bitmap, uint64_t wanted, uint64_t* from, uint64_t* length) {
+    if (bitmap->free_count == 0 || wanted == 0)
+        return false;
+    uint64_t best_from = 0;
+    uint64_t best_length = 0;
+    // First from the cursor to the end, then from the start to the cursor
+    uint64_t passes[2][2] = {{bitmap->cursor, bitmap->bit_count}, {0, bitmap->cursor}};
+    for (int pass = 0; pass < 2; ++pass) {
+        uint64_t position = passes[pass][0];
+        uint64_t end = passes[pass][1];
+        while (position < end) {
+            uint64_t run_from = bitmap_scan(bitmap, position, end, false);
+            if (run_from == end)
+                break;
+            uint64_t run_to = bitmap_scan(bitmap, run_from, end, true);
+            if (run_to - run_from >= wanted) {
+                best_from = run_from;
+                best_length = wanted;
+                goto found;
+            }
+            if (run_to - run_from > best_length) {
+                best_from = run_from;
+                best_length = run_to - run_from;
+            }
+            position = run_to;
+        }
+    }
+    if (best_length == 0)
+        return false;
+found:
+    *from = best_from;
+    *length = best_length;
+    bitmap->cursor = best_from + best_length < bitmap->bit_count ? best_from + best_length : 0;
+    return true;
+}
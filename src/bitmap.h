@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// One bit per block, set if the block is in use
+typedef struct {
+    uint64_t* words;
+    uint64_t bit_count;
+    uint64_t free_count;
+    // Where the next search for a free bit starts, so allocations don't rescan the full start of the image every time
+    uint64_t cursor;
+} ewsfs_bitmap_t;
+
+bool ewsfs_bitmap_init(ewsfs_bitmap_t* bitmap, uint64_t bit_count);
+void ewsfs_bitmap_uninit(ewsfs_bitmap_t* bitmap);
+// Mark every bit as free
+void ewsfs_bitmap_clear(ewsfs_bitmap_t* bitmap);
+// Add free bits at the end, up to `bit_count` bits. The bits that are there already keep their state.
+bool ewsfs_bitmap_grow(ewsfs_bitmap_t* bitmap, uint64_t bit_count);
+bool ewsfs_bitmap_is_used(const ewsfs_bitmap_t* bitmap, uint64_t index);
+// Mark a range of bits as used or free. Returns false if the range doesn't fit in the bitmap.
+bool ewsfs_bitmap_set_used(ewsfs_bitmap_t* bitmap, uint64_t from, uint64_t length);
+bool ewsfs_bitmap_set_free(ewsfs_bitmap_t* bitmap, uint64_t from, uint64_t length);
+// Find a free bit, starting at the cursor and wrapping around. The bit isn't marked as used.
+bool ewsfs_bitmap_find_free(ewsfs_bitmap_t* bitmap, uint64_t* index);
+// Find a run of `wanted` free bits, starting at the cursor and wrapping around. If there is no run that long,
+// the longest free run is returned instead. The bits aren't marked as used.
+bool ewsfs_bitmap_find_free_run(ewsfs_bitmap_t* bitmap, uint64_t wanted, uint64_t* from, uint64_t* length);
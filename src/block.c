@@ -1,50 +1,408 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #define NOB_STRIP_PREFIX
 #include "nob.h"
 #include "block.h"
 #include "log.h"
 
 #define BLOCK_SIZE_RESERVED_BYTES 8
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-off_t get_file_size(FILE* file) {
+// The amount of bounce buffers for O_DIRECT, and how much each of them transfers at a time (rounded down to whole blocks)
+#define DIRECT_BUFFER_COUNT 8
+#define DIRECT_CHUNK_SIZE (64*1024)
+// Used if the file system doesn't tell us its direct I/O alignment; this works for any sector size up to 4K
+#define DIRECT_DEFAULT_ALIGNMENT 4096
+
+off_t get_file_size(int fd) {
     struct stat file_stat = {0};
-    if (fstat(fileno(file), &file_stat) != 0)
+    if (fstat(fd, &file_stat) != 0)
         return -1;
+    // st_size is 0 for a block device, so it's asked for its size instead
+    if (S_ISBLK(file_stat.st_mode)) {
+        uint64_t size = 0;
+        if (ioctl(fd, BLKGETSIZE64, &size) != 0)
+            return -1;
+        return size;
+    }
     return file_stat.st_size;
 }
 
+// Skip over the first `n` bytes of an iovec list: the buffers that were transferred completely
+// are dropped, and the one that was transferred partially is advanced into
+static struct iovec* iov_advance(struct iovec* iov, int* iov_count, size_t n) {
+    while (*iov_count > 0 && n >= iov->iov_len) {
+        n -= iov->iov_len;
+        ++iov;
+        --*iov_count;
+    }
+    if (*iov_count > 0) {
+        iov->iov_base = (uint8_t*) iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+    return iov;
+}
+
+// Read or write exactly the size of the iovec list at `offset`, retrying on short transfers and EINTR.
+// Returns 0 on success, or an errno value on failure (EFAULT if the end of the file was reached).
+// The iovec array is modified while advancing over partial transfers.
+static int preadv_all(int fd, struct iovec* iov, int iov_count, off_t offset) {
+    while (iov_count > 0) {
+        ssize_t n = preadv(fd, iov, iov_count < IOV_MAX ? iov_count : IOV_MAX, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (n == 0)
+            return EFAULT;
+        offset += n;
+        iov = iov_advance(iov, &iov_count, n);
+    }
+    return 0;
+}
+
+static int pwritev_all(int fd, struct iovec* iov, int iov_count, off_t offset) {
+    while (iov_count > 0) {
+        ssize_t n = pwritev(fd, iov, iov_count < IOV_MAX ? iov_count : IOV_MAX, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (n == 0)
+            return EFAULT;
+        offset += n;
+        iov = iov_advance(iov, &iov_count, n);
+    }
+    return 0;
+}
+
+// Copy `size` bytes between a flat buffer and an iovec list, starting `offset` bytes into the iovec list
+static void iov_copy(const struct iovec* iov, int iov_count, size_t offset, uint8_t* buffer, size_t size, bool to_iov) {
+    for (int i = 0; i < iov_count && size > 0; ++i) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        size_t n = iov[i].iov_len - offset < size ? iov[i].iov_len - offset : size;
+        uint8_t* base = (uint8_t*) iov[i].iov_base + offset;
+        if (to_iov)
+            memcpy(base, buffer, n);
+        else
+            memcpy(buffer, base, n);
+        buffer += n;
+        size -= n;
+        offset = 0;
+    }
+}
+
+static size_t direct_get_alignment(int fd) {
+#ifdef STATX_DIOALIGN
+    struct statx file_statx = {0};
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &file_statx) == 0 && (file_statx.stx_mask & STATX_DIOALIGN)
+        && file_statx.stx_dio_offset_align > 0) {
+        // One alignment for both the buffers and the file offsets keeps things simple
+        return file_statx.stx_dio_offset_align > file_statx.stx_dio_mem_align ? file_statx.stx_dio_offset_align : file_statx.stx_dio_mem_align;
+    }
+#endif
+    // Older kernels don't tell, but a block device knows its logical sector size
+    struct stat file_stat = {0};
+    int sector_size = 0;
+    if (fstat(fd, &file_stat) == 0 && S_ISBLK(file_stat.st_mode) && ioctl(fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0)
+        return sector_size;
+    return DIRECT_DEFAULT_ALIGNMENT;
+}
+
+static void direct_buffers_uninit(ewsfs_block_buffer_pool_t* pool) {
+    if (pool->free_buffers) {
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->available);
+    }
+    for (size_t i = 0; i < pool->free_count; ++i)
+        free(pool->free_buffers[i]);
+    free(pool->free_buffers);
+    *pool = (ewsfs_block_buffer_pool_t) {0};
+}
+
+static bool direct_buffers_init(ewsfs_block_buffer_pool_t* pool, size_t count, size_t chunk_size, size_t alignment) {
+    *pool = (ewsfs_block_buffer_pool_t) {0};
+    pool->free_buffers = malloc(count*sizeof(*pool->free_buffers));
+    if (!pool->free_buffers)
+        return false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    pool->chunk_size = chunk_size;
+    // An unaligned chunk can stick out of its aligned part by up to one sector in total
+    pool->buffer_size = (chunk_size + alignment - 1) / alignment * alignment + alignment;
+    for (; pool->buffer_count < count; ++pool->buffer_count) {
+        void* buffer = NULL;
+        if (posix_memalign(&buffer, alignment, pool->buffer_size) != 0) {
+            direct_buffers_uninit(pool);
+            return false;
+        }
+        pool->free_buffers[pool->free_count++] = buffer;
+    }
+    return true;
+}
+
+static uint8_t* direct_buffers_acquire(ewsfs_block_buffer_pool_t* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->free_count == 0)
+        pthread_cond_wait(&pool->available, &pool->lock);
+    uint8_t* buffer = pool->free_buffers[--pool->free_count];
+    pthread_mutex_unlock(&pool->lock);
+    return buffer;
+}
+
+static void direct_buffers_release(ewsfs_block_buffer_pool_t* pool, uint8_t* buffer) {
+    pthread_mutex_lock(&pool->lock);
+    pool->free_buffers[pool->free_count++] = buffer;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Read an aligned part of the image. The end of the image doesn't have to be aligned, so whatever lies past it is zeroed.
+static int direct_pread(ewsfs_block_device_t* device, uint8_t* buffer, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = pread(device->fd, buffer, size, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        buffer += n;
+        size -= n;
+        offset += n;
+        if (n == 0 || (device->direct_image_size > 0 && offset >= device->direct_image_size)) {
+            memset(buffer, 0, size);
+            break;
+        }
+    }
+    return 0;
+}
+
+// Transfer through the aligned bounce buffers, a chunk at a time
+static int direct_transfer(ewsfs_block_device_t* device, const struct iovec* iov, int iov_count, off_t offset, bool write) {
+    size_t size = 0;
+    for (int i = 0; i < iov_count; ++i)
+        size += iov[i].iov_len;
+    size_t alignment = device->direct_alignment;
+
+    // Until the block size is known (while reading the reserved bytes), there are no pooled buffers yet
+    ewsfs_block_buffer_pool_t* pool = &device->direct_buffers;
+    bool pooled = pool->buffer_count > 0;
+    size_t chunk_size = pooled ? pool->chunk_size : size;
+    uint8_t* buffer = NULL;
+    if (pooled)
+        buffer = direct_buffers_acquire(pool);
+    else if (posix_memalign((void**) &buffer, alignment, (size + alignment - 1) / alignment * alignment + alignment) != 0)
+        return ENOMEM;
+
+    int error = 0;
+    for (size_t done = 0; done < size && !error; done += chunk_size) {
+        size_t n = size - done < chunk_size ? size - done : chunk_size;
+        off_t from = offset + done;
+        off_t aligned_from = from - from % alignment;
+        off_t aligned_to = (from + n + alignment - 1) / alignment * alignment;
+        size_t span = aligned_to - aligned_from;
+        size_t head = from - aligned_from;
+
+        if (!write) {
+            error = direct_pread(device, buffer, span, aligned_from);
+            if (!error)
+                iov_copy(iov, iov_count, done, buffer + head, n, true);
+            continue;
+        }
+
+        // Whole sectors only hold this write's bytes, so only a span with a partial sector at an edge needs its locks
+        bool partial_tail = (off_t) (from + n) < aligned_to;
+        size_t first_lock = (aligned_from / alignment) % EWSFS_BLOCK_DIRECT_LOCKS;
+        size_t last_lock = ((aligned_to - alignment) / alignment) % EWSFS_BLOCK_DIRECT_LOCKS;
+        if (first_lock > last_lock) {
+            size_t swap = first_lock;
+            first_lock = last_lock;
+            last_lock = swap;
+        }
+        bool locked = head > 0 || partial_tail;
+        if (locked) {
+            pthread_mutex_lock(&device->direct_locks[first_lock]);
+            if (last_lock != first_lock)
+                pthread_mutex_lock(&device->direct_locks[last_lock]);
+        }
+
+        // Keep the parts of the edge sectors that belong to the neighbouring blocks
+        if (head > 0)
+            error = direct_pread(device, buffer, alignment, aligned_from);
+        if (!error && partial_tail && (head == 0 || span > alignment))
+            error = direct_pread(device, buffer + span - alignment, alignment, aligned_to - alignment);
+        if (!error) {
+            iov_copy(iov, iov_count, done, buffer + head, n, false);
+            struct iovec buffer_iov = {buffer, span};
+            error = pwritev_all(device->fd, &buffer_iov, 1, aligned_from);
+        }
+        // Writing the last sector may have made the image longer than it was. That sector is partial,
+        // so its lock is still held.
+        if (device->direct_image_size > 0 && aligned_to > device->direct_image_size
+            && ftruncate(device->fd, device->direct_image_size) != 0 && !error)
+            error = errno;
+
+        if (locked) {
+            if (last_lock != first_lock)
+                pthread_mutex_unlock(&device->direct_locks[last_lock]);
+            pthread_mutex_unlock(&device->direct_locks[first_lock]);
+        }
+    }
+
+    if (pooled)
+        direct_buffers_release(pool, buffer);
+    else
+        free(buffer);
+    return error;
+}
+
+static int ewsfs_block_device_read(ewsfs_block_device_t* device, const struct iovec* iov, int iov_count, off_t offset);
+
 uint64_t ewsfs_block_size = 0;
 uint64_t ewsfs_block_count = 0;
-bool ewsfs_block_read_size(FILE* file) {
-    ewsfs_block_size = 0;
-    // Go to the beginning of the file
-    if (fseek(file, 0, SEEK_SET) != 0)
+
+// The amount of blocks that fit in an image of `file_size` bytes, after the reserved bytes
+static uint64_t ewsfs_block_count_for_size(uint64_t block_size, uint64_t file_size) {
+    uint64_t block_count = file_size / block_size;
+    if (block_count > 0 && block_count * block_size + BLOCK_SIZE_RESERVED_BYTES > file_size)
+        --block_count;
+    return block_count;
+}
+
+// Read the block size from the reserved bytes of an image, and calculate how many blocks fit in it
+static bool ewsfs_block_read_image_size(ewsfs_block_device_t* device, uint64_t* block_size, uint64_t* block_count) {
+    *block_size = 0;
+    // Read the reserved bytes at the beginning of the file
+    uint8_t size_bytes[BLOCK_SIZE_RESERVED_BYTES];
+    struct iovec size_iov = {size_bytes, BLOCK_SIZE_RESERVED_BYTES};
+    if (ewsfs_block_device_read(device, &size_iov, 1, 0) != 0)
         return false;
     // Example with BLOCK_SIZE_RESERVED_BYTES=2:
     //   First bytes of file (hex): be ef
     //   Iteration 1:
-    //     i = 1;  getc(file) = 0xbe
-    //     ewsfs_block_size | 0xbe << 1*8 = 0x0000 | 0xbe00 = 0xbe00
+    //     i = 1;  size_bytes[0] = 0xbe
+    //     block_size | 0xbe << 1*8 = 0x0000 | 0xbe00 = 0xbe00
     //   Iteration 2:
-    //     i = 0;  getc(file) = 0xef
-    //     ewsfs_block_size | 0xef << 0*8 = 0xbe00 | 0x00ef = 0xbeef
-    for (char i = BLOCK_SIZE_RESERVED_BYTES-1; i >= 0; --i) {
-        ewsfs_block_size |= getc(file) << i*8;
+    //     i = 0;  size_bytes[1] = 0xef
+    //     block_size | 0xef << 0*8 = 0xbe00 | 0x00ef = 0xbeef
+    for (int i = BLOCK_SIZE_RESERVED_BYTES-1; i >= 0; --i) {
+        *block_size |= (uint64_t) size_bytes[BLOCK_SIZE_RESERVED_BYTES-1 - i] << i*8;
     }
+    if (*block_size == 0)
+        return false;
 
-    off_t file_size = get_file_size(file);
+    off_t file_size = get_file_size(device->fd);
     if (file_size < 0)
         return false;
     // Calculate the amount of blocks based on the file size
-    ewsfs_block_count = file_size / ewsfs_block_size;
-    if (ewsfs_block_count * ewsfs_block_size + BLOCK_SIZE_RESERVED_BYTES > (uint64_t) file_size)
-        --ewsfs_block_count;
+    *block_count = ewsfs_block_count_for_size(*block_size, file_size);
+    return true;
+}
 
+static bool ewsfs_block_init_direct_buffers(ewsfs_block_device_t* device) {
+    if (!device->direct || device->direct_buffers.buffer_count > 0)
+        return true;
+    size_t blocks_per_chunk = DIRECT_CHUNK_SIZE / ewsfs_block_size > 0 ? DIRECT_CHUNK_SIZE / ewsfs_block_size : 1;
+    return direct_buffers_init(&device->direct_buffers, DIRECT_BUFFER_COUNT, blocks_per_chunk*ewsfs_block_size, device->direct_alignment);
+}
+
+bool ewsfs_block_read_size(ewsfs_block_device_t* device) {
+    ewsfs_block_size = 0;
+    if (device->member_count == 0) {
+        if (!ewsfs_block_read_image_size(device, &ewsfs_block_size, &ewsfs_block_count))
+            return false;
+        return ewsfs_block_init_direct_buffers(device);
+    }
+
+    // Every image gets as many blocks as the smallest one has, in whole stripes if they're striped
+    uint64_t member_blocks = 0;
+    for (size_t i = 0; i < device->member_count; ++i) {
+        uint64_t block_size = 0;
+        uint64_t block_count = 0;
+        if (!ewsfs_block_read_image_size(&device->members[i], &block_size, &block_count))
+            return false;
+        if (i > 0 && block_size != ewsfs_block_size) {
+            nob_log(ERROR, "Image %zu has a block size of %"PRIu64" bytes, the first image %"PRIu64" bytes", i + 1, block_size, ewsfs_block_size);
+            return false;
+        }
+        ewsfs_block_size = block_size;
+        if (i == 0 || block_count < member_blocks)
+            member_blocks = block_count;
+    }
+    if (device->layout == EWSFS_BLOCK_LAYOUT_MIRROR) {
+        ewsfs_block_count = member_blocks;
+    } else {
+        member_blocks -= member_blocks % device->stripe_blocks;
+        ewsfs_block_count = member_blocks*device->member_count;
+    }
+    for (size_t i = 0; i < device->member_count; ++i) {
+        if (!ewsfs_block_init_direct_buffers(&device->members[i]))
+            return false;
+    }
     return true;
 }
 
+// Take the size an image has now, and how many blocks fit in it. The mapping of EWSFS_BLOCK_BACKEND_MMAP
+// is made bigger if the image grew, it's never made smaller.
+static int ewsfs_block_grow_image(ewsfs_block_device_t* device, uint64_t* block_count) {
+    off_t file_size = get_file_size(device->fd);
+    if (file_size < 0)
+        return errno;
+    *block_count = ewsfs_block_count_for_size(ewsfs_block_size, file_size);
+    if (device->direct && file_size > device->direct_image_size)
+        device->direct_image_size = file_size;
+    if (device->backend == EWSFS_BLOCK_BACKEND_MMAP && (size_t) file_size > device->map_size) {
+        // A dirty range stays the same, and an empty one stays empty
+        uint8_t* map = mremap(device->map, device->map_size, file_size, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED)
+            return errno;
+        device->map = map;
+        device->map_size = file_size;
+    }
+    return 0;
+}
+
+int ewsfs_block_grow(ewsfs_block_device_t* device, uint64_t* block_count) {
+    *block_count = 0;
+    if (device->member_count == 0) {
+        int error = ewsfs_block_grow_image(device, block_count);
+        if (error)
+            return error;
+    }
+    for (size_t i = 0; i < device->member_count; ++i) {
+        uint64_t member_blocks = 0;
+        int error = ewsfs_block_grow_image(&device->members[i], &member_blocks);
+        if (error)
+            return error;
+        if (i == 0 || member_blocks < *block_count)
+            *block_count = member_blocks;
+    }
+    if (device->member_count > 0 && device->layout == EWSFS_BLOCK_LAYOUT_STRIPE)
+        *block_count = *block_count / device->stripe_blocks * device->stripe_blocks * device->member_count;
+    // Blocks past the new end could still be in use
+    if (*block_count < ewsfs_block_count)
+        return EINVAL;
+    ewsfs_block_count = *block_count;
+    return 0;
+}
+
 void ewsfs_block_set_size(uint64_t block_size) {
     ewsfs_block_size = block_size;
 }
@@ -59,46 +417,1147 @@ uint64_t ewsfs_block_get_count() {
     return ewsfs_block_count;
 }
 
-int ewsfs_block_read(FILE* file, uint64_t block_index, uint8_t* buffer) {
-    if (block_index >= ewsfs_block_count)
+bool ewsfs_block_backend_from_name(const char* name, ewsfs_block_backend_t* backend) {
+    if (strcmp(name, "pio") == 0) {
+        *backend = EWSFS_BLOCK_BACKEND_PIO;
+        return true;
+    }
+    if (strcmp(name, "mmap") == 0) {
+        *backend = EWSFS_BLOCK_BACKEND_MMAP;
+        return true;
+    }
+    if (strcmp(name, "uring") == 0) {
+        *backend = EWSFS_BLOCK_BACKEND_URING;
+        return true;
+    }
+    return false;
+}
+
+bool ewsfs_block_open(ewsfs_block_device_t* device, const char* path, const ewsfs_block_options_t* options) {
+    *device = (ewsfs_block_device_t) {0};
+    device->backend = options->backend;
+    if (options->direct && options->backend == EWSFS_BLOCK_BACKEND_MMAP) {
+        nob_log(ERROR, "O_DIRECT can't be used with the mmap backend");
+        return false;
+    }
+    if (options->direct && options->backend == EWSFS_BLOCK_BACKEND_URING) {
+        // The blocks in a batch aren't sector aligned, so they'd all need bounce buffers anyway
+        nob_log(WARNING, "O_DIRECT can't be used with the uring backend, using pread/pwrite");
+        device->backend = EWSFS_BLOCK_BACKEND_PIO;
+    }
+
+    // O_EXCL on a block device makes the open fail if the device is mounted, or opened exclusively by someone else
+    struct stat path_stat = {0};
+    bool block_device = stat(path, &path_stat) == 0 && S_ISBLK(path_stat.st_mode);
+    int flags = O_RDWR | (options->exclusive && block_device ? O_EXCL : 0);
+    device->fd = open(path, flags | (options->direct ? O_DIRECT : 0));
+    if (device->fd < 0 && options->direct && errno == EINVAL) {
+        // Not every file system supports O_DIRECT
+        nob_log(WARNING, "%s doesn't support O_DIRECT, using the page cache", path);
+        device->fd = open(path, flags);
+    } else if (device->fd >= 0 && options->direct) {
+        device->direct = true;
+        device->direct_alignment = direct_get_alignment(device->fd);
+        device->direct_image_size = get_file_size(device->fd);
+    }
+    if (device->fd < 0) {
+        nob_log(ERROR, "Couldn't open %s: %s", path, strerror(errno));
+        return false;
+    }
+    // An image file is locked instead, which only keeps other ewsfs mounts out
+    if (options->exclusive && !block_device && flock(device->fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK)
+            nob_log(ERROR, "%s is already in use by another mount", path);
+        else
+            nob_log(ERROR, "Couldn't lock %s: %s", path, strerror(errno));
+        close(device->fd);
+        return false;
+    }
+    pthread_mutex_init(&device->dirty_lock, NULL);
+    for (size_t i = 0; i < EWSFS_BLOCK_DIRECT_LOCKS; ++i)
+        pthread_mutex_init(&device->direct_locks[i], NULL);
+
+    switch (device->backend) {
+        case EWSFS_BLOCK_BACKEND_PIO:
+            break;
+        case EWSFS_BLOCK_BACKEND_URING:
+            if (!ewsfs_uring_init(&device->uring, options->queue_depth > 0 ? options->queue_depth : 1)) {
+                // The kernel may not support io_uring, or it may be disabled
+                nob_log(WARNING, "Couldn't set up io_uring (%s), falling back to pread/pwrite", strerror(errno));
+                device->backend = EWSFS_BLOCK_BACKEND_PIO;
+            }
+            break;
+        case EWSFS_BLOCK_BACKEND_MMAP: {
+            off_t file_size = get_file_size(device->fd);
+            if (file_size <= 0) {
+                nob_log(ERROR, "Couldn't get the size of %s", path);
+                close(device->fd);
+                return false;
+            }
+            // Map the whole image, including the reserved bytes, so block offsets are the same as in the file
+            device->map_size = file_size;
+            device->map = mmap(NULL, device->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, device->fd, 0);
+            if (device->map == MAP_FAILED) {
+                nob_log(ERROR, "Couldn't map %s: %s", path, strerror(errno));
+                close(device->fd);
+                return false;
+            }
+            device->dirty_from = device->map_size;
+            device->dirty_to = 0;
+        } break;
+    }
+    return true;
+}
+
+static void ewsfs_block_stop_worker(ewsfs_block_device_t* member);
+
+bool ewsfs_block_open_images(ewsfs_block_device_t* device, const char* const* paths, size_t path_count, const ewsfs_block_options_t* options) {
+    if (path_count == 1 && options->layout != EWSFS_BLOCK_LAYOUT_MIRROR)
+        return ewsfs_block_open(device, paths[0], options);
+    *device = (ewsfs_block_device_t) {0};
+    device->fd = -1;
+    device->backend = options->backend;
+    device->layout = options->layout;
+    device->stripe_blocks = options->stripe_blocks > 0 ? options->stripe_blocks : 1;
+    device->members = calloc(path_count, sizeof(*device->members));
+    if (!device->members)
+        return false;
+    for (; device->member_count < path_count; ++device->member_count) {
+        ewsfs_block_device_t* member = &device->members[device->member_count];
+        if (!ewsfs_block_open(member, paths[device->member_count], options)) {
+            ewsfs_block_close(device);
+            return false;
+        }
+    }
+    return true;
+}
+
+void ewsfs_block_get_layout(ewsfs_block_device_t* device, ewsfs_block_layout_t* layout, uint64_t* images, uint64_t* stripe_blocks) {
+    *layout = device->layout;
+    *images = device->member_count > 0 ? device->member_count : 1;
+    *stripe_blocks = device->stripe_blocks;
+}
+
+bool ewsfs_block_pin_replica(ewsfs_block_device_t* device, size_t replica) {
+    if (device->layout != EWSFS_BLOCK_LAYOUT_MIRROR || replica >= device->member_count || device->members[replica].failed)
+        return false;
+    device->pinned = true;
+    device->pinned_member = replica;
+    return true;
+}
+
+void ewsfs_block_unpin_replica(ewsfs_block_device_t* device) {
+    device->pinned = false;
+}
+
+#define COPY_REPLICA_BLOCKS 256
+
+int ewsfs_block_copy_replica(ewsfs_block_device_t* device, size_t from, size_t to, uint64_t block_index, uint64_t block_count) {
+    if (device->layout != EWSFS_BLOCK_LAYOUT_MIRROR || from >= device->member_count || to >= device->member_count)
+        return EINVAL;
+    uint64_t chunk_blocks = block_count < COPY_REPLICA_BLOCKS ? block_count : COPY_REPLICA_BLOCKS;
+    uint8_t* buffer = malloc(chunk_blocks*EWSFS_BLOCK_SIZE);
+    if (!buffer)
+        return ENOMEM;
+    int error = 0;
+    for (uint64_t done = 0; done < block_count && !error; done += chunk_blocks) {
+        uint64_t count = block_count - done < chunk_blocks ? block_count - done : chunk_blocks;
+        struct iovec iov = {buffer, count*EWSFS_BLOCK_SIZE};
+        error = ewsfs_block_read_range(&device->members[from], block_index + done, count, &iov, 1);
+        if (!error)
+            error = ewsfs_block_write_range(&device->members[to], block_index + done, count, &iov, 1);
+    }
+    free(buffer);
+    return error;
+}
+
+void ewsfs_block_fail_replica(ewsfs_block_device_t* device, size_t replica) {
+    if (device->layout == EWSFS_BLOCK_LAYOUT_MIRROR && replica < device->member_count)
+        device->members[replica].failed = true;
+}
+
+void ewsfs_block_get_replicas(ewsfs_block_device_t* device, uint64_t* replicas, uint64_t* failed) {
+    *replicas = 1;
+    *failed = 0;
+    if (device->member_count == 0 || device->layout != EWSFS_BLOCK_LAYOUT_MIRROR)
+        return;
+    *replicas = device->member_count;
+    for (size_t i = 0; i < device->member_count; ++i)
+        *failed += device->members[i].failed;
+}
+
+uint64_t ewsfs_block_get_blocks_read(ewsfs_block_device_t* device, size_t image) {
+    if (image >= device->member_count)
+        return 0;
+    return __atomic_load_n(&device->members[image].blocks_read, __ATOMIC_RELAXED);
+}
+
+void ewsfs_block_close(ewsfs_block_device_t* device) {
+    ewsfs_block_stop_discard(device);
+    ewsfs_block_sync(device);
+    if (device->cache) {
+        ewsfs_cache_uninit(device->cache);
+        free(device->cache);
+        device->cache = NULL;
+    }
+    if (device->members) {
+        for (size_t i = 0; i < device->member_count; ++i) {
+            ewsfs_block_stop_worker(&device->members[i]);
+            ewsfs_block_close(&device->members[i]);
+        }
+        free(device->members);
+        device->members = NULL;
+        device->member_count = 0;
+        return;
+    }
+    if (device->map)
+        munmap(device->map, device->map_size);
+    // The ring may still be there after a fall back to pread/pwrite
+    ewsfs_uring_uninit(&device->uring);
+    direct_buffers_uninit(&device->direct_buffers);
+    pthread_mutex_destroy(&device->dirty_lock);
+    for (size_t i = 0; i < EWSFS_BLOCK_DIRECT_LOCKS; ++i)
+        pthread_mutex_destroy(&device->direct_locks[i]);
+    close(device->fd);
+    device->fd = -1;
+    device->map = NULL;
+}
+
+// The backend can change from EWSFS_BLOCK_BACKEND_URING to EWSFS_BLOCK_BACKEND_PIO while other threads use the device
+static ewsfs_block_backend_t ewsfs_block_get_backend(ewsfs_block_device_t* device) {
+    return __atomic_load_n(&device->backend, __ATOMIC_ACQUIRE);
+}
+
+int ewsfs_block_sync(ewsfs_block_device_t* device) {
+    if (device->cache) {
+        int error = ewsfs_cache_flush(device->cache);
+        if (error)
+            return error;
+    }
+    for (size_t i = 0; i < device->member_count; ++i) {
+        if (device->members[i].failed)
+            continue;
+        int error = ewsfs_block_sync(&device->members[i]);
+        if (error)
+            return error;
+    }
+    if (device->member_count > 0)
+        return 0;
+
+    switch (ewsfs_block_get_backend(device)) {
+        case EWSFS_BLOCK_BACKEND_PIO:
+        case EWSFS_BLOCK_BACKEND_URING:
+            // pwrite and io_uring writes already hand the data to the kernel
+            return 0;
+        case EWSFS_BLOCK_BACKEND_MMAP: {
+            pthread_mutex_lock(&device->dirty_lock);
+            size_t from = device->dirty_from;
+            size_t to = device->dirty_to;
+            device->dirty_from = device->map_size;
+            device->dirty_to = 0;
+            pthread_mutex_unlock(&device->dirty_lock);
+            if (from >= to)
+                return 0;
+
+            // msync needs a page aligned address
+            size_t page_size = sysconf(_SC_PAGESIZE);
+            from -= from % page_size;
+            if (msync(device->map + from, to - from, MS_SYNC) != 0)
+                return errno;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Copy between the mapping and the buffers, and remember what was written for the next ewsfs_block_sync
+static int mmap_transfer(ewsfs_block_device_t* device, const struct iovec* iov, int iov_count, size_t offset, bool write) {
+    size_t size = 0;
+    for (int i = 0; i < iov_count; ++i)
+        size += iov[i].iov_len;
+    if (offset + size > device->map_size)
         return EFAULT;
-    // Try to go to the position in the file corresponding to block_index
-    if (fseek(file, BLOCK_SIZE_RESERVED_BYTES + block_index*EWSFS_BLOCK_SIZE, SEEK_SET) != 0)
-        return errno;
 
-    return fread(buffer, EWSFS_BLOCK_SIZE, 1, file) == 1 ? 0 : EFAULT;
+    size_t position = offset;
+    for (int i = 0; i < iov_count; ++i) {
+        if (write)
+            memcpy(device->map + position, iov[i].iov_base, iov[i].iov_len);
+        else
+            memcpy(iov[i].iov_base, device->map + position, iov[i].iov_len);
+        position += iov[i].iov_len;
+    }
+
+    if (write) {
+        pthread_mutex_lock(&device->dirty_lock);
+        if (offset < device->dirty_from)
+            device->dirty_from = offset;
+        if (offset + size > device->dirty_to)
+            device->dirty_to = offset + size;
+        pthread_mutex_unlock(&device->dirty_lock);
+    }
+    return 0;
+}
+
+static int ewsfs_block_members_transfer(ewsfs_block_device_t* device, const ewsfs_block_range_t* ranges, size_t range_count, bool write);
+
+// A transfer at a byte offset of a device with several images, which has to be whole blocks
+static int ewsfs_block_members_transfer_at(ewsfs_block_device_t* device, const struct iovec* iov, int iov_count, off_t offset, bool write) {
+    uint64_t size = 0;
+    for (int i = 0; i < iov_count; ++i)
+        size += iov[i].iov_len;
+    if (offset < BLOCK_SIZE_RESERVED_BYTES || (offset - BLOCK_SIZE_RESERVED_BYTES) % EWSFS_BLOCK_SIZE != 0 || size % EWSFS_BLOCK_SIZE != 0)
+        return EINVAL;
+    ewsfs_block_range_t range = {(offset - BLOCK_SIZE_RESERVED_BYTES) / EWSFS_BLOCK_SIZE, size / EWSFS_BLOCK_SIZE, iov, iov_count};
+    return ewsfs_block_members_transfer(device, &range, 1, write);
 }
 
-int ewsfs_block_write(FILE* file, uint64_t block_index, const uint8_t* buffer) {
-    if (block_index >= ewsfs_block_count)
+static int ewsfs_block_device_read(ewsfs_block_device_t* device, const struct iovec* iov, int iov_count, off_t offset) {
+    if (device->member_count > 0)
+        return ewsfs_block_members_transfer_at(device, iov, iov_count, offset, false);
+    switch (ewsfs_block_get_backend(device)) {
+        case EWSFS_BLOCK_BACKEND_PIO:
+        case EWSFS_BLOCK_BACKEND_URING: {
+            if (device->direct)
+                return direct_transfer(device, iov, iov_count, offset, false);
+            // preadv_all advances through the iovecs, so give it a copy
+            struct iovec iov_copy[iov_count];
+            memcpy(iov_copy, iov, iov_count*sizeof(*iov));
+            return preadv_all(device->fd, iov_copy, iov_count, offset);
+        }
+        case EWSFS_BLOCK_BACKEND_MMAP:
+            return mmap_transfer(device, iov, iov_count, offset, false);
+    }
+    return EINVAL;
+}
+
+static int ewsfs_block_device_write(ewsfs_block_device_t* device, const struct iovec* iov, int iov_count, off_t offset) {
+    if (device->member_count > 0)
+        return ewsfs_block_members_transfer_at(device, iov, iov_count, offset, true);
+    switch (ewsfs_block_get_backend(device)) {
+        case EWSFS_BLOCK_BACKEND_PIO:
+        case EWSFS_BLOCK_BACKEND_URING: {
+            if (device->direct)
+                return direct_transfer(device, iov, iov_count, offset, true);
+            struct iovec iov_copy[iov_count];
+            memcpy(iov_copy, iov, iov_count*sizeof(*iov));
+            return pwritev_all(device->fd, iov_copy, iov_count, offset);
+        }
+        case EWSFS_BLOCK_BACKEND_MMAP:
+            return mmap_transfer(device, iov, iov_count, offset, true);
+    }
+    return EINVAL;
+}
+
+int ewsfs_block_read(ewsfs_block_device_t* device, uint64_t block_index, uint8_t* buffer) {
+    struct iovec iov = {buffer, EWSFS_BLOCK_SIZE};
+    return ewsfs_block_read_range(device, block_index, 1, &iov, 1);
+}
+
+int ewsfs_block_write(ewsfs_block_device_t* device, uint64_t block_index, const uint8_t* buffer) {
+    struct iovec iov = {(uint8_t*) buffer, EWSFS_BLOCK_SIZE};
+    return ewsfs_block_write_range(device, block_index, 1, &iov, 1);
+}
+
+static bool ewsfs_block_range_valid(uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count) {
+    if (block_count == 0 || block_index >= ewsfs_block_count || block_count > ewsfs_block_count - block_index)
+        return false;
+    // The buffers need to cover the range exactly
+    uint64_t iov_size = 0;
+    for (int i = 0; i < iov_count; ++i)
+        iov_size += iov[i].iov_len;
+    return iov_size == block_count*EWSFS_BLOCK_SIZE;
+}
+
+int ewsfs_block_read_range(ewsfs_block_device_t* device, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count) {
+    if (!ewsfs_block_range_valid(block_index, block_count, iov, iov_count))
         return EFAULT;
+    // The cache holds the blocks of whichever image they were read from, so a pinned image is read past it
+    ewsfs_cache_t* cache = device->pinned ? NULL : device->cache;
+    if (cache && ewsfs_cache_read_range(cache, block_index, block_count, iov, iov_count))
+        return 0;
 
-    if (fseek(file, BLOCK_SIZE_RESERVED_BYTES + block_index*EWSFS_BLOCK_SIZE, SEEK_SET) != 0)
-        return errno;
+    int error = ewsfs_block_device_read(device, iov, iov_count, BLOCK_SIZE_RESERVED_BYTES + block_index*EWSFS_BLOCK_SIZE);
+    if (!error && cache)
+        ewsfs_cache_fill_range(cache, block_index, block_count, iov, iov_count);
+    return error;
+}
 
-    return fwrite(buffer, EWSFS_BLOCK_SIZE, 1, file) == 1 ? 0 : EFAULT;
+int ewsfs_block_write_range(ewsfs_block_device_t* device, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count) {
+    if (!ewsfs_block_range_valid(block_index, block_count, iov, iov_count))
+        return EFAULT;
+    // Small writes are kept in the cache until the next commit point. Ranges that would push out
+    // a large part of the cache are written to the device directly, so they keep their single pwritev.
+    if (device->cache && block_count*2 <= device->cache->capacity)
+        return ewsfs_cache_write_range(device->cache, block_index, block_count, iov, iov_count);
+
+    int error = ewsfs_block_device_write(device, iov, iov_count, BLOCK_SIZE_RESERVED_BYTES + block_index*EWSFS_BLOCK_SIZE);
+    if (!error && device->cache)
+        ewsfs_cache_write_through_range(device->cache, block_index, block_count, iov, iov_count);
+    return error;
 }
 
-bool ewsfs_block_get_next_free_index(ewsfs_block_index_list_t* used_block_indexes, uint64_t* next_free_index) {
-    uint64_t index = 0;
-    for (size_t i = 0; i < used_block_indexes->count; ++i) {
-        if (index == used_block_indexes->items[i]) {
-            ++index;
-            // If used_block_indexes is out of order (e.g. [0, 1, 3, 5, 2, 8]), we don't want to accidentaly
-            // use an index that is actually already in use (in the example, 3 would be chosen because
-            // we went past it while index was still 2). Because I'm lazy, I used this inefficient solution.
-            // TODO: make this better
-            i = 0;
+static int ewsfs_block_cache_write_back(void* context, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count) {
+    (void) block_count;
+    return ewsfs_block_device_write(context, iov, iov_count, BLOCK_SIZE_RESERVED_BYTES + block_index*EWSFS_BLOCK_SIZE);
+}
+
+// Submit a batch through io_uring, and finish any short transfers synchronously.
+// If io_uring itself fails, the device falls back to pread/pwrite for good. The ring stays until
+// ewsfs_block_close, since other threads may still be in ewsfs_uring_submit.
+static int ewsfs_block_uring_transfer(ewsfs_block_device_t* device, const ewsfs_block_range_t* ranges, size_t range_count, bool write) {
+    ewsfs_uring_request_t* requests = malloc(range_count*sizeof(*requests));
+    if (!requests)
+        return ENOMEM;
+    for (size_t i = 0; i < range_count; ++i) {
+        requests[i] = (ewsfs_uring_request_t) {
+            .write = write,
+            .offset = BLOCK_SIZE_RESERVED_BYTES + ranges[i].block_index*EWSFS_BLOCK_SIZE,
+            .iov = ranges[i].iov,
+            .iov_count = ranges[i].iov_count,
+        };
+    }
+
+    int error = ewsfs_uring_submit(&device->uring, device->fd, requests, range_count);
+    if (error) {
+        if (__atomic_exchange_n(&device->backend, EWSFS_BLOCK_BACKEND_PIO, __ATOMIC_ACQ_REL) == EWSFS_BLOCK_BACKEND_URING)
+            nob_log(WARNING, "io_uring failed (%s), falling back to pread/pwrite", strerror(error));
+        free(requests);
+        return -1;
+    }
+
+    for (size_t i = 0; i < range_count && !error; ++i) {
+        if (requests[i].result < 0) {
+            error = -requests[i].result;
+            break;
+        }
+        size_t range_size = ranges[i].block_count*EWSFS_BLOCK_SIZE;
+        if ((size_t) requests[i].result == range_size)
+            continue;
+
+        struct iovec iov_copy[ranges[i].iov_count];
+        memcpy(iov_copy, ranges[i].iov, ranges[i].iov_count*sizeof(*iov_copy));
+        int iov_count = ranges[i].iov_count;
+        struct iovec* iov = iov_advance(iov_copy, &iov_count, requests[i].result);
+        off_t offset = requests[i].offset + requests[i].result;
+        error = write ? pwritev_all(device->fd, iov, iov_count, offset) : preadv_all(device->fd, iov, iov_count, offset);
+    }
+    free(requests);
+    return error;
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    size_t remaining;
+} ewsfs_block_fanout_t;
+
+// An image's part of a transfer of a device with several images, in the image's own block indexes
+typedef struct ewsfs_block_job {
+    struct ewsfs_block_job* next;
+    ewsfs_block_device_t* member;
+    const ewsfs_block_range_t* ranges;
+    size_t range_count;
+    uint64_t blocks;
+    bool write;
+    int error;
+    ewsfs_block_fanout_t* fanout;
+} ewsfs_block_job_t;
+
+static int ewsfs_block_member_transfer(ewsfs_block_device_t* member, const ewsfs_block_range_t* ranges, size_t range_count, bool write) {
+    if (ewsfs_block_get_backend(member) == EWSFS_BLOCK_BACKEND_URING && range_count > 1) {
+        int error = ewsfs_block_uring_transfer(member, ranges, range_count, write);
+        if (error >= 0)
+            return error;
+    }
+    int error = 0;
+    for (size_t i = 0; i < range_count && !error; ++i) {
+        off_t offset = BLOCK_SIZE_RESERVED_BYTES + ranges[i].block_index*EWSFS_BLOCK_SIZE;
+        if (write)
+            error = ewsfs_block_device_write(member, ranges[i].iov, ranges[i].iov_count, offset);
+        else
+            error = ewsfs_block_device_read(member, ranges[i].iov, ranges[i].iov_count, offset);
+    }
+    return error;
+}
+
+static void* ewsfs_block_worker_thread(void* arg) {
+    ewsfs_block_device_t* member = arg;
+    ewsfs_block_worker_t* worker = &member->worker;
+    pthread_mutex_lock(&worker->lock);
+    for (;;) {
+        while (worker->running && !worker->first_job)
+            pthread_cond_wait(&worker->changed, &worker->lock);
+        if (!worker->first_job)
+            break;
+        ewsfs_block_job_t* job = worker->first_job;
+        worker->first_job = job->next;
+        if (!worker->first_job)
+            worker->last_job = NULL;
+        pthread_mutex_unlock(&worker->lock);
+
+        job->error = ewsfs_block_member_transfer(member, job->ranges, job->range_count, job->write);
+        ewsfs_block_fanout_t* fanout = job->fanout;
+        pthread_mutex_lock(&fanout->lock);
+        if (--fanout->remaining == 0)
+            pthread_cond_signal(&fanout->done);
+        pthread_mutex_unlock(&fanout->lock);
+
+        pthread_mutex_lock(&worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+static bool ewsfs_block_start_worker(ewsfs_block_device_t* member) {
+    ewsfs_block_worker_t* worker = &member->worker;
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->changed, NULL);
+    worker->running = true;
+    if (pthread_create(&worker->thread, NULL, ewsfs_block_worker_thread, member) != 0) {
+        pthread_cond_destroy(&worker->changed);
+        pthread_mutex_destroy(&worker->lock);
+        *worker = (ewsfs_block_worker_t) {0};
+        return false;
+    }
+    worker->started = true;
+    return true;
+}
+
+static void ewsfs_block_stop_worker(ewsfs_block_device_t* member) {
+    ewsfs_block_worker_t* worker = &member->worker;
+    if (!worker->started)
+        return;
+    pthread_mutex_lock(&worker->lock);
+    worker->running = false;
+    pthread_cond_signal(&worker->changed);
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->thread, NULL);
+    pthread_cond_destroy(&worker->changed);
+    pthread_mutex_destroy(&worker->lock);
+    *worker = (ewsfs_block_worker_t) {0};
+}
+
+bool ewsfs_block_start_workers(ewsfs_block_device_t* device) {
+    for (size_t i = 0; i < device->member_count; ++i) {
+        if (!device->members[i].worker.started && !ewsfs_block_start_worker(&device->members[i]))
+            return false;
+    }
+    return true;
+}
+
+static void ewsfs_block_queue_job(ewsfs_block_job_t* job) {
+    ewsfs_block_worker_t* worker = &job->member->worker;
+    job->next = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->last_job)
+        worker->last_job->next = job;
+    else
+        worker->first_job = job;
+    worker->last_job = job;
+    pthread_cond_signal(&worker->changed);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static void ewsfs_block_stripe_locate(const ewsfs_block_device_t* device, uint64_t block_index, size_t* member, uint64_t* member_block) {
+    uint64_t stripe = block_index / device->stripe_blocks;
+    *member = stripe % device->member_count;
+    *member_block = stripe / device->member_count * device->stripe_blocks + block_index % device->stripe_blocks;
+}
+
+// Put the iovecs for `size` bytes of an iovec list, starting `offset` bytes into it, in `out`. Returns how many there are.
+static int iov_slice(const struct iovec* iov, int iov_count, size_t offset, size_t size, struct iovec* out) {
+    int count = 0;
+    for (int i = 0; i < iov_count && size > 0; ++i) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        size_t n = iov[i].iov_len - offset < size ? iov[i].iov_len - offset : size;
+        out[count++] = (struct iovec) {(uint8_t*) iov[i].iov_base + offset, n};
+        size -= n;
+        offset = 0;
+    }
+    return count;
+}
+
+// Do the jobs of the images at the same time, the first one on this thread and the others by their workers.
+// Jobs of images whose worker isn't running (before ewsfs_block_start_workers) are done on this thread as well.
+static void ewsfs_block_run_jobs(ewsfs_block_job_t* jobs, size_t job_count) {
+    ewsfs_block_job_t* own_job = NULL;
+    size_t queued = 0;
+    for (size_t i = 0; i < job_count; ++i) {
+        jobs[i].blocks = 0;
+        for (size_t j = 0; j < jobs[i].range_count; ++j)
+            jobs[i].blocks += jobs[i].ranges[j].block_count;
+        if (jobs[i].range_count == 0)
+            continue;
+        __atomic_add_fetch(&jobs[i].member->in_flight, jobs[i].blocks, __ATOMIC_RELAXED);
+        if (!own_job)
+            own_job = &jobs[i];
+        else if (jobs[i].member->worker.started)
+            queued++;
+    }
+
+    ewsfs_block_fanout_t fanout = {.remaining = queued};
+    pthread_mutex_init(&fanout.lock, NULL);
+    pthread_cond_init(&fanout.done, NULL);
+    for (size_t i = 0; i < job_count; ++i) {
+        if (jobs[i].range_count == 0 || &jobs[i] == own_job || !jobs[i].member->worker.started)
+            continue;
+        jobs[i].fanout = &fanout;
+        ewsfs_block_queue_job(&jobs[i]);
+    }
+    for (size_t i = 0; i < job_count; ++i) {
+        if (jobs[i].range_count > 0 && (&jobs[i] == own_job || !jobs[i].member->worker.started))
+            jobs[i].error = ewsfs_block_member_transfer(jobs[i].member, jobs[i].ranges, jobs[i].range_count, jobs[i].write);
+    }
+    pthread_mutex_lock(&fanout.lock);
+    while (fanout.remaining > 0)
+        pthread_cond_wait(&fanout.done, &fanout.lock);
+    pthread_mutex_unlock(&fanout.lock);
+    pthread_cond_destroy(&fanout.done);
+    pthread_mutex_destroy(&fanout.lock);
+
+    for (size_t i = 0; i < job_count; ++i) {
+        if (jobs[i].range_count == 0)
+            continue;
+        __atomic_sub_fetch(&jobs[i].member->in_flight, jobs[i].blocks, __ATOMIC_RELAXED);
+        if (!jobs[i].write && !jobs[i].error)
+            __atomic_add_fetch(&jobs[i].member->blocks_read, jobs[i].blocks, __ATOMIC_RELAXED);
+    }
+}
+
+// Split the ranges at the stripe boundaries and give every image its part
+static int ewsfs_block_stripe_transfer(ewsfs_block_device_t* device, const ewsfs_block_range_t* ranges, size_t range_count, bool write) {
+    uint64_t stripe_blocks = device->stripe_blocks;
+    // Every stripe a range touches becomes a piece, with at most one more iovec than the range has
+    size_t piece_capacity = 0;
+    size_t iov_capacity = 0;
+    for (size_t i = 0; i < range_count; ++i) {
+        size_t stripes = (ranges[i].block_index + ranges[i].block_count - 1) / stripe_blocks - ranges[i].block_index / stripe_blocks + 1;
+        piece_capacity += stripes;
+        iov_capacity += ranges[i].iov_count + stripes;
+    }
+    ewsfs_block_range_t* pieces = malloc(piece_capacity*sizeof(*pieces));
+    struct iovec* iovs = malloc(iov_capacity*sizeof(*iovs));
+    ewsfs_block_job_t* jobs = calloc(device->member_count, sizeof(*jobs));
+    if (!pieces || !iovs || !jobs) {
+        free(pieces);
+        free(iovs);
+        free(jobs);
+        return ENOMEM;
+    }
+
+    // Group the pieces by image. A piece that continues the previous one on the same image is merged into it,
+    // so a long range becomes one transfer per image.
+    size_t piece_count = 0;
+    size_t iov_count = 0;
+    for (size_t m = 0; m < device->member_count; ++m) {
+        ewsfs_block_job_t* job = &jobs[m];
+        *job = (ewsfs_block_job_t) {.member = &device->members[m], .ranges = pieces + piece_count, .write = write};
+        for (size_t i = 0; i < range_count; ++i) {
+            for (uint64_t done = 0; done < ranges[i].block_count;) {
+                uint64_t block_index = ranges[i].block_index + done;
+                uint64_t length = stripe_blocks - block_index % stripe_blocks;
+                if (length > ranges[i].block_count - done)
+                    length = ranges[i].block_count - done;
+                size_t member = 0;
+                uint64_t member_block = 0;
+                ewsfs_block_stripe_locate(device, block_index, &member, &member_block);
+                if (member == m) {
+                    struct iovec* piece_iov = iovs + iov_count;
+                    int piece_iov_count = iov_slice(ranges[i].iov, ranges[i].iov_count, done*EWSFS_BLOCK_SIZE, length*EWSFS_BLOCK_SIZE, piece_iov);
+                    iov_count += piece_iov_count;
+                    ewsfs_block_range_t* last = job->range_count > 0 ? &pieces[piece_count - 1] : NULL;
+                    if (last && last->block_index + last->block_count == member_block && last->iov_count + piece_iov_count <= IOV_MAX) {
+                        last->block_count += length;
+                        last->iov_count += piece_iov_count;
+                    } else {
+                        pieces[piece_count++] = (ewsfs_block_range_t) {member_block, length, piece_iov, piece_iov_count};
+                        job->range_count++;
+                    }
+                }
+                done += length;
+            }
+        }
+    }
+    ewsfs_block_run_jobs(jobs, device->member_count);
+
+    int error = 0;
+    for (size_t m = 0; m < device->member_count && !error; ++m)
+        error = jobs[m].error;
+    free(pieces);
+    free(iovs);
+    free(jobs);
+    return error;
+}
+
+// The image of a mirror with the least I/O in flight, or the pinned one. Returns false if every image failed.
+static bool ewsfs_block_mirror_pick(ewsfs_block_device_t* device, const uint64_t* loads, size_t* member) {
+    if (device->pinned) {
+        *member = device->pinned_member;
+        return true;
+    }
+    bool found = false;
+    for (size_t m = 0; m < device->member_count; ++m) {
+        if (device->members[m].failed)
+            continue;
+        if (!found || loads[m] < loads[*member]) {
+            *member = m;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Every range is read from the image with the least I/O in flight, so the ranges of a batch are spread over the images.
+// A range that can't be read from its image is read from the others.
+static int ewsfs_block_mirror_read(ewsfs_block_device_t* device, const ewsfs_block_range_t* ranges, size_t range_count) {
+    ewsfs_block_range_t* grouped = malloc(range_count*sizeof(*grouped));
+    size_t* picks = malloc(range_count*sizeof(*picks));
+    uint64_t* loads = malloc(device->member_count*sizeof(*loads));
+    ewsfs_block_job_t* jobs = calloc(device->member_count, sizeof(*jobs));
+    int error = 0;
+    if (!grouped || !picks || !loads || !jobs) {
+        error = ENOMEM;
+        goto defer;
+    }
+
+    for (size_t m = 0; m < device->member_count; ++m)
+        loads[m] = __atomic_load_n(&device->members[m].in_flight, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < range_count; ++i) {
+        if (!ewsfs_block_mirror_pick(device, loads, &picks[i])) {
+            error = EIO;
+            goto defer;
+        }
+        loads[picks[i]] += ranges[i].block_count;
+    }
+    size_t grouped_count = 0;
+    for (size_t m = 0; m < device->member_count; ++m) {
+        jobs[m] = (ewsfs_block_job_t) {.member = &device->members[m], .ranges = grouped + grouped_count};
+        for (size_t i = 0; i < range_count; ++i) {
+            if (picks[i] == m) {
+                grouped[grouped_count++] = ranges[i];
+                jobs[m].range_count++;
+            }
+        }
+    }
+    ewsfs_block_run_jobs(jobs, device->member_count);
+
+    for (size_t m = 0; m < device->member_count && !error; ++m) {
+        if (!jobs[m].error)
+            continue;
+        if (device->pinned) {
+            error = jobs[m].error;
+            break;
+        }
+        nob_log(WARNING, "Couldn't read from image %zu of the mirror (%s), reading from the others", m + 1, strerror(jobs[m].error));
+        for (size_t i = 0; i < jobs[m].range_count && !error; ++i) {
+            error = jobs[m].error;
+            for (size_t other = 0; other < device->member_count && error; ++other) {
+                if (other != m && !device->members[other].failed)
+                    error = ewsfs_block_member_transfer(&device->members[other], &jobs[m].ranges[i], 1, false);
+            }
+        }
+    }
+
+defer:
+    free(grouped);
+    free(picks);
+    free(loads);
+    free(jobs);
+    return error;
+}
+
+// Every write goes to all images that haven't failed. An image that fails a write is left out from then on,
+// the write only fails if it failed on every image.
+static int ewsfs_block_mirror_write(ewsfs_block_device_t* device, const ewsfs_block_range_t* ranges, size_t range_count) {
+    ewsfs_block_job_t* jobs = calloc(device->member_count, sizeof(*jobs));
+    if (!jobs)
+        return ENOMEM;
+    for (size_t m = 0; m < device->member_count; ++m) {
+        jobs[m] = (ewsfs_block_job_t) {.member = &device->members[m], .ranges = ranges, .write = true};
+        if (!device->members[m].failed)
+            jobs[m].range_count = range_count;
+    }
+    ewsfs_block_run_jobs(jobs, device->member_count);
+
+    int error = EIO;
+    for (size_t m = 0; m < device->member_count; ++m) {
+        if (jobs[m].range_count == 0)
+            continue;
+        if (!jobs[m].error) {
+            error = 0;
+            continue;
+        }
+        if (error)
+            error = jobs[m].error;
+        nob_log(ERROR, "Couldn't write to image %zu of the mirror (%s), it won't be used anymore", m + 1, strerror(jobs[m].error));
+        device->members[m].failed = true;
+    }
+    free(jobs);
+    return error;
+}
+
+static int ewsfs_block_members_transfer(ewsfs_block_device_t* device, const ewsfs_block_range_t* ranges, size_t range_count, bool write) {
+    switch (device->layout) {
+        case EWSFS_BLOCK_LAYOUT_STRIPE:
+            return ewsfs_block_stripe_transfer(device, ranges, range_count, write);
+        case EWSFS_BLOCK_LAYOUT_MIRROR:
+            return write ? ewsfs_block_mirror_write(device, ranges, range_count) : ewsfs_block_mirror_read(device, ranges, range_count);
+    }
+    return EINVAL;
+}
+
+// Transfer a batch of ranges past the cache: spread over the images of the device, or submitted through io_uring
+static int ewsfs_block_batch_transfer(ewsfs_block_device_t* device, const ewsfs_block_range_t* ranges, size_t range_count, bool write) {
+    if (device->member_count > 0)
+        return ewsfs_block_members_transfer(device, ranges, range_count, write);
+    int error = ewsfs_block_uring_transfer(device, ranges, range_count, write);
+    if (error < 0) {
+        // io_uring is gone, so do it synchronously
+        error = 0;
+        for (size_t i = 0; i < range_count && !error; ++i) {
+            off_t offset = BLOCK_SIZE_RESERVED_BYTES + ranges[i].block_index*EWSFS_BLOCK_SIZE;
+            if (write)
+                error = ewsfs_block_device_write(device, ranges[i].iov, ranges[i].iov_count, offset);
+            else
+                error = ewsfs_block_device_read(device, ranges[i].iov, ranges[i].iov_count, offset);
+        }
+    }
+    return error;
+}
+
+int ewsfs_block_read_ranges(ewsfs_block_device_t* device, const ewsfs_block_range_t* ranges, size_t range_count) {
+    for (size_t i = 0; i < range_count; ++i) {
+        if (!ewsfs_block_range_valid(ranges[i].block_index, ranges[i].block_count, ranges[i].iov, ranges[i].iov_count))
+            return EFAULT;
+    }
+    bool batched = device->member_count > 0 || ewsfs_block_get_backend(device) == EWSFS_BLOCK_BACKEND_URING;
+    if (!batched || range_count < 2) {
+        for (size_t i = 0; i < range_count; ++i) {
+            int error = ewsfs_block_read_range(device, ranges[i].block_index, ranges[i].block_count, ranges[i].iov, ranges[i].iov_count);
+            if (error)
+                return error;
+        }
+        return 0;
+    }
+
+    // Only submit the ranges that aren't fully cached
+    ewsfs_block_range_t* misses = malloc(range_count*sizeof(*misses));
+    if (!misses)
+        return ENOMEM;
+    ewsfs_cache_t* cache = device->pinned ? NULL : device->cache;
+    size_t miss_count = 0;
+    for (size_t i = 0; i < range_count; ++i) {
+        if (!cache || !ewsfs_cache_read_range(cache, ranges[i].block_index, ranges[i].block_count, ranges[i].iov, ranges[i].iov_count))
+            misses[miss_count++] = ranges[i];
+    }
+
+    int error = miss_count > 0 ? ewsfs_block_batch_transfer(device, misses, miss_count, false) : 0;
+    for (size_t i = 0; i < miss_count && !error && cache; ++i)
+        ewsfs_cache_fill_range(cache, misses[i].block_index, misses[i].block_count, misses[i].iov, misses[i].iov_count);
+    free(misses);
+    return error;
+}
+
+int ewsfs_block_write_ranges(ewsfs_block_device_t* device, const ewsfs_block_range_t* ranges, size_t range_count) {
+    for (size_t i = 0; i < range_count; ++i) {
+        if (!ewsfs_block_range_valid(ranges[i].block_index, ranges[i].block_count, ranges[i].iov, ranges[i].iov_count))
+            return EFAULT;
+    }
+    bool batched = device->member_count > 0 || ewsfs_block_get_backend(device) == EWSFS_BLOCK_BACKEND_URING;
+    if (!batched || range_count < 2) {
+        for (size_t i = 0; i < range_count; ++i) {
+            int error = ewsfs_block_write_range(device, ranges[i].block_index, ranges[i].block_count, ranges[i].iov, ranges[i].iov_count);
+            if (error)
+                return error;
+        }
+        return 0;
+    }
+
+    // Same as in `ewsfs_block_write_range`: small ranges go into the cache, the rest is submitted
+    ewsfs_block_range_t* direct = malloc(range_count*sizeof(*direct));
+    if (!direct)
+        return ENOMEM;
+    size_t direct_count = 0;
+    int error = 0;
+    for (size_t i = 0; i < range_count && !error; ++i) {
+        if (device->cache && ranges[i].block_count*2 <= device->cache->capacity)
+            error = ewsfs_cache_write_range(device->cache, ranges[i].block_index, ranges[i].block_count, ranges[i].iov, ranges[i].iov_count);
+        else
+            direct[direct_count++] = ranges[i];
+    }
+
+    if (!error && direct_count > 0)
+        error = ewsfs_block_batch_transfer(device, direct, direct_count, true);
+    for (size_t i = 0; i < direct_count && !error && device->cache; ++i)
+        ewsfs_cache_write_through_range(device->cache, direct[i].block_index, direct[i].block_count, direct[i].iov, direct[i].iov_count);
+    free(direct);
+    return error;
+}
+
+bool ewsfs_block_enable_cache(ewsfs_block_device_t* device, size_t capacity) {
+    if (ewsfs_block_size == 0)
+        return false;
+    device->cache = malloc(sizeof(*device->cache));
+    if (!device->cache)
+        return false;
+    if (!ewsfs_cache_init(device->cache, capacity, ewsfs_block_size, ewsfs_block_cache_write_back, device)) {
+        free(device->cache);
+        device->cache = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool ewsfs_block_get_cache_stats(ewsfs_block_device_t* device, ewsfs_cache_stats_t* stats) {
+    if (!device->cache)
+        return false;
+    *stats = ewsfs_cache_get_stats(device->cache);
+    return true;
+}
+
+const uint8_t* ewsfs_block_get_mapped(ewsfs_block_device_t* device, uint64_t block_index, uint64_t block_count) {
+    if (block_index >= ewsfs_block_count || block_count > ewsfs_block_count - block_index)
+        return NULL;
+    // Clean cached blocks are the same as the mapped ones, only dirty ones are newer than the mapping
+    if (device->cache && ewsfs_cache_range_dirty(device->cache, block_index, block_count))
+        return NULL;
+    if (device->member_count > 0 && device->layout == EWSFS_BLOCK_LAYOUT_MIRROR) {
+        // Every image has all blocks, as long as it hasn't failed
+        for (size_t i = 0; i < device->member_count; ++i) {
+            if (!device->members[i].failed)
+                return ewsfs_block_get_mapped(&device->members[i], block_index, block_count);
         }
+        return NULL;
+    }
+    if (device->member_count > 0) {
+        // Only blocks within one stripe are next to each other in an image
+        if (block_index % device->stripe_blocks + block_count > device->stripe_blocks)
+            return NULL;
+        size_t member = 0;
+        uint64_t member_block = 0;
+        ewsfs_block_stripe_locate(device, block_index, &member, &member_block);
+        return ewsfs_block_get_mapped(&device->members[member], member_block, block_count);
     }
+    if (device->backend != EWSFS_BLOCK_BACKEND_MMAP)
+        return NULL;
+    return device->map + BLOCK_SIZE_RESERVED_BYTES + block_index*EWSFS_BLOCK_SIZE;
+}
 
-    if (index >= ewsfs_block_count)
+bool ewsfs_block_get_next_free_index(ewsfs_allocator_t* allocator, uint64_t hint, uint64_t* next_free_index) {
+    uint64_t index = 0;
+    uint64_t length = 0;
+    if (!ewsfs_alloc_extent(allocator, hint, 1, &index, &length))
         return false;
     ewsfs_log("[BLOCK] Allocated new block %"PRIu64, index);
     // Set the next_free_index output value
     *next_free_index = index;
-    // Add this block to the list of used blocks
-    da_append(used_block_indexes, index);
 
     return true;
 }
+
+bool ewsfs_block_allocate_extent(ewsfs_allocator_t* allocator, uint64_t hint, uint64_t wanted, uint64_t* from, uint64_t* length) {
+    if (!ewsfs_alloc_extent(allocator, hint, wanted, from, length))
+        return false;
+    ewsfs_log("[BLOCK] Allocated %"PRIu64" new blocks from %"PRIu64, *length, *from);
+    return true;
+}
+
+bool ewsfs_block_extend_extent(ewsfs_allocator_t* allocator, uint64_t from, uint64_t wanted, uint64_t* length) {
+    if (!ewsfs_alloc_extend(allocator, from, wanted, length))
+        return false;
+    ewsfs_log("[BLOCK] Allocated %"PRIu64" new blocks from %"PRIu64" in place", *length, from);
+    return true;
+}
+
+// Block devices only discard whole sectors, so the range is shrunk to the sectors that are completely inside it
+#define DISCARD_DEVICE_ALIGNMENT 4096
+
+static int discard_range(ewsfs_block_device_t* device, uint64_t from, uint64_t length) {
+    if (device->member_count > 0 && device->layout == EWSFS_BLOCK_LAYOUT_MIRROR) {
+        int error = 0;
+        for (size_t i = 0; i < device->member_count && !error; ++i) {
+            if (!device->members[i].failed)
+                error = discard_range(&device->members[i], from, length);
+        }
+        return error;
+    }
+    if (device->member_count > 0) {
+        // Every image discards its own part of the range, with the stripes that are next to each other in it merged
+        int error = 0;
+        for (size_t m = 0; m < device->member_count && !error; ++m) {
+            uint64_t run_from = 0;
+            uint64_t run_length = 0;
+            for (uint64_t done = 0; done < length && !error;) {
+                uint64_t block_index = from + done;
+                uint64_t piece_length = device->stripe_blocks - block_index % device->stripe_blocks;
+                if (piece_length > length - done)
+                    piece_length = length - done;
+                done += piece_length;
+                size_t member = 0;
+                uint64_t member_block = 0;
+                ewsfs_block_stripe_locate(device, block_index, &member, &member_block);
+                if (member != m)
+                    continue;
+                if (run_length > 0 && run_from + run_length == member_block) {
+                    run_length += piece_length;
+                    continue;
+                }
+                if (run_length > 0)
+                    error = discard_range(&device->members[m], run_from, run_length);
+                run_from = member_block;
+                run_length = piece_length;
+            }
+            if (!error && run_length > 0)
+                error = discard_range(&device->members[m], run_from, run_length);
+        }
+        return error;
+    }
+    uint64_t offset = BLOCK_SIZE_RESERVED_BYTES + from*EWSFS_BLOCK_SIZE;
+    uint64_t size = length*EWSFS_BLOCK_SIZE;
+    if (device->discard.block_device) {
+        uint64_t start = (offset + DISCARD_DEVICE_ALIGNMENT - 1) / DISCARD_DEVICE_ALIGNMENT * DISCARD_DEVICE_ALIGNMENT;
+        uint64_t end = (offset + size) / DISCARD_DEVICE_ALIGNMENT * DISCARD_DEVICE_ALIGNMENT;
+        if (end <= start)
+            return 0;
+        uint64_t range[2] = {start, end - start};
+        return ioctl(device->fd, BLKDISCARD, range) == 0 ? 0 : errno;
+    }
+    // The file system only frees whole pages, the partial pages at the edges are just zeroed
+    return fallocate(device->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0 ? 0 : errno;
+}
+
+static void* discard_thread(void* arg) {
+    ewsfs_block_device_t* device = arg;
+    ewsfs_block_discard_queue_t* discard = &device->discard;
+    pthread_mutex_lock(&discard->lock);
+    for (;;) {
+        while (discard->running && discard->pending.count == 0)
+            pthread_cond_wait(&discard->changed, &discard->lock);
+        // Stopped, and everything that was queued is done
+        if (discard->pending.count == 0)
+            break;
+
+        // Take the whole queue, so frees that come in meanwhile don't wait for the discards
+        ewsfs_extent_set_t batch = discard->pending;
+        discard->pending = (ewsfs_extent_set_t) {0};
+        discard->busy = true;
+        pthread_mutex_unlock(&discard->lock);
+
+        uint64_t discarded = 0;
+        for (size_t i = 0; i < batch.count; ++i) {
+            if (discard->supported) {
+                int error = discard_range(device, batch.items[i].from, batch.items[i].length);
+                if (error == EOPNOTSUPP || error == ENOTTY) {
+                    nob_log(WARNING, "The image doesn't support discarding freed blocks, only freeing them");
+                    discard->supported = false;
+                } else if (!error) {
+                    discarded += batch.items[i].length;
+                }
+            }
+            ewsfs_alloc_set_free(discard->allocator, batch.items[i].from, batch.items[i].length);
+        }
+        da_free(batch);
+
+        pthread_mutex_lock(&discard->lock);
+        discard->discarded += discarded;
+        discard->busy = false;
+        pthread_cond_broadcast(&discard->changed);
+    }
+    pthread_mutex_unlock(&discard->lock);
+    return NULL;
+}
+
+bool ewsfs_block_start_discard(ewsfs_block_device_t* device, ewsfs_allocator_t* allocator) {
+    ewsfs_block_discard_queue_t* discard = &device->discard;
+    if (discard->started)
+        return true;
+    struct stat file_stat = {0};
+    for (size_t i = 0; i < device->member_count; ++i) {
+        if (fstat(device->members[i].fd, &file_stat) != 0)
+            return false;
+        device->members[i].discard.block_device = S_ISBLK(file_stat.st_mode);
+    }
+    if (device->member_count == 0 && fstat(device->fd, &file_stat) != 0)
+        return false;
+    discard->block_device = S_ISBLK(file_stat.st_mode);
+    discard->supported = true;
+    discard->allocator = allocator;
+    discard->running = true;
+    pthread_mutex_init(&discard->lock, NULL);
+    pthread_cond_init(&discard->changed, NULL);
+    if (pthread_create(&discard->thread, NULL, discard_thread, device) != 0) {
+        pthread_cond_destroy(&discard->changed);
+        pthread_mutex_destroy(&discard->lock);
+        discard->running = false;
+        return false;
+    }
+    discard->started = true;
+    return true;
+}
+
+void ewsfs_block_stop_discard(ewsfs_block_device_t* device) {
+    ewsfs_block_discard_queue_t* discard = &device->discard;
+    if (!discard->started)
+        return;
+    pthread_mutex_lock(&discard->lock);
+    discard->running = false;
+    pthread_cond_broadcast(&discard->changed);
+    pthread_mutex_unlock(&discard->lock);
+    pthread_join(discard->thread, NULL);
+    pthread_cond_destroy(&discard->changed);
+    pthread_mutex_destroy(&discard->lock);
+    da_free(discard->pending);
+    *discard = (ewsfs_block_discard_queue_t) {0};
+}
+
+bool ewsfs_block_discard(ewsfs_block_device_t* device, uint64_t from, uint64_t length) {
+    ewsfs_block_discard_queue_t* discard = &device->discard;
+    if (!discard->started)
+        return false;
+    pthread_mutex_lock(&discard->lock);
+    ewsfs_extent_set_add(&discard->pending, from, length);
+    pthread_cond_broadcast(&discard->changed);
+    pthread_mutex_unlock(&discard->lock);
+    return true;
+}
+
+void ewsfs_block_cancel_discard(ewsfs_block_device_t* device) {
+    ewsfs_block_discard_queue_t* discard = &device->discard;
+    if (!discard->started)
+        return;
+    pthread_mutex_lock(&discard->lock);
+    discard->pending.count = 0;
+    while (discard->busy)
+        pthread_cond_wait(&discard->changed, &discard->lock);
+    pthread_mutex_unlock(&discard->lock);
+}
+
+void ewsfs_block_hold_discard(ewsfs_block_device_t* device) {
+    ewsfs_block_discard_queue_t* discard = &device->discard;
+    if (!discard->started)
+        return;
+    pthread_mutex_lock(&discard->lock);
+    while (discard->busy)
+        pthread_cond_wait(&discard->changed, &discard->lock);
+}
+
+void ewsfs_block_release_discard(ewsfs_block_device_t* device) {
+    ewsfs_block_discard_queue_t* discard = &device->discard;
+    if (!discard->started)
+        return;
+    pthread_mutex_unlock(&discard->lock);
+}
+
+bool ewsfs_block_get_discard_stats(ewsfs_block_device_t* device, uint64_t* pending, uint64_t* discarded) {
+    ewsfs_block_discard_queue_t* discard = &device->discard;
+    if (!discard->started)
+        return false;
+    pthread_mutex_lock(&discard->lock);
+    *pending = ewsfs_extent_set_blocks(&discard->pending);
+    *discarded = discard->discarded;
+    pthread_mutex_unlock(&discard->lock);
+    return true;
+}
@@ -2,8 +2,16 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include "alloc.h"
+#include "cache.h"
+#include "extent.h"
+#include "uring.h"
 
 #define EWSFS_BLOCK_SIZE ewsfs_block_get_size()
+// The amount of locks the edge sectors of O_DIRECT writes are spread over
+#define EWSFS_BLOCK_DIRECT_LOCKS 64
 
 typedef struct {
     uint64_t* items;
@@ -11,10 +19,205 @@ typedef struct {
     size_t capacity;
 } ewsfs_block_index_list_t;
 
-bool ewsfs_block_read_size(FILE* file);
+typedef enum {
+    // Positional pread/pwrite on the file descriptor
+    EWSFS_BLOCK_BACKEND_PIO,
+    // The whole image is mapped into memory, and blocks are copied from and to the mapping
+    EWSFS_BLOCK_BACKEND_MMAP,
+    // Batches of ranges are submitted through io_uring; single ranges use pread/pwrite
+    EWSFS_BLOCK_BACKEND_URING,
+} ewsfs_block_backend_t;
+
+// How the blocks are spread over several images
+typedef enum {
+    // Stripe n of `stripe_blocks` blocks goes to image n % the amount of images (RAID0)
+    EWSFS_BLOCK_LAYOUT_STRIPE,
+    // Every image holds all blocks (RAID1). Writes go to all images, reads to the one with the least I/O in flight.
+    EWSFS_BLOCK_LAYOUT_MIRROR,
+} ewsfs_block_layout_t;
+
+typedef struct {
+    ewsfs_block_backend_t backend;
+    // The maximum amount of requests in flight with EWSFS_BLOCK_BACKEND_URING
+    unsigned int queue_depth;
+    // Open the image with O_DIRECT, so it isn't kept in the host page cache as well
+    bool direct;
+    // Fail to open a block device that's in use (mounted or opened exclusively), or an image file that another
+    // mount has open exclusively
+    bool exclusive;
+    ewsfs_block_layout_t layout;
+    // With several striped images, the amount of consecutive blocks that go to one image before the next one gets its turn
+    uint64_t stripe_blocks;
+} ewsfs_block_options_t;
+
+// Aligned bounce buffers for O_DIRECT, each big enough for a chunk of whole blocks plus the edge sectors
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    uint8_t** free_buffers;
+    size_t free_count;
+    size_t buffer_count;
+    size_t buffer_size;
+    // The amount of bytes transferred per buffer
+    size_t chunk_size;
+} ewsfs_block_buffer_pool_t;
+
+// Freed ranges waiting to be discarded by a background thread, merged with their neighbours while they wait
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+    bool started;
+    bool running;
+    // Set while the thread is discarding a batch that was taken out of `pending`
+    bool busy;
+    // Block devices get BLKDISCARD, image files get their blocks punched out
+    bool block_device;
+    // Cleared when the image doesn't support discarding; the ranges are then only handed back
+    bool supported;
+    ewsfs_extent_set_t pending;
+    ewsfs_allocator_t* allocator;
+    uint64_t discarded;
+} ewsfs_block_discard_queue_t;
+
+struct ewsfs_block_job;
+
+// The thread that does an image's part of the transfers of a device with several images, so all images are busy at the same time
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+    bool started;
+    bool running;
+    struct ewsfs_block_job* first_job;
+    struct ewsfs_block_job* last_job;
+} ewsfs_block_worker_t;
+
+typedef struct ewsfs_block_device {
+    int fd;
+    ewsfs_block_backend_t backend;
+    // Only used by EWSFS_BLOCK_BACKEND_MMAP
+    uint8_t* map;
+    size_t map_size;
+    // The byte range of the mapping written to since the last ewsfs_block_sync
+    pthread_mutex_t dirty_lock;
+    size_t dirty_from;
+    size_t dirty_to;
+    // Only used by EWSFS_BLOCK_BACKEND_URING
+    ewsfs_uring_t uring;
+    // Only used with O_DIRECT. Blocks don't start on a sector boundary (because of the reserved bytes),
+    // so writes read-modify-write the edge sectors. The lock picked by an edge sector's index keeps two writes
+    // from doing that to the same sector; writes of whole sectors don't take one.
+    bool direct;
+    size_t direct_alignment;
+    off_t direct_image_size;
+    pthread_mutex_t direct_locks[EWSFS_BLOCK_DIRECT_LOCKS];
+    ewsfs_block_buffer_pool_t direct_buffers;
+    // The block cache in front of the backend, NULL if it's disabled
+    ewsfs_cache_t* cache;
+    ewsfs_block_discard_queue_t discard;
+    // The images the blocks are spread over, each opened as a device of its own, or none for a single image.
+    // The cache and the discard queue are on the device of all images, the other fields above are only used by the members.
+    struct ewsfs_block_device* members;
+    size_t member_count;
+    ewsfs_block_layout_t layout;
+    uint64_t stripe_blocks;
+    // Set while all mirrored reads have to come from one image, e.g. to compare the FACTs of the images
+    bool pinned;
+    size_t pinned_member;
+    // Only used by a member
+    ewsfs_block_worker_t worker;
+    // The amount of blocks being transferred, which reads of a mirror are balanced by
+    uint64_t in_flight;
+    uint64_t blocks_read;
+    // A mirrored image that failed a write isn't used anymore
+    bool failed;
+} ewsfs_block_device_t;
+
+bool ewsfs_block_backend_from_name(const char* name, ewsfs_block_backend_t* backend);
+bool ewsfs_block_open(ewsfs_block_device_t* device, const char* path, const ewsfs_block_options_t* options);
+// Open several images as one device, with the blocks striped across them or mirrored, see ewsfs_block_layout_t.
+// Every image needs its own reserved bytes with the same block size, e.g. by formatting each of them.
+// Opening a single image that isn't mirrored is the same as ewsfs_block_open.
+bool ewsfs_block_open_images(ewsfs_block_device_t* device, const char* const* paths, size_t path_count, const ewsfs_block_options_t* options);
+// How the blocks are spread, over how many images (1 for a single image), and the stripe width in blocks
+void ewsfs_block_get_layout(ewsfs_block_device_t* device, ewsfs_block_layout_t* layout, uint64_t* images, uint64_t* stripe_blocks);
+// Read only from one image of a mirror, until ewsfs_block_unpin_replica. The cache is skipped, since it may hold
+// blocks of another image. Returns false if there's no such image.
+bool ewsfs_block_pin_replica(ewsfs_block_device_t* device, size_t replica);
+void ewsfs_block_unpin_replica(ewsfs_block_device_t* device);
+// Copy blocks from one image of a mirror to another, past the cache
+int ewsfs_block_copy_replica(ewsfs_block_device_t* device, size_t from, size_t to, uint64_t block_index, uint64_t block_count);
+// Stop using an image of a mirror, like when it fails a write
+void ewsfs_block_fail_replica(ewsfs_block_device_t* device, size_t replica);
+// The amount of images of a mirror (1 if the device isn't mirrored), and how many of them failed
+void ewsfs_block_get_replicas(ewsfs_block_device_t* device, uint64_t* replicas, uint64_t* failed);
+// The amount of blocks read from an image of a device with several images
+uint64_t ewsfs_block_get_blocks_read(ewsfs_block_device_t* device, size_t image);
+void ewsfs_block_close(ewsfs_block_device_t* device);
+// Put a cache of `capacity` blocks in front of the device. Needs the block size to be known.
+bool ewsfs_block_enable_cache(ewsfs_block_device_t* device, size_t capacity);
+bool ewsfs_block_get_cache_stats(ewsfs_block_device_t* device, ewsfs_cache_stats_t* stats);
+// Start the threads that do the parts of a transfer on the images of a device with several images at the same
+// time. Until then, or if they can't be started, the parts are done one after another by the calling thread.
+// Has to be called after FUSE has forked into the background.
+bool ewsfs_block_start_workers(ewsfs_block_device_t* device);
+// Start a thread that punches freed ranges out of the image (or discards them on a block device), so a thin image
+// shrinks on the host. The ranges are handed back to `allocator` once they're discarded, so they can't be reused
+// before that. Has to be called after FUSE has forked into the background.
+bool ewsfs_block_start_discard(ewsfs_block_device_t* device, ewsfs_allocator_t* allocator);
+// Discards what's still queued, then stops the thread
+void ewsfs_block_stop_discard(ewsfs_block_device_t* device);
+// Queue a freed range. Returns false if discarding isn't enabled, the caller has to free the range itself then.
+bool ewsfs_block_discard(ewsfs_block_device_t* device, uint64_t from, uint64_t length);
+// Drop the queued ranges (for when the allocator is rebuilt from scratch) and wait for the running batch to finish
+void ewsfs_block_cancel_discard(ewsfs_block_device_t* device);
+// Wait for the batch that's being discarded, and keep the thread from starting another one until
+// ewsfs_block_release_discard, so it doesn't hand ranges back to the allocator meanwhile
+void ewsfs_block_hold_discard(ewsfs_block_device_t* device);
+void ewsfs_block_release_discard(ewsfs_block_device_t* device);
+bool ewsfs_block_get_discard_stats(ewsfs_block_device_t* device, uint64_t* pending, uint64_t* discarded);
+// Called at FACT commit points; writes dirty cached blocks back and pushes writes made through the mapping to the image
+int ewsfs_block_sync(ewsfs_block_device_t* device);
+
+// All block I/O is positional, so the device has no shared file position
+// and these functions can be called from multiple threads.
+bool ewsfs_block_read_size(ewsfs_block_device_t* device);
 void ewsfs_block_set_size(uint64_t block_size);
 uint64_t ewsfs_block_get_size();
-int ewsfs_block_read(FILE* file, uint64_t block_index, uint8_t* buffer);
-int ewsfs_block_write(FILE* file, uint64_t block_index, const uint8_t* buffer);
+void ewsfs_block_set_count(uint64_t block_count);
+uint64_t ewsfs_block_get_count();
+// Take the sizes the images have now, e.g. after they were made bigger with `truncate -s`, and put the new block
+// count in `block_count`. The block count can only grow, a smaller image gives EINVAL. The image is mapped again with
+// EWSFS_BLOCK_BACKEND_MMAP, so nothing may use the device meanwhile.
+int ewsfs_block_grow(ewsfs_block_device_t* device, uint64_t* block_count);
+int ewsfs_block_read(ewsfs_block_device_t* device, uint64_t block_index, uint8_t* buffer);
+int ewsfs_block_write(ewsfs_block_device_t* device, uint64_t block_index, const uint8_t* buffer);
+// Read or write `block_count` consecutive blocks starting at `block_index` in one go
+// (a single preadv/pwritev call with the PIO backend).
+// The iovec lengths need to add up to exactly `block_count` blocks.
+int ewsfs_block_read_range(ewsfs_block_device_t* device, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count);
+int ewsfs_block_write_range(ewsfs_block_device_t* device, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count);
+
+typedef struct {
+    uint64_t block_index;
+    uint64_t block_count;
+    const struct iovec* iov;
+    int iov_count;
+} ewsfs_block_range_t;
+
+// Read or write several ranges as one batch. With EWSFS_BLOCK_BACKEND_URING, they're all submitted
+// together and their completions are reaped together; the other backends go through them one by one.
+int ewsfs_block_read_ranges(ewsfs_block_device_t* device, const ewsfs_block_range_t* ranges, size_t range_count);
+int ewsfs_block_write_ranges(ewsfs_block_device_t* device, const ewsfs_block_range_t* ranges, size_t range_count);
+// Returns a pointer to the blocks inside the mapped image, or NULL if the device isn't mapped or the cache has
+// changes to one of the blocks that aren't in the mapping yet
+const uint8_t* ewsfs_block_get_mapped(ewsfs_block_device_t* device, uint64_t block_index, uint64_t block_count);
 
-bool ewsfs_block_get_next_free_index(ewsfs_block_index_list_t* free_block_indices, uint64_t* next_free_index);
+// `hint` picks the allocation group to start in, see ewsfs_alloc_extent
+bool ewsfs_block_get_next_free_index(ewsfs_allocator_t* allocator, uint64_t hint, uint64_t* next_free_index);
+// Allocate up to `wanted` consecutive blocks. If there's no free run that long, a shorter one is allocated,
+// so `length` can be less than `wanted`; call it again for the rest.
+bool ewsfs_block_allocate_extent(ewsfs_allocator_t* allocator, uint64_t hint, uint64_t wanted, uint64_t* from, uint64_t* length);
+// Allocate up to `wanted` blocks right at `from`, see ewsfs_alloc_extend
+bool ewsfs_block_extend_extent(ewsfs_allocator_t* allocator, uint64_t from, uint64_t wanted, uint64_t* length);
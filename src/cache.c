@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define CACHE_SLOT_NONE SIZE_MAX
+
+static size_t cache_hash(const ewsfs_cache_t* cache, uint64_t block_index) {
+    // Fibonacci hashing; table_size is a power of two
+    return (size_t) (block_index * 0x9E3779B97F4A7C15ull) & (cache->table_size - 1);
+}
+
+static uint8_t* cache_slot_data(const ewsfs_cache_t* cache, size_t slot) {
+    return cache->data + slot*cache->block_size;
+}
+
+// Copy `size` bytes between a flat buffer and an iovec list, starting `offset` bytes into the iovec list
+static void iov_copy(const struct iovec* iov, int iov_count, size_t offset, uint8_t* buffer, size_t size, bool to_iov) {
+    for (int i = 0; i < iov_count && size > 0; ++i) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        size_t n = iov[i].iov_len - offset < size ? iov[i].iov_len - offset : size;
+        uint8_t* base = (uint8_t*) iov[i].iov_base + offset;
+        if (to_iov)
+            memcpy(base, buffer, n);
+        else
+            memcpy(buffer, base, n);
+        buffer += n;
+        size -= n;
+        offset = 0;
+    }
+}
+
+static size_t cache_find(const ewsfs_cache_t* cache, uint64_t block_index) {
+    size_t mask = cache->table_size - 1;
+    for (size_t pos = cache_hash(cache, block_index); cache->table[pos] != 0; pos = (pos + 1) & mask) {
+        size_t slot = cache->table[pos] - 1;
+        if (cache->slots[slot].block_index == block_index)
+            return slot;
+    }
+    return CACHE_SLOT_NONE;
+}
+
+static void cache_table_insert(ewsfs_cache_t* cache, size_t slot) {
+    size_t mask = cache->table_size - 1;
+    size_t pos = cache_hash(cache, cache->slots[slot].block_index);
+    while (cache->table[pos] != 0)
+        pos = (pos + 1) & mask;
+    cache->table[pos] = slot + 1;
+}
+
+static void cache_table_remove(ewsfs_cache_t* cache, size_t slot) {
+    size_t mask = cache->table_size - 1;
+    size_t pos = cache_hash(cache, cache->slots[slot].block_index);
+    while (cache->table[pos] != slot + 1)
+        pos = (pos + 1) & mask;
+    cache->table[pos] = 0;
+
+    // Shift the entries after this one back if the hole we just made breaks their probe sequence
+    for (size_t next = (pos + 1) & mask; cache->table[next] != 0; next = (next + 1) & mask) {
+        size_t home = cache_hash(cache, cache->slots[cache->table[next] - 1].block_index);
+        if (((next - home) & mask) >= ((next - pos) & mask)) {
+            cache->table[pos] = cache->table[next];
+            cache->table[next] = 0;
+            pos = next;
+        }
+    }
+}
+
+// Find a slot for a new block using the CLOCK algorithm, writing the old block back if it's dirty
+static int cache_get_free_slot(ewsfs_cache_t* cache, size_t* slot_out) {
+    for (;;) {
+        size_t slot = cache->clock_hand;
+        cache->clock_hand = (cache->clock_hand + 1) % cache->capacity;
+        ewsfs_cache_slot_t* cache_slot = &cache->slots[slot];
+
+        if (!cache_slot->used) {
+            ++cache->stats.used;
+            *slot_out = slot;
+            return 0;
+        }
+        // Give recently used blocks a second chance
+        if (cache_slot->referenced) {
+            cache_slot->referenced = false;
+            continue;
+        }
+
+        if (cache_slot->dirty) {
+            struct iovec iov = {cache_slot_data(cache, slot), cache->block_size};
+            int error = cache->write_back(cache->write_back_context, cache_slot->block_index, 1, &iov, 1);
+            if (error)
+                return error;
+            cache_slot->dirty = false;
+            ++cache->stats.write_backs;
+        }
+        cache_table_remove(cache, slot);
+        cache_slot->used = false;
+        ++cache->stats.evictions;
+        *slot_out = slot;
+        return 0;
+    }
+}
+
+bool ewsfs_cache_init(ewsfs_cache_t* cache, size_t capacity, uint64_t block_size, ewsfs_cache_write_back_t write_back, void* write_back_context) {
+    *cache = (ewsfs_cache_t) {0};
+    if (capacity == 0)
+        return false;
+
+    cache->capacity = capacity;
+    cache->block_size = block_size;
+    cache->write_back = write_back;
+    cache->write_back_context = write_back_context;
+    // Keep the hash table at most half full
+    cache->table_size = 1;
+    while (cache->table_size < capacity*2)
+        cache->table_size *= 2;
+
+    cache->slots = calloc(capacity, sizeof(*cache->slots));
+    cache->data = malloc(capacity*block_size);
+    cache->table = calloc(cache->table_size, sizeof(*cache->table));
+    if (!cache->slots || !cache->data || !cache->table) {
+        ewsfs_cache_uninit(cache);
+        return false;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->stats.capacity = capacity;
+    return true;
+}
+
+void ewsfs_cache_uninit(ewsfs_cache_t* cache) {
+    if (cache->slots)
+        pthread_mutex_destroy(&cache->lock);
+    free(cache->slots);
+    free(cache->data);
+    free(cache->table);
+    *cache = (ewsfs_cache_t) {0};
+}
+
+bool ewsfs_cache_read_range(ewsfs_cache_t* cache, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count) {
+    pthread_mutex_lock(&cache->lock);
+    // Only serve the range from the cache if all blocks are in it; otherwise it's read from the device in one go
+    uint64_t missing = 0;
+    for (uint64_t i = 0; i < block_count; ++i) {
+        if (cache_find(cache, block_index + i) == CACHE_SLOT_NONE)
+            ++missing;
+    }
+    cache->stats.hits += block_count - missing;
+    cache->stats.misses += missing;
+    if (missing > 0) {
+        pthread_mutex_unlock(&cache->lock);
+        return false;
+    }
+
+    for (uint64_t i = 0; i < block_count; ++i) {
+        size_t slot = cache_find(cache, block_index + i);
+        cache->slots[slot].referenced = true;
+        iov_copy(iov, iov_count, i*cache->block_size, cache_slot_data(cache, slot), cache->block_size, true);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+void ewsfs_cache_fill_range(ewsfs_cache_t* cache, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count) {
+    pthread_mutex_lock(&cache->lock);
+    bool can_insert = true;
+    for (uint64_t i = 0; i < block_count; ++i) {
+        size_t slot = cache_find(cache, block_index + i);
+        if (slot != CACHE_SLOT_NONE) {
+            // The cached block is at least as new as what's on the device
+            cache->slots[slot].referenced = true;
+            if (cache->slots[slot].dirty)
+                iov_copy(iov, iov_count, i*cache->block_size, cache_slot_data(cache, slot), cache->block_size, true);
+            continue;
+        }
+
+        // If a dirty block couldn't be written back to make room, stop inserting, but keep overlaying
+        if (!can_insert || cache_get_free_slot(cache, &slot) != 0) {
+            can_insert = false;
+            continue;
+        }
+        cache->slots[slot] = (ewsfs_cache_slot_t) {
+            .block_index = block_index + i,
+            .used = true,
+            .referenced = true,
+        };
+        iov_copy(iov, iov_count, i*cache->block_size, cache_slot_data(cache, slot), cache->block_size, false);
+        cache_table_insert(cache, slot);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int ewsfs_cache_write_range(ewsfs_cache_t* cache, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count) {
+    uint8_t block[cache->block_size];
+    pthread_mutex_lock(&cache->lock);
+    for (uint64_t i = 0; i < block_count; ++i) {
+        iov_copy(iov, iov_count, i*cache->block_size, block, cache->block_size, false);
+
+        size_t slot = cache_find(cache, block_index + i);
+        if (slot == CACHE_SLOT_NONE) {
+            int error = cache_get_free_slot(cache, &slot);
+            if (error) {
+                pthread_mutex_unlock(&cache->lock);
+                return error;
+            }
+            cache->slots[slot] = (ewsfs_cache_slot_t) {
+                .block_index = block_index + i,
+                .used = true,
+            };
+            cache_table_insert(cache, slot);
+        } else if (!cache->slots[slot].dirty && memcmp(cache_slot_data(cache, slot), block, cache->block_size) == 0) {
+            // Nothing changed, so there's nothing to write back (this is what keeps FACT saves cheap)
+            cache->slots[slot].referenced = true;
+            continue;
+        }
+
+        memcpy(cache_slot_data(cache, slot), block, cache->block_size);
+        cache->slots[slot].dirty = true;
+        cache->slots[slot].referenced = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+void ewsfs_cache_write_through_range(ewsfs_cache_t* cache, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count) {
+    pthread_mutex_lock(&cache->lock);
+    for (uint64_t i = 0; i < block_count; ++i) {
+        size_t slot = cache_find(cache, block_index + i);
+        if (slot == CACHE_SLOT_NONE)
+            continue;
+        iov_copy(iov, iov_count, i*cache->block_size, cache_slot_data(cache, slot), cache->block_size, false);
+        cache->slots[slot].dirty = false;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+bool ewsfs_cache_range_dirty(ewsfs_cache_t* cache, uint64_t block_index, uint64_t block_count) {
+    pthread_mutex_lock(&cache->lock);
+    bool dirty = false;
+    if (block_count <= cache->capacity) {
+        for (uint64_t i = 0; i < block_count && !dirty; ++i) {
+            size_t slot = cache_find(cache, block_index + i);
+            dirty = slot != CACHE_SLOT_NONE && cache->slots[slot].dirty;
+        }
+    } else {
+        // Ranges longer than the cache are checked the other way around
+        for (size_t slot = 0; slot < cache->capacity && !dirty; ++slot) {
+            ewsfs_cache_slot_t* cache_slot = &cache->slots[slot];
+            dirty = cache_slot->used && cache_slot->dirty
+                && cache_slot->block_index >= block_index && cache_slot->block_index - block_index < block_count;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return dirty;
+}
+
+typedef struct {
+    uint64_t block_index;
+    size_t slot;
+} dirty_slot_t;
+
+static int compare_dirty_slots(const void* a, const void* b) {
+    uint64_t index_a = ((const dirty_slot_t*) a)->block_index;
+    uint64_t index_b = ((const dirty_slot_t*) b)->block_index;
+    return (index_a > index_b) - (index_a < index_b);
+}
+
+int ewsfs_cache_flush(ewsfs_cache_t* cache) {
+    pthread_mutex_lock(&cache->lock);
+    dirty_slot_t* dirty_slots = malloc(cache->capacity*sizeof(*dirty_slots));
+    if (!dirty_slots) {
+        pthread_mutex_unlock(&cache->lock);
+        return ENOMEM;
+    }
+    size_t dirty_count = 0;
+    for (size_t slot = 0; slot < cache->capacity; ++slot) {
+        if (cache->slots[slot].used && cache->slots[slot].dirty)
+            dirty_slots[dirty_count++] = (dirty_slot_t) {cache->slots[slot].block_index, slot};
+    }
+    qsort(dirty_slots, dirty_count, sizeof(*dirty_slots), compare_dirty_slots);
+
+    // Write the dirty blocks in runs of consecutive block indexes, one call per run
+    int error = 0;
+    struct iovec iov[IOV_MAX];
+    size_t run_start = 0;
+    while (run_start < dirty_count && !error) {
+        uint64_t first_block_index = dirty_slots[run_start].block_index;
+        size_t run_length = 0;
+        while (run_start + run_length < dirty_count && run_length < IOV_MAX
+            && dirty_slots[run_start + run_length].block_index == first_block_index + run_length) {
+            iov[run_length] = (struct iovec) {cache_slot_data(cache, dirty_slots[run_start + run_length].slot), cache->block_size};
+            ++run_length;
+        }
+
+        error = cache->write_back(cache->write_back_context, first_block_index, run_length, iov, run_length);
+        if (!error) {
+            for (size_t i = run_start; i < run_start + run_length; ++i)
+                cache->slots[dirty_slots[i].slot].dirty = false;
+            cache->stats.write_backs += run_length;
+        }
+        run_start += run_length;
+    }
+
+    free(dirty_slots);
+    pthread_mutex_unlock(&cache->lock);
+    return error;
+}
+
+ewsfs_cache_stats_t ewsfs_cache_get_stats(ewsfs_cache_t* cache) {
+    pthread_mutex_lock(&cache->lock);
+    ewsfs_cache_stats_t stats = cache->stats;
+    stats.dirty = 0;
+    for (size_t slot = 0; slot < cache->capacity; ++slot) {
+        if (cache->slots[slot].used && cache->slots[slot].dirty)
+            ++stats.dirty;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return stats;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+// Called to write dirty blocks back to the device. The blocks are consecutive, starting at block_index.
+typedef int (*ewsfs_cache_write_back_t)(void* context, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count);
+
+typedef struct {
+    uint64_t block_index;
+    bool used;
+    bool dirty;
+    // The CLOCK reference bit, set on every access and cleared when the clock hand passes
+    bool referenced;
+} ewsfs_cache_slot_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t write_backs;
+    size_t capacity;
+    size_t used;
+    size_t dirty;
+} ewsfs_cache_stats_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t capacity;
+    uint64_t block_size;
+    ewsfs_cache_slot_t* slots;
+    uint8_t* data;
+    // Open addressing hash table from block index to slot index + 1 (0 means empty)
+    size_t* table;
+    size_t table_size;
+    size_t clock_hand;
+    ewsfs_cache_write_back_t write_back;
+    void* write_back_context;
+    ewsfs_cache_stats_t stats;
+} ewsfs_cache_t;
+
+bool ewsfs_cache_init(ewsfs_cache_t* cache, size_t capacity, uint64_t block_size, ewsfs_cache_write_back_t write_back, void* write_back_context);
+void ewsfs_cache_uninit(ewsfs_cache_t* cache);
+// Copy a range of blocks from the cache. Returns false if any of the blocks isn't cached.
+bool ewsfs_cache_read_range(ewsfs_cache_t* cache, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count);
+// Overlay cached blocks onto a range that was just read from the device (cached blocks may be newer),
+// and insert the blocks that weren't cached yet as clean blocks.
+void ewsfs_cache_fill_range(ewsfs_cache_t* cache, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count);
+// Store a range of blocks in the cache as dirty; they're written back on eviction or on ewsfs_cache_flush
+int ewsfs_cache_write_range(ewsfs_cache_t* cache, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count);
+// Update the cached copies of a range that was written to the device directly
+void ewsfs_cache_write_through_range(ewsfs_cache_t* cache, uint64_t block_index, uint64_t block_count, const struct iovec* iov, int iov_count);
+// Whether any block of the range is in the cache with changes that haven't been written back yet
+bool ewsfs_cache_range_dirty(ewsfs_cache_t* cache, uint64_t block_index, uint64_t block_count);
+// Write all dirty blocks back, in runs of consecutive blocks
+int ewsfs_cache_flush(ewsfs_cache_t* cache);
+ewsfs_cache_stats_t ewsfs_cache_get_stats(ewsfs_cache_t* cache);
@@ -0,0 +1,131 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "ctl.h"
+#include "fact.h"
+#define NOB_STRIP_PREFIX
+#include "nob.h"
+
+// The default for `defrag` without an argument: every file that isn't in one piece
+#define CTL_DEFRAG_MIN_FRAGMENTS 2
+
+static String_Builder ctl_result = {0};
+
+static void ewsfs_ctl_set_result(const char* result) {
+    ctl_result.count = 0;
+    sb_append_cstr(&ctl_result, result);
+    sb_append_cstr(&ctl_result, "\n");
+}
+
+// Parse a whole number argument, so "12abc" or "-1" aren't taken as a number
+static bool ewsfs_ctl_parse_u64(String_View arg, uint64_t* value) {
+    char number[32];
+    if (arg.count == 0 || arg.count >= sizeof(number) || arg.data[0] < '0' || arg.data[0] > '9')
+        return false;
+    memcpy(number, arg.data, arg.count);
+    number[arg.count] = '\0';
+    char* end = NULL;
+    errno = 0;
+    *value = strtoull(number, &end, 10);
+    return errno == 0 && *end == '\0';
+}
+
+static int ewsfs_ctl_defrag(String_View args) {
+    uint64_t min_fragments = CTL_DEFRAG_MIN_FRAGMENTS;
+    if (args.count > 0 && !ewsfs_ctl_parse_u64(args, &min_fragments))
+        return -EINVAL;
+
+    uint64_t moved_count = 0;
+    int error = ewsfs_fact_defrag(min_fragments, UINT64_MAX, &moved_count);
+    char result[64];
+    snprintf(result, sizeof(result), "defrag: moved %"PRIu64" files", moved_count);
+    ewsfs_ctl_set_result(result);
+    return error;
+}
+
+static int ewsfs_ctl_compact(String_View args) {
+    if (args.count > 0)
+        return -EINVAL;
+
+    uint64_t freed_count = 0;
+    int error = ewsfs_fact_compact(UINT64_MAX, &freed_count);
+    char result[64];
+    snprintf(result, sizeof(result), "compact: freed %"PRIu64" blocks", freed_count);
+    ewsfs_ctl_set_result(result);
+    return error;
+}
+
+static int ewsfs_ctl_grow(String_View args) {
+    if (args.count > 0)
+        return -EINVAL;
+
+    uint64_t old_count = 0;
+    uint64_t new_count = 0;
+    int error = ewsfs_fact_grow(&old_count, &new_count);
+    char result[96];
+    snprintf(result, sizeof(result), "grow: %"PRIu64" -> %"PRIu64" blocks", old_count, new_count);
+    ewsfs_ctl_set_result(result);
+    return error;
+}
+
+// `reflink <src> <dst>`, both paths are absolute paths in the mounted filesystem
+static int ewsfs_ctl_reflink(String_View args) {
+    String_View src = sv_chop_by_delim(&args, ' ');
+    String_View dst = sv_trim(args);
+    if (src.count == 0 || dst.count == 0 || src.data[0] != '/' || dst.data[0] != '/')
+        return -EINVAL;
+
+    String_Builder src_path = {0};
+    String_Builder dst_path = {0};
+    sb_append_buf(&src_path, src.data, src.count);
+    sb_append_null(&src_path);
+    sb_append_buf(&dst_path, dst.data, dst.count);
+    sb_append_null(&dst_path);
+
+    uint64_t shared_count = 0;
+    int error = ewsfs_fact_reflink(src_path.items, dst_path.items, &shared_count);
+    char result[64];
+    snprintf(result, sizeof(result), "reflink: shared %"PRIu64" blocks", shared_count);
+    ewsfs_ctl_set_result(result);
+    da_free(src_path);
+    da_free(dst_path);
+    return error;
+}
+
+int ewsfs_ctl_file_write(const char* buffer, size_t size, off_t offset) {
+    if (offset != 0)
+        return -EINVAL;
+
+    String_View args = sv_trim(sv_from_parts(buffer, size));
+    String_View command = sv_chop_by_delim(&args, ' ');
+    args = sv_trim(args);
+
+    int error = 0;
+    if (sv_eq(command, sv_from_cstr("defrag"))) {
+        error = ewsfs_ctl_defrag(args);
+    } else if (sv_eq(command, sv_from_cstr("compact"))) {
+        error = ewsfs_ctl_compact(args);
+    } else if (sv_eq(command, sv_from_cstr("grow"))) {
+        error = ewsfs_ctl_grow(args);
+    } else if (sv_eq(command, sv_from_cstr("reflink"))) {
+        error = ewsfs_ctl_reflink(args);
+    } else {
+        error = -EINVAL;
+    }
+    if (error < 0)
+        return error;
+    return size;
+}
+
+int ewsfs_ctl_file_read(char* buffer, size_t size, off_t offset) {
+    if ((size_t) offset >= ctl_result.count)
+        return 0;
+    size_t bytecount = ctl_result.count - offset < size ? ctl_result.count - offset : size;
+    memcpy(buffer, ctl_result.items + offset, bytecount);
+    return bytecount;
+}
+
+long ewsfs_ctl_file_size() {
+    return ctl_result.count;
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+#define EWSFS_CTL_FILE "ewsfs.ctl"
+
+// ewsfs.ctl file operations. Every write is one command, e.g. `echo defrag > ewsfs.ctl`,
+// and reading the file gives the result of the last command.
+// Commands change the FACT, so the caller needs to hold the FACT lock exclusively.
+int ewsfs_ctl_file_write(const char* buffer, size_t size, off_t offset);
+int ewsfs_ctl_file_read(char* buffer, size_t size, off_t offset);
+long ewsfs_ctl_file_size();
@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dedup.h"
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ull
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME3 0x165667B19E3779F9ull
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ull
+#define XXH_PRIME5 0x27D4EB2F165667C5ull
+
+#define DEDUP_MIN_CAPACITY 64
+
+static uint64_t xxh_read64(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t xxh_read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t xxh_rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input*XXH_PRIME2;
+    acc = xxh_rotl(acc, 31);
+    return acc*XXH_PRIME1;
+}
+
+static uint64_t xxh_merge_round(uint64_t acc, uint64_t value) {
+    acc ^= xxh_round(0, value);
+    return acc*XXH_PRIME1 + XXH_PRIME4;
+}
+
+uint64_t ewsfs_dedup_hash(const uint8_t* data, size_t size) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    uint64_t hash;
+
+    if (size >= 32) {
+        // Four independent lanes, so the multiplies of a stripe can run in parallel
+        uint64_t lanes[4] = {XXH_PRIME1 + XXH_PRIME2, XXH_PRIME2, 0, -XXH_PRIME1};
+        for (; end - p >= 32; p += 32) {
+            for (int i = 0; i < 4; ++i)
+                lanes[i] = xxh_round(lanes[i], xxh_read64(p + i*8));
+        }
+        hash = xxh_rotl(lanes[0], 1) + xxh_rotl(lanes[1], 7) + xxh_rotl(lanes[2], 12) + xxh_rotl(lanes[3], 18);
+        for (int i = 0; i < 4; ++i)
+            hash = xxh_merge_round(hash, lanes[i]);
+    } else {
+        hash = XXH_PRIME5;
+    }
+    hash += (uint64_t) size;
+
+    for (; end - p >= 8; p += 8) {
+        hash ^= xxh_round(0, xxh_read64(p));
+        hash = xxh_rotl(hash, 27)*XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (end - p >= 4) {
+        hash ^= (uint64_t) xxh_read32(p)*XXH_PRIME1;
+        hash = xxh_rotl(hash, 23)*XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        hash ^= *p*XXH_PRIME5;
+        hash = xxh_rotl(hash, 11)*XXH_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// The tables use linear probing, so the home slot of a key needs to be well mixed, block indexes are sequential
+static size_t ewsfs_dedup_home(const ewsfs_dedup_table_t* table, uint64_t key) {
+    key ^= key >> 33;
+    key *= XXH_PRIME2;
+    key ^= key >> 29;
+    return (size_t) key & (table->capacity - 1);
+}
+
+// The slot that holds `key`, or the empty slot where it would go
+static size_t ewsfs_dedup_slot(const ewsfs_dedup_table_t* table, uint64_t key) {
+    size_t i = ewsfs_dedup_home(table, key);
+    while (table->slots[i].used && table->slots[i].key != key)
+        i = (i + 1) & (table->capacity - 1);
+    return i;
+}
+
+static ewsfs_dedup_slot_t* ewsfs_dedup_get(const ewsfs_dedup_table_t* table, uint64_t key) {
+    if (table->count == 0)
+        return NULL;
+    ewsfs_dedup_slot_t* slot = &table->slots[ewsfs_dedup_slot(table, key)];
+    return slot->used ? slot : NULL;
+}
+
+static void ewsfs_dedup_put(ewsfs_dedup_table_t* table, ewsfs_dedup_slot_t slot) {
+    // Keep the table at most 3/4 full, so the probe sequences stay short
+    if ((table->count + 1)*4 > table->capacity*3) {
+        ewsfs_dedup_table_t grown = {0};
+        grown.capacity = table->capacity > 0 ? table->capacity*2 : DEDUP_MIN_CAPACITY;
+        grown.slots = calloc(grown.capacity, sizeof(*grown.slots));
+        for (size_t i = 0; i < table->capacity; ++i) {
+            if (table->slots[i].used)
+                grown.slots[ewsfs_dedup_slot(&grown, table->slots[i].key)] = table->slots[i];
+        }
+        grown.count = table->count;
+        free(table->slots);
+        *table = grown;
+    }
+    slot.used = true;
+    table->slots[ewsfs_dedup_slot(table, slot.key)] = slot;
+    table->count++;
+}
+
+// Remove a slot and move the slots after it back, so no probe sequence has a gap
+static void ewsfs_dedup_remove(ewsfs_dedup_table_t* table, uint64_t key) {
+    ewsfs_dedup_slot_t* slot = ewsfs_dedup_get(table, key);
+    if (!slot)
+        return;
+    size_t hole = slot - table->slots;
+    size_t i = hole;
+    for (;;) {
+        i = (i + 1) & (table->capacity - 1);
+        if (!table->slots[i].used)
+            break;
+        // A slot can fill the hole if its home isn't between the hole and itself
+        size_t home = ewsfs_dedup_home(table, table->slots[i].key);
+        if (((i - home) & (table->capacity - 1)) >= ((i - hole) & (table->capacity - 1))) {
+            table->slots[hole] = table->slots[i];
+            hole = i;
+        }
+    }
+    table->slots[hole].used = false;
+    table->count--;
+}
+
+void ewsfs_dedup_clear(ewsfs_dedup_index_t* index) {
+    if (index->hashes.slots)
+        memset(index->hashes.slots, 0, index->hashes.capacity*sizeof(*index->hashes.slots));
+    if (index->blocks.slots)
+        memset(index->blocks.slots, 0, index->blocks.capacity*sizeof(*index->blocks.slots));
+    index->hashes.count = 0;
+    index->blocks.count = 0;
+    index->references = 0;
+}
+
+void ewsfs_dedup_free(ewsfs_dedup_index_t* index) {
+    free(index->hashes.slots);
+    free(index->blocks.slots);
+    *index = (ewsfs_dedup_index_t) {0};
+}
+
+bool ewsfs_dedup_insert(ewsfs_dedup_index_t* index, uint64_t hash, uint64_t block, uint64_t refs) {
+    if (ewsfs_dedup_get(&index->hashes, hash) || ewsfs_dedup_get(&index->blocks, block))
+        return false;
+    ewsfs_dedup_put(&index->hashes, (ewsfs_dedup_slot_t) {.key = hash, .value = block});
+    ewsfs_dedup_put(&index->blocks, (ewsfs_dedup_slot_t) {.key = block, .value = hash, .refs = refs, .hashed = true});
+    index->references += refs;
+    return true;
+}
+
+void ewsfs_dedup_share(ewsfs_dedup_index_t* index, uint64_t block) {
+    ewsfs_dedup_slot_t* slot = ewsfs_dedup_get(&index->blocks, block);
+    if (slot) {
+        slot->refs++;
+        index->references++;
+        return;
+    }
+    ewsfs_dedup_put(&index->blocks, (ewsfs_dedup_slot_t) {.key = block, .refs = 2});
+    index->references += 2;
+}
+
+void ewsfs_dedup_insert_unhashed(ewsfs_dedup_index_t* index, uint64_t block) {
+    if (!ewsfs_dedup_get(&index->blocks, block))
+        ewsfs_dedup_put(&index->blocks, (ewsfs_dedup_slot_t) {.key = block});
+}
+
+bool ewsfs_dedup_find(const ewsfs_dedup_index_t* index, uint64_t hash, uint64_t* block) {
+    ewsfs_dedup_slot_t* slot = ewsfs_dedup_get(&index->hashes, hash);
+    if (!slot)
+        return false;
+    *block = slot->value;
+    return true;
+}
+
+uint64_t ewsfs_dedup_refs(const ewsfs_dedup_index_t* index, uint64_t block) {
+    ewsfs_dedup_slot_t* slot = ewsfs_dedup_get(&index->blocks, block);
+    return slot ? slot->refs : 0;
+}
+
+void ewsfs_dedup_ref(ewsfs_dedup_index_t* index, uint64_t block) {
+    ewsfs_dedup_slot_t* slot = ewsfs_dedup_get(&index->blocks, block);
+    if (!slot)
+        return;
+    slot->refs++;
+    index->references++;
+}
+
+bool ewsfs_dedup_unref(ewsfs_dedup_index_t* index, uint64_t block) {
+    ewsfs_dedup_slot_t* slot = ewsfs_dedup_get(&index->blocks, block);
+    if (!slot)
+        return true;
+    if (slot->refs > 0) {
+        slot->refs--;
+        index->references--;
+    }
+    // An unhashed block with one reference left isn't shared anymore, so it's a normal block again
+    if (!slot->hashed && slot->refs == 1) {
+        index->references--;
+        ewsfs_dedup_remove(&index->blocks, block);
+        return false;
+    }
+    if (slot->refs > 0)
+        return false;
+    if (slot->hashed)
+        ewsfs_dedup_remove(&index->hashes, slot->value);
+    ewsfs_dedup_remove(&index->blocks, block);
+    return true;
+}
+
+void ewsfs_dedup_move(ewsfs_dedup_index_t* index, uint64_t from, uint64_t to) {
+    ewsfs_dedup_slot_t* slot = ewsfs_dedup_get(&index->blocks, from);
+    if (!slot)
+        return;
+    ewsfs_dedup_slot_t moved = *slot;
+    moved.key = to;
+    ewsfs_dedup_remove(&index->blocks, from);
+    ewsfs_dedup_put(&index->blocks, moved);
+    if (moved.hashed)
+        ewsfs_dedup_get(&index->hashes, moved.value)->value = to;
+}
+
+void ewsfs_dedup_prune(ewsfs_dedup_index_t* index) {
+    // Removing moves slots back, so only go on once the slot holds a block that stays
+    for (size_t i = 0; i < index->blocks.capacity; ) {
+        ewsfs_dedup_slot_t slot = index->blocks.slots[i];
+        if (!slot.used || slot.refs > (slot.hashed ? 0 : 1)) {
+            ++i;
+            continue;
+        }
+        index->references -= slot.refs;
+        ewsfs_dedup_remove(&index->blocks, slot.key);
+        if (slot.hashed)
+            ewsfs_dedup_remove(&index->hashes, slot.value);
+    }
+}
+
+#define DEDUP_MAGIC "EWSFSDDP"
+#define DEDUP_HEADER_SIZE 32
+
+// The stored index is little endian, whatever the host is
+static void dedup_put64(uint8_t* p, uint64_t value) {
+    for (int i = 0; i < 8; ++i)
+        p[i] = (uint8_t) (value >> i*8);
+}
+
+static uint64_t dedup_get64(const uint8_t* p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value |= (uint64_t) p[i] << i*8;
+    return value;
+}
+
+static int dedup_compare_blocks(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+uint8_t* ewsfs_dedup_serialize(const ewsfs_dedup_index_t* index, size_t* size) {
+    // Blocks shared by cloning come in whole extents, so they're stored as ranges
+    size_t unhashed_count = index->blocks.count - index->hashes.count;
+    uint64_t* unhashed = malloc((unhashed_count > 0 ? unhashed_count : 1)*sizeof(*unhashed));
+    if (!unhashed)
+        return NULL;
+    size_t found = 0;
+    for (size_t i = 0; i < index->blocks.capacity; ++i) {
+        if (index->blocks.slots[i].used && !index->blocks.slots[i].hashed)
+            unhashed[found++] = index->blocks.slots[i].key;
+    }
+    qsort(unhashed, found, sizeof(*unhashed), dedup_compare_blocks);
+    size_t range_count = 0;
+    for (size_t i = 0; i < found; ++i)
+        range_count += i == 0 || unhashed[i] != unhashed[i - 1] + 1;
+
+    *size = DEDUP_HEADER_SIZE + (index->hashes.count + range_count)*16;
+    uint8_t* data = malloc(*size);
+    if (!data) {
+        free(unhashed);
+        return NULL;
+    }
+    uint8_t* p = data + DEDUP_HEADER_SIZE;
+    for (size_t i = 0; i < index->blocks.capacity; ++i) {
+        const ewsfs_dedup_slot_t* slot = &index->blocks.slots[i];
+        if (!slot->used || !slot->hashed)
+            continue;
+        dedup_put64(p, slot->key);
+        dedup_put64(p + 8, slot->value);
+        p += 16;
+    }
+    for (size_t i = 0; i < found; ) {
+        size_t run_end = i + 1;
+        while (run_end < found && unhashed[run_end] == unhashed[run_end - 1] + 1)
+            ++run_end;
+        dedup_put64(p, unhashed[i]);
+        dedup_put64(p + 8, run_end - i);
+        p += 16;
+        i = run_end;
+    }
+    free(unhashed);
+
+    memcpy(data, DEDUP_MAGIC, 8);
+    dedup_put64(data + 8, index->hashes.count);
+    dedup_put64(data + 16, range_count);
+    dedup_put64(data + 24, ewsfs_dedup_hash(data + DEDUP_HEADER_SIZE, *size - DEDUP_HEADER_SIZE));
+    return data;
+}
+
+bool ewsfs_dedup_deserialize(ewsfs_dedup_index_t* index, const uint8_t* data, size_t size) {
+    if (size < DEDUP_HEADER_SIZE || memcmp(data, DEDUP_MAGIC, 8) != 0)
+        return false;
+    uint64_t hashed_count = dedup_get64(data + 8);
+    uint64_t range_count = dedup_get64(data + 16);
+    if (hashed_count > size / 16 || range_count > size / 16 || DEDUP_HEADER_SIZE + (hashed_count + range_count)*16 > size)
+        return false;
+    size_t stored_size = DEDUP_HEADER_SIZE + (hashed_count + range_count)*16;
+    if (dedup_get64(data + 24) != ewsfs_dedup_hash(data + DEDUP_HEADER_SIZE, stored_size - DEDUP_HEADER_SIZE))
+        return false;
+    const uint8_t* p = data + DEDUP_HEADER_SIZE;
+    for (uint64_t i = 0; i < hashed_count; ++i, p += 16)
+        ewsfs_dedup_insert(index, dedup_get64(p + 8), dedup_get64(p), 0);
+    for (uint64_t i = 0; i < range_count; ++i, p += 16) {
+        uint64_t from = dedup_get64(p);
+        uint64_t length = dedup_get64(p + 8);
+        for (uint64_t block = from; block < from + length; ++block)
+            ewsfs_dedup_insert_unhashed(index, block);
+    }
+    return true;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// One slot of an open addressing table. `value`, `refs` and `hashed` are only used by the table they're needed in.
+typedef struct {
+    bool used;
+    bool hashed;
+    uint64_t key;
+    uint64_t value;
+    uint64_t refs;
+} ewsfs_dedup_slot_t;
+
+typedef struct {
+    ewsfs_dedup_slot_t* slots;
+    size_t capacity;
+    size_t count;
+} ewsfs_dedup_table_t;
+
+// The content hash index of deduplicated blocks. Every indexed block has a reference count, the amount of
+// times it's used by files. Blocks that aren't indexed are only used once.
+// Blocks that are shared by cloning a file are indexed without a hash, and only while they're shared.
+typedef struct {
+    // hash -> block
+    ewsfs_dedup_table_t hashes;
+    // block -> hash (if it's hashed), with the reference count
+    ewsfs_dedup_table_t blocks;
+    // The sum of the reference counts
+    uint64_t references;
+} ewsfs_dedup_index_t;
+
+// 64-bit hash of a block's contents (XXH64)
+uint64_t ewsfs_dedup_hash(const uint8_t* data, size_t size);
+
+void ewsfs_dedup_clear(ewsfs_dedup_index_t* index);
+void ewsfs_dedup_free(ewsfs_dedup_index_t* index);
+// Index `block` with `refs` references. Returns false if the hash or the block is indexed already.
+bool ewsfs_dedup_insert(ewsfs_dedup_index_t* index, uint64_t hash, uint64_t block, uint64_t refs);
+// Find the block that was indexed with `hash`
+bool ewsfs_dedup_find(const ewsfs_dedup_index_t* index, uint64_t hash, uint64_t* block);
+// The reference count of a block, 0 if it isn't indexed
+uint64_t ewsfs_dedup_refs(const ewsfs_dedup_index_t* index, uint64_t block);
+// Add a reference to an indexed block
+void ewsfs_dedup_ref(ewsfs_dedup_index_t* index, uint64_t block);
+// Add a reference to any block. A block that isn't indexed yet is indexed without a hash, with its first
+// reference and the new one.
+void ewsfs_dedup_share(ewsfs_dedup_index_t* index, uint64_t block);
+// Index `block` without a hash and without references, e.g. while loading the index
+void ewsfs_dedup_insert_unhashed(ewsfs_dedup_index_t* index, uint64_t block);
+// Drop a reference to a block. Returns true if nothing uses the block anymore, so it can be freed.
+// Blocks that aren't indexed only have the one reference.
+bool ewsfs_dedup_unref(ewsfs_dedup_index_t* index, uint64_t block);
+// The contents of an indexed block moved to `to`, e.g. by the defragmenter
+void ewsfs_dedup_move(ewsfs_dedup_index_t* index, uint64_t from, uint64_t to);
+// Remove the blocks without references, and the unhashed ones that aren't shared anymore, e.g. after counting
+// the references of a FACT that was just loaded
+void ewsfs_dedup_prune(ewsfs_dedup_index_t* index);
+// The index as it's stored on the image: a header with the amount of hashed blocks and shared ranges and a
+// checksum of the rest, then (block, hash) pairs and (from, length) ranges of shared blocks, all as little endian
+// 64-bit numbers. Reference counts aren't stored. Returns a buffer of `size` bytes, or NULL if out of memory.
+uint8_t* ewsfs_dedup_serialize(const ewsfs_dedup_index_t* index, size_t* size);
+// Add the entries of a stored index, without references. Returns false if it's damaged.
+bool ewsfs_dedup_deserialize(ewsfs_dedup_index_t* index, const uint8_t* data, size_t size);
@@ -0,0 +1,103 @@
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "defrag.h"
+#include "fact.h"
+#include "log.h"
+
+// The amount of packed blocks compacted per turn
+#define COMPACT_STEP_BLOCKS 16
+
+static pthread_t defrag_thread;
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_wake = PTHREAD_COND_INITIALIZER;
+static bool defrag_running = false;
+static unsigned int defrag_interval = 0;
+
+static bool ewsfs_defrag_is_running() {
+    pthread_mutex_lock(&defrag_lock);
+    bool running = defrag_running;
+    pthread_mutex_unlock(&defrag_lock);
+    return running;
+}
+
+static bool ewsfs_defrag_wait() {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += defrag_interval;
+    pthread_mutex_lock(&defrag_lock);
+    while (defrag_running) {
+        if (pthread_cond_timedwait(&defrag_wake, &defrag_lock, &until) == ETIMEDOUT)
+            break;
+    }
+    bool running = defrag_running;
+    pthread_mutex_unlock(&defrag_lock);
+    return running;
+}
+
+static void* ewsfs_defrag_thread(void* arg) {
+    (void) arg;
+    // Only this thread gets the lowest priority, the FUSE threads stay as they are
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), 19);
+
+    while (ewsfs_defrag_wait()) {
+        // One file per turn, so file operations don't have to wait for a whole pass
+        uint64_t total = 0;
+        uint64_t moved_count = 0;
+        do {
+            ewsfs_fact_lock(true);
+            int error = ewsfs_fact_defrag(EWSFS_DEFRAG_MIN_FRAGMENTS, 1, &moved_count);
+            ewsfs_fact_unlock();
+            if (error < 0) {
+                ewsfs_log("[DEFRAG] Failed with error %d", error);
+                break;
+            }
+            total += moved_count;
+        } while (moved_count > 0 && ewsfs_defrag_is_running());
+        if (total > 0)
+            ewsfs_log("[DEFRAG] Moved %"PRIu64" files", total);
+
+        // Packed blocks that lost files are compacted in the same pass
+        total = 0;
+        uint64_t freed_count = 0;
+        do {
+            ewsfs_fact_lock(true);
+            int error = ewsfs_fact_compact(COMPACT_STEP_BLOCKS, &freed_count);
+            ewsfs_fact_unlock();
+            if (error < 0) {
+                ewsfs_log("[DEFRAG] Compacting failed with error %d", error);
+                break;
+            }
+            total += freed_count;
+        } while (freed_count > 0 && ewsfs_defrag_is_running());
+        if (total > 0)
+            ewsfs_log("[DEFRAG] Compacting freed %"PRIu64" packed blocks", total);
+    }
+    return NULL;
+}
+
+bool ewsfs_defrag_start(unsigned int interval) {
+    if (interval == 0 || defrag_running)
+        return true;
+    defrag_interval = interval;
+    defrag_running = true;
+    if (pthread_create(&defrag_thread, NULL, ewsfs_defrag_thread, NULL) != 0) {
+        defrag_running = false;
+        return false;
+    }
+    return true;
+}
+
+void ewsfs_defrag_stop() {
+    pthread_mutex_lock(&defrag_lock);
+    bool running = defrag_running;
+    defrag_running = false;
+    pthread_cond_signal(&defrag_wake);
+    pthread_mutex_unlock(&defrag_lock);
+    if (running)
+        pthread_join(defrag_thread, NULL);
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Files with at least this many fragments are moved by the background defragmenter
+#define EWSFS_DEFRAG_MIN_FRAGMENTS 8
+
+// Start a low priority thread that defragments files and compacts packed blocks every `interval` seconds.
+// Has to be called after FUSE has forked into the background, threads don't survive the fork.
+bool ewsfs_defrag_start(unsigned int interval);
+void ewsfs_defrag_stop();
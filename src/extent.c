@@ -0,0 +1,65 @@
+#include <string.h>
+#include "extent.h"
+#define NOB_STRIP_PREFIX
+#include "nob.h"
+
+void ewsfs_extent_set_add(ewsfs_extent_set_t* set, uint64_t from, uint64_t length) {
+    if (length == 0)
+        return;
+    uint64_t to = from + length;
+
+    // Find the first extent that ends at or after `from`; the extents are sorted and don't overlap,
+    // so their ends are sorted as well. That one and the ones after it may touch the new extent.
+    size_t low = 0;
+    size_t high = set->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (set->items[middle].from + set->items[middle].length < from)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    size_t first = low;
+    size_t last = first;
+    while (last < set->count && set->items[last].from <= to) {
+        uint64_t item_to = set->items[last].from + set->items[last].length;
+        if (set->items[last].from < from)
+            from = set->items[last].from;
+        if (item_to > to)
+            to = item_to;
+        ++last;
+    }
+
+    ewsfs_extent_t merged = {from, to - from};
+    if (first == last) {
+        // Nothing to merge with, so make room for the new extent
+        da_append(set, merged);
+        memmove(&set->items[first + 1], &set->items[first], (set->count - 1 - first)*sizeof(*set->items));
+        set->items[first] = merged;
+        return;
+    }
+    // Replace the extents from `first` up to `last` by the merged one
+    set->items[first] = merged;
+    memmove(&set->items[first + 1], &set->items[last], (set->count - last)*sizeof(*set->items));
+    set->count -= last - first - 1;
+}
+
+uint64_t ewsfs_extent_set_blocks(const ewsfs_extent_set_t* set) {
+    uint64_t blocks = 0;
+    for (size_t i = 0; i < set->count; ++i)
+        blocks += set->items[i].length;
+    return blocks;
+}
+
+bool ewsfs_extent_set_contains(const ewsfs_extent_set_t* set, uint64_t block) {
+    size_t low = 0;
+    size_t high = set->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (set->items[middle].from + set->items[middle].length <= block)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < set->count && set->items[low].from <= block;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct {
+    uint64_t from;
+    uint64_t length;
+} ewsfs_extent_t;
+
+// A set of block ranges, kept sorted by `from`. Touching and overlapping extents are merged when they're added.
+typedef struct {
+    ewsfs_extent_t* items;
+    size_t count;
+    size_t capacity;
+} ewsfs_extent_set_t;
+
+void ewsfs_extent_set_add(ewsfs_extent_set_t* set, uint64_t from, uint64_t length);
+bool ewsfs_extent_set_contains(const ewsfs_extent_set_t* set, uint64_t block);
+// The total amount of blocks in the set
+uint64_t ewsfs_extent_set_blocks(const ewsfs_extent_set_t* set);
@@ -1,8 +1,15 @@
 #include <inttypes.h>
+#include <linux/falloc.h>
+#include <pthread.h>
 #include <string.h>
 #include <time.h>
 #include "fact.h"
+#include "base64.h"
 #include "block.h"
+#include "dedup.h"
+#include "lz.h"
+#include "pack.h"
+#include "readahead.h"
 #define NOB_STRIP_PREFIX
 #include "nob.h"
 
@@ -11,28 +18,48 @@
 #define FACT_END_ADDRESS_SIZE 8
 
 ewsfs_block_index_list_t fact_block_indexes = {0};
-ewsfs_block_index_list_t used_block_indexes = {0};
+ewsfs_allocator_t block_allocator = {0};
+// Blocks that were freed since the last FACT commit. They're only handed back to the allocator once
+// a FACT that doesn't use them anymore is on the image, so they can't be overwritten while the FACT on the image still points to them.
+ewsfs_extent_set_t freed_extents = {0};
 cJSON* fact_root;
 ewsfs_fact_buffer_t fact_current_file_on_disk = {0};
 ewsfs_fact_buffer_t fact_file_buffer = {0};
-static FILE* fsfile;
-
-bool ewsfs_fact_read_from_image(FILE* file, ewsfs_fact_buffer_t* buffer) {
+static ewsfs_block_device_t* fsdevice;
+static pthread_rwlock_t fact_lock = PTHREAD_RWLOCK_INITIALIZER;
+// Compress file data when it's flushed, see ewsfs_fact_set_compression
+static bool compress_files = false;
+// Blocks with the same contents are shared between files, see ewsfs_fact_set_dedup.
+// The index is kept in blocks of its own, see ewsfs_fact_store_dedup; it's only written out again when it changed.
+static bool dedup_files = false;
+static bool dedup_changed = false;
+ewsfs_dedup_index_t dedup_index = {0};
+// Files up to this size are kept in their FACT item, see ewsfs_fact_set_inline_limit
+static uint64_t inline_limit = 0;
+// Files up to this size share blocks with other small files, see ewsfs_fact_set_pack_limit
+static uint64_t pack_limit = 0;
+ewsfs_pack_index_t pack_index = {0};
+// Counts the commits, see ewsfs_fact_set_generation
+static uint64_t fact_generation = 0;
+
+// Read the FACT chain into `buffer`, with the indexes of its blocks in `indexes`
+static bool ewsfs_fact_read_chain(ewsfs_block_device_t* device, ewsfs_fact_buffer_t* buffer, ewsfs_block_index_list_t* indexes) {
     uint8_t temp_buffer[EWSFS_BLOCK_SIZE];
     uint64_t current_block_index = 0;
     do {
+        // A chain that's longer than the image loops
+        if (indexes->count >= ewsfs_block_get_count())
+            return false;
         // Read the next block
-        if (ewsfs_block_read(file, current_block_index, temp_buffer) != 0)
+        if (ewsfs_block_read(device, current_block_index, temp_buffer) != 0)
             return false;
-        // Add the current block index to the lists of used indexes
-        da_append(&fact_block_indexes, current_block_index);
-        da_append(&used_block_indexes, current_block_index);
+        da_append(indexes, current_block_index);
 
         // Get the next block index
         current_block_index = 0;
         for (int i = 0; i < FACT_END_ADDRESS_SIZE; ++i) {
             int buffer_index = EWSFS_BLOCK_SIZE - i - 1;
-            current_block_index |= temp_buffer[buffer_index] << i*8;
+            current_block_index |= (uint64_t) temp_buffer[buffer_index] << i*8;
         }
 
         // We need to trim off at least the address at the end of the block
@@ -53,13 +80,28 @@ bool ewsfs_fact_read_from_image(FILE* file, ewsfs_fact_buffer_t* buffer) {
     return true;
 }
 
+bool ewsfs_fact_read_from_image(ewsfs_block_device_t* device, ewsfs_fact_buffer_t* buffer) {
+    size_t first = fact_block_indexes.count;
+    bool result = ewsfs_fact_read_chain(device, buffer, &fact_block_indexes);
+    // Mark the blocks of the FACT as used
+    for (size_t i = first; i < fact_block_indexes.count; ++i)
+        ewsfs_alloc_set_used(&block_allocator, fact_block_indexes.items[i], 1);
+    return result;
+}
+
 // Always call this function AFTER reading the FACT at least once
-bool ewsfs_fact_write_to_image(FILE* file, const ewsfs_fact_buffer_t buffer) {
+bool ewsfs_fact_write_to_image(ewsfs_block_device_t* device, const ewsfs_fact_buffer_t buffer) {
     uint64_t fact_size_per_block = EWSFS_BLOCK_SIZE - FACT_END_ADDRESS_SIZE;
     double amount_of_blocks_double = buffer.count / (double) fact_size_per_block;
     // Ceil the amount_of_blocks_double value
     size_t amount_of_blocks = amount_of_blocks_double > (size_t) amount_of_blocks_double ? (size_t) amount_of_blocks_double + 1 : (size_t) amount_of_blocks_double;
 
+    // All FACT blocks are prepared first and then written as one batch
+    uint8_t* blocks = calloc(amount_of_blocks, EWSFS_BLOCK_SIZE);
+    ewsfs_block_range_t* ranges = malloc(amount_of_blocks*sizeof(*ranges));
+    struct iovec* iovs = malloc(amount_of_blocks*sizeof(*iovs));
+    bool result = true;
+
     for (size_t i = 0; i < amount_of_blocks; ++i) {
         bool is_last_block = i == amount_of_blocks - 1;
 
@@ -68,15 +110,18 @@ bool ewsfs_fact_write_to_image(FILE* file, const ewsfs_fact_buffer_t buffer) {
             (!is_last_block && i + 1 >= fact_block_indexes.count) ||
             ( is_last_block && i     >= fact_block_indexes.count)
         ) {
+            // Keep the chain in the group of its last block
             uint64_t new_block_index = 0;
-            if (!ewsfs_block_get_next_free_index(&used_block_indexes, &new_block_index))
-                return false;
+            uint64_t hint = ewsfs_alloc_hint_for_block(&block_allocator, fact_block_indexes.items[fact_block_indexes.count - 1]);
+            if (!ewsfs_block_get_next_free_index(&block_allocator, hint, &new_block_index)) {
+                result = false;
+                goto defer;
+            }
             da_append(&fact_block_indexes, new_block_index);
         }
 
         // The block we'll be writing to the file
-        uint8_t current_block[EWSFS_BLOCK_SIZE];
-        memset(current_block, 0, EWSFS_BLOCK_SIZE);
+        uint8_t* current_block = blocks + i*EWSFS_BLOCK_SIZE;
 
         // Copy the data of the current FACT block to current_block
         uint64_t current_block_index = fact_block_indexes.items[i];
@@ -93,11 +138,304 @@ bool ewsfs_fact_write_to_image(FILE* file, const ewsfs_fact_buffer_t buffer) {
             }
         }
 
-        // Write current_block to the file
-        if (ewsfs_block_write(file, current_block_index, current_block) != 0)
-            return false;
+        iovs[i] = (struct iovec) {current_block, EWSFS_BLOCK_SIZE};
+        ranges[i] = (ewsfs_block_range_t) {current_block_index, 1, &iovs[i], 1};
     }
-    return true;
+
+    // Write the blocks to the file
+    if (ewsfs_block_write_ranges(device, ranges, amount_of_blocks) != 0) {
+        result = false;
+        goto defer;
+    }
+
+    // If the FACT shrunk, the end of the old chain isn't used anymore
+    for (size_t i = amount_of_blocks > 0 ? amount_of_blocks : 1; i < fact_block_indexes.count; ++i)
+        ewsfs_extent_set_add(&freed_extents, fact_block_indexes.items[i], 1);
+    if (amount_of_blocks > 0 && fact_block_indexes.count > amount_of_blocks)
+        fact_block_indexes.count = amount_of_blocks;
+defer:
+    free(blocks);
+    free(ranges);
+    free(iovs);
+    return result;
+}
+
+// Count the references to indexed blocks in the allocations of the files in `dir`
+static void ewsfs_fact_count_dedup_refs(cJSON* dir) {
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, cJSON_GetObjectItemCaseSensitive(dir, "contents")) {
+        if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(item, "is_dir"))) {
+            ewsfs_fact_count_dedup_refs(item);
+            continue;
+        }
+        cJSON* alloc_item = NULL;
+        cJSON_ArrayForEach(alloc_item, cJSON_GetObjectItemCaseSensitive(item, "allocation")) {
+            // Unwritten blocks are never shared, and packed blocks are counted by the pack index
+            if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(alloc_item, "hole"))
+             || cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(alloc_item, "unwritten"))
+             || cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(alloc_item, "offset")))
+                continue;
+            uint64_t from = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "from"));
+            uint64_t length = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "length"));
+            for (uint64_t block = from; block < from + length; ++block)
+                ewsfs_dedup_ref(&dedup_index, block);
+        }
+    }
+}
+
+// Find the blocks that more than one file uses, for when the stored index is lost. Their hashes are gone with it,
+// so they're indexed like blocks shared by cloning.
+static void ewsfs_fact_find_shared_blocks(cJSON* dir, ewsfs_bitmap_t* seen) {
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, cJSON_GetObjectItemCaseSensitive(dir, "contents")) {
+        if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(item, "is_dir"))) {
+            ewsfs_fact_find_shared_blocks(item, seen);
+            continue;
+        }
+        cJSON* alloc_item = NULL;
+        cJSON_ArrayForEach(alloc_item, cJSON_GetObjectItemCaseSensitive(item, "allocation")) {
+            if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(alloc_item, "hole"))
+             || cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(alloc_item, "unwritten"))
+             || cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(alloc_item, "offset")))
+                continue;
+            uint64_t from = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "from"));
+            uint64_t length = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "length"));
+            for (uint64_t block = from; block < from + length; ++block) {
+                if (ewsfs_bitmap_is_used(seen, block))
+                    ewsfs_dedup_insert_unhashed(&dedup_index, block);
+                else
+                    ewsfs_bitmap_set_used(seen, block, 1);
+            }
+        }
+    }
+}
+
+// Read the index from the blocks `"dedup_index"` points to. Returns false if they can't be read or don't hold an index.
+static bool ewsfs_fact_read_dedup_index(ewsfs_block_device_t* device, cJSON* stored) {
+    bool result = true;
+    uint64_t block_size = ewsfs_block_get_size();
+    uint64_t size = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(stored, "size"));
+    cJSON* allocation = cJSON_GetObjectItemCaseSensitive(stored, "allocation");
+    size_t range_count = (size_t) cJSON_GetArraySize(allocation);
+    uint64_t block_count = 0;
+    cJSON* alloc_item = NULL;
+    cJSON_ArrayForEach(alloc_item, allocation)
+        block_count += (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "length"));
+    if (range_count == 0 || block_count*block_size < size)
+        return false;
+
+    uint8_t* data = malloc(block_count*block_size);
+    ewsfs_block_range_t* ranges = malloc(range_count*sizeof(*ranges));
+    struct iovec* iovs = malloc(range_count*sizeof(*iovs));
+    if (!data || !ranges || !iovs)
+        return_defer(false);
+    size_t i = 0;
+    uint64_t offset = 0;
+    cJSON_ArrayForEach(alloc_item, allocation) {
+        uint64_t from = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "from"));
+        uint64_t length = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "length"));
+        iovs[i] = (struct iovec) {data + offset, length*block_size};
+        ranges[i] = (ewsfs_block_range_t) {from, length, &iovs[i], 1};
+        offset += length*block_size;
+        i++;
+    }
+    if (ewsfs_block_read_ranges(device, ranges, range_count) != 0)
+        return_defer(false);
+    result = ewsfs_dedup_deserialize(&dedup_index, data, size);
+defer:
+    free(data);
+    free(ranges);
+    free(iovs);
+    return result;
+}
+
+// Load the dedup index of a (validated) FACT. The reference counts aren't stored, they're counted from the allocations.
+static void ewsfs_fact_load_dedup(ewsfs_block_device_t* device, cJSON* root) {
+    ewsfs_dedup_clear(&dedup_index);
+    dedup_changed = false;
+    // Older FACTs keep the index in `"dedup"` and `"shared"`, it's moved to blocks of its own with the next save
+    cJSON* entry = NULL;
+    cJSON_ArrayForEach(entry, cJSON_GetObjectItemCaseSensitive(root, "dedup")) {
+        uint64_t block = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(entry, "block"));
+        uint64_t hash = strtoull(cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(entry, "hash")), NULL, 16);
+        ewsfs_dedup_insert(&dedup_index, hash, block, 0);
+        dedup_changed = true;
+    }
+    cJSON_ArrayForEach(entry, cJSON_GetObjectItemCaseSensitive(root, "shared")) {
+        uint64_t from = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(entry, "from"));
+        uint64_t length = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(entry, "length"));
+        for (uint64_t block = from; block < from + length; ++block)
+            ewsfs_dedup_insert_unhashed(&dedup_index, block);
+        dedup_changed = true;
+    }
+    cJSON* stored = cJSON_GetObjectItemCaseSensitive(root, "dedup_index");
+    if (stored && !ewsfs_fact_read_dedup_index(device, stored)) {
+        // Without the index, a block that two files use would be freed when one of them lets go of it
+        nob_log(WARNING, "The dedup index is damaged, looking for blocks that files share instead");
+        ewsfs_dedup_clear(&dedup_index);
+        ewsfs_bitmap_t seen = {0};
+        if (ewsfs_bitmap_init(&seen, ewsfs_block_get_count())) {
+            ewsfs_fact_find_shared_blocks(root, &seen);
+            ewsfs_bitmap_uninit(&seen);
+        }
+        dedup_changed = true;
+    }
+    if (dedup_index.blocks.count == 0)
+        return;
+    ewsfs_fact_count_dedup_refs(root);
+    // Entries of blocks that no file uses anymore are dropped with the next save
+    size_t count = dedup_index.blocks.count;
+    ewsfs_dedup_prune(&dedup_index);
+    if (dedup_index.blocks.count != count)
+        dedup_changed = true;
+}
+
+// Add the packed allocations of the files in `dir` to the pack index
+static void ewsfs_fact_count_packed(cJSON* dir) {
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, cJSON_GetObjectItemCaseSensitive(dir, "contents")) {
+        if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(item, "is_dir"))) {
+            ewsfs_fact_count_packed(item);
+            continue;
+        }
+        cJSON* alloc_item = NULL;
+        cJSON_ArrayForEach(alloc_item, cJSON_GetObjectItemCaseSensitive(item, "allocation")) {
+            cJSON* offset = cJSON_GetObjectItemCaseSensitive(alloc_item, "offset");
+            if (!cJSON_IsNumber(offset))
+                continue;
+            uint64_t from = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "from"));
+            uint64_t size = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "size"));
+            ewsfs_pack_add(&pack_index, from, (uint64_t) cJSON_GetNumberValue(offset), size);
+        }
+    }
+}
+
+// Rebuild the pack index of a (validated) FACT. New files go into the block with the most room left.
+static void ewsfs_fact_load_pack_index(cJSON* root) {
+    ewsfs_pack_clear(&pack_index);
+    ewsfs_fact_count_packed(root);
+    ewsfs_pack_pick_current(&pack_index, ewsfs_block_get_size());
+}
+
+// The index is kept in blocks of its own that `"dedup_index"` points to, so commits that don't change it don't
+// rewrite it. It goes to new blocks that reach the image before the FACT does; the old ones are freed by the commit.
+static void ewsfs_fact_store_dedup(cJSON* root) {
+    if (!dedup_changed)
+        return;
+    dedup_changed = false;
+    cJSON_DeleteItemFromObjectCaseSensitive(root, "dedup");
+    cJSON_DeleteItemFromObjectCaseSensitive(root, "shared");
+    cJSON* alloc_item = NULL;
+    cJSON_ArrayForEach(alloc_item, cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(root, "dedup_index"), "allocation")) {
+        uint64_t from = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "from"));
+        uint64_t length = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "length"));
+        ewsfs_extent_set_add(&freed_extents, from, length);
+    }
+    cJSON_DeleteItemFromObjectCaseSensitive(root, "dedup_index");
+    if (dedup_index.blocks.count == 0)
+        return;
+
+    uint64_t block_size = ewsfs_block_get_size();
+    size_t size = 0;
+    uint8_t* data = ewsfs_dedup_serialize(&dedup_index, &size);
+    uint64_t block_count = (size + block_size - 1)/block_size;
+    ewsfs_extent_set_t extents = {0};
+    ewsfs_block_range_t* ranges = NULL;
+    struct iovec* iovs = NULL;
+    bool written = data != NULL;
+    for (uint64_t allocated = 0; written && allocated < block_count;) {
+        uint64_t from, length;
+        if (!ewsfs_block_allocate_extent(&block_allocator, 0, block_count - allocated, &from, &length)) {
+            written = false;
+            break;
+        }
+        ewsfs_extent_set_add(&extents, from, length);
+        allocated += length;
+    }
+    if (written) {
+        uint8_t* padded = realloc(data, block_count*block_size);
+        ranges = malloc(extents.count*sizeof(*ranges));
+        iovs = malloc(extents.count*sizeof(*iovs));
+        written = padded && ranges && iovs;
+        if (padded)
+            data = padded;
+    }
+    if (written) {
+        memset(data + size, 0, block_count*block_size - size);
+        uint64_t offset = 0;
+        for (size_t i = 0; i < extents.count; ++i) {
+            iovs[i] = (struct iovec) {data + offset, extents.items[i].length*block_size};
+            ranges[i] = (ewsfs_block_range_t) {extents.items[i].from, extents.items[i].length, &iovs[i], 1};
+            offset += extents.items[i].length*block_size;
+        }
+        written = ewsfs_block_write_ranges(fsdevice, ranges, extents.count) == 0 && ewsfs_block_sync(fsdevice) == 0;
+    }
+
+    cJSON* stored = cJSON_AddObjectToObject(root, "dedup_index");
+    cJSON* allocation = cJSON_AddArrayToObject(stored, "allocation");
+    if (written) {
+        cJSON_AddNumberToObject(stored, "size", (double) size);
+        for (size_t i = 0; i < extents.count; ++i) {
+            cJSON* entry = cJSON_CreateObject();
+            cJSON_AddNumberToObject(entry, "from", (double) extents.items[i].from);
+            cJSON_AddNumberToObject(entry, "length", (double) extents.items[i].length);
+            cJSON_AddItemToArray(allocation, entry);
+        }
+    } else {
+        // An index without blocks counts as damaged, so the shared blocks are looked for again on the next mount
+        nob_log(ERROR, "Couldn't write the dedup index");
+        cJSON_AddNumberToObject(stored, "size", 0);
+        for (size_t i = 0; i < extents.count; ++i)
+            ewsfs_alloc_set_free(&block_allocator, extents.items[i].from, extents.items[i].length);
+        dedup_changed = true;
+    }
+    da_free(extents);
+    free(data);
+    free(ranges);
+    free(iovs);
+}
+
+// Every commit stores the next generation in the FACT, so the images of a mirror that missed commits can be told
+// apart from the ones that have the newest FACT
+static void ewsfs_fact_set_generation(cJSON* root, uint64_t generation) {
+    cJSON* fs_info = cJSON_GetObjectItemCaseSensitive(root, "filesystem_info");
+    cJSON* item = cJSON_GetObjectItemCaseSensitive(fs_info, "generation");
+    if (cJSON_IsNumber(item)) {
+        cJSON_SetNumberValue(item, (double) generation);
+        return;
+    }
+    cJSON_DeleteItemFromObjectCaseSensitive(fs_info, "generation");
+    cJSON_AddNumberToObject(fs_info, "generation", (double) generation);
+}
+
+// FACTs from before generations were added count as generation 0
+static uint64_t ewsfs_fact_get_generation(cJSON* root) {
+    cJSON* item = cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(root, "filesystem_info"), "generation");
+    return cJSON_IsNumber(item) ? (uint64_t) cJSON_GetNumberValue(item) : 0;
+}
+
+// Hand the blocks freed since the last commit back to the allocator. Only call this once the FACT is on the image.
+// With discarding enabled, they go through the discard queue first, which frees them once they're discarded.
+static void ewsfs_fact_release_freed_blocks() {
+    if (freed_extents.count == 0)
+        return;
+    ewsfs_log("[BLOCK] Released %"PRIu64" freed blocks in %zu extents", ewsfs_extent_set_blocks(&freed_extents), freed_extents.count);
+    for (size_t i = 0; i < freed_extents.count; ++i) {
+        if (!ewsfs_block_discard(fsdevice, freed_extents.items[i].from, freed_extents.items[i].length))
+            ewsfs_alloc_set_free(&block_allocator, freed_extents.items[i].from, freed_extents.items[i].length);
+    }
+    freed_extents.count = 0;
+}
+
+// Mark exactly the blocks used by the FACT chain and by the files in `root` as used
+static void ewsfs_fact_rebuild_used_blocks(cJSON* root) {
+    // Queued ranges would be freed again after the rebuild, while they may already be in use by then
+    ewsfs_block_cancel_discard(fsdevice);
+    ewsfs_alloc_clear(&block_allocator);
+    for (size_t i = 0; i < fact_block_indexes.count; ++i)
+        ewsfs_alloc_set_used(&block_allocator, fact_block_indexes.items[i], 1);
+    freed_extents.count = 0;
+    ewsfs_fact_validate(root);
 }
 
 int ewsfs_fact_file_truncate(off_t length) {
@@ -132,14 +470,40 @@ int ewsfs_fact_file_write(const char* buffer, size_t size, off_t offset) {
     return bytecount;
 }
 
-int ewsfs_fact_file_flush(FILE* file) {
+static int ewsfs_file_load_handles(cJSON* item);
+
+int ewsfs_fact_file_flush(ewsfs_block_device_t* device) {
+    // The new FACT can move or drop the blocks of open files
+    if (ewsfs_file_load_handles(NULL) < 0)
+        return EOF;
     cJSON* new_root = cJSON_ParseWithLength((char*) fact_file_buffer.items, fact_file_buffer.count);
-    if (!new_root || !ewsfs_fact_validate(new_root) || !ewsfs_fact_write_to_image(file, fact_file_buffer)) {
+    bool valid = new_root && ewsfs_fact_validate(new_root);
+    if (valid) {
+        // The written FACT is a commit as well, whatever generation it says it is
+        ewsfs_fact_set_generation(new_root, fact_generation + 1);
+        char* printed_json = cJSON_Print(new_root);
+        fact_file_buffer.count = 0;
+        sb_append_cstr(&fact_file_buffer, printed_json);
+        cJSON_free(printed_json);
+    }
+    if (!valid || !ewsfs_fact_write_to_image(device, fact_file_buffer)) {
         // If not successful, reset the fact_file_buffer
         fact_file_buffer.count = 0;
         da_append_many(&fact_file_buffer, fact_current_file_on_disk.items, fact_current_file_on_disk.count);
+        // Validating the new FACT may have marked blocks that the current one doesn't use
+        if (new_root) {
+            cJSON_Delete(new_root);
+            ewsfs_fact_rebuild_used_blocks(fact_root);
+        }
         return EOF;
     }
+    ewsfs_block_sync(device);
+    fact_generation++;
+    // The new FACT can drop files or allocations of the old one, so the used blocks and references follow it
+    ewsfs_fact_rebuild_used_blocks(new_root);
+    ewsfs_fact_load_dedup(device, new_root);
+    ewsfs_fact_load_pack_index(new_root);
+
     // If successful, copy the fact_file_buffer to the fact_current_file_on_disk
     fact_current_file_on_disk.count = 0;
     da_append_many(&fact_current_file_on_disk, fact_file_buffer.items, fact_file_buffer.count);
@@ -155,6 +519,8 @@ long ewsfs_fact_file_size() {
 }
 
 void ewsfs_fact_save_to_disk() {
+    ewsfs_fact_store_dedup(fact_root);
+    ewsfs_fact_set_generation(fact_root, ++fact_generation);
     // Make sure the FACT is valid
     assert(ewsfs_fact_validate(fact_root));
 
@@ -168,24 +534,16 @@ void ewsfs_fact_save_to_disk() {
     da_append_many(&fact_current_file_on_disk, fact_file_buffer.items, fact_file_buffer.count);
 
     // Make sure the JSON is written back properly
-    assert(ewsfs_fact_write_to_image(fsfile, fact_file_buffer));
+    assert(ewsfs_fact_write_to_image(fsdevice, fact_file_buffer));
 
-    // Flush the device or image file, so the changes are pushed to the disk
-    fflush(fsfile);
+    // This is a commit point, so make sure everything written so far reaches the image
+    ewsfs_block_sync(fsdevice);
+    ewsfs_fact_release_freed_blocks();
 
     ewsfs_log("[FACT] Saved fact.json");
 }
 
 
-typedef struct {
-    cJSON* item;
-    String_Builder buffer;
-    int flags;
-} file_handle_t;
-
-#define MAX_FILE_HANDLES 1024
-static file_handle_t file_handles[MAX_FILE_HANDLES];
-
 cJSON* ewsfs_file_get_item(const char* path) {
     String_View sv_path = sv_from_cstr(path);
     if (sv_path.count < 1) return NULL;
@@ -274,6 +632,22 @@ int ewsfs_file_getattr(const char* path, struct stat* st) {
         st->st_mode = S_IFREG | perms_int; // TODO: make permissions writable
         st->st_nlink = 2;
         st->st_size = (off_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(item, "file_size"));
+        // Holes don't count, so tools like `cp --sparse=auto` and `tar --sparse` can tell the file is sparse.
+        // A packed file only counts its part of the block, and an inline file its bytes in the FACT.
+        uint64_t allocated = 0;
+        if (cJSON_IsString(cJSON_GetObjectItemCaseSensitive(item, "inline_data")))
+            allocated += (uint64_t) st->st_size;
+        cJSON* alloc_item = NULL;
+        cJSON_ArrayForEach(alloc_item, cJSON_GetObjectItemCaseSensitive(item, "allocation")) {
+            if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(alloc_item, "hole")))
+                continue;
+            if (cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(alloc_item, "offset")))
+                allocated += (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "size"));
+            else
+                allocated += (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "length"))*ewsfs_block_get_size();
+        }
+        st->st_blksize = ewsfs_block_get_size();
+        st->st_blocks = (allocated + 511) / 512;
     }
 
     // Set universal stat fields
@@ -343,192 +717,1190 @@ int ewsfs_file_utimens(const char* path, const struct timespec tv[2]) {
     return 0;
 }
 
-static int ewsfs_file_read_from_disk(file_handle_t* file_handle) {
-    uint64_t file_size = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(file_handle->item, "file_size"));
-    uint64_t read_size = 0;
+// Make sure `buffer` can hold at least `size` bytes without reallocating
+static void ewsfs_file_buffer_reserve(String_Builder* buffer, size_t size) {
+    if (buffer->capacity >= size)
+        return;
+    buffer->capacity = size;
+    buffer->items = realloc(buffer->items, buffer->capacity);
+    assert(buffer->items != NULL && "Buy more RAM lol");
+}
 
-    // A temporary buffer for reading blocks
-    char temp_buffer[ewsfs_block_get_size()];
+typedef enum {
+    // Blocks on the image that hold file data
+    EWSFS_FILE_EXTENT_DATA,
+    // Preallocated blocks that were never written to; they read as zeroes without touching the image
+    EWSFS_FILE_EXTENT_UNWRITTEN,
+    // A range of the file without any blocks (`"hole": true` in the FACT); it reads as zeroes as well
+    EWSFS_FILE_EXTENT_HOLE,
+    // File data compressed into fewer blocks (`"codec"` in the FACT). It can only be read and written as a whole.
+    EWSFS_FILE_EXTENT_COMPRESSED,
+    // A file smaller than a block, in part of a block that other small files use as well (`"offset"` in the FACT).
+    // It's the only extent of its file.
+    EWSFS_FILE_EXTENT_PACKED,
+} ewsfs_file_extent_kind_t;
 
-    cJSON* allocation = cJSON_GetObjectItemCaseSensitive(file_handle->item, "allocation");
-    cJSON* alloc_item = NULL;
-    bool done = false;
-    cJSON_ArrayForEach(alloc_item, allocation) {
-        uint64_t from = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "from"));
-        uint64_t length = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "length"));
+typedef struct {
+    ewsfs_file_extent_kind_t kind;
+    // Not used for holes
+    uint64_t from;
+    // The amount of blocks of the file the extent covers
+    uint64_t length;
+    // Only used for compressed extents: the amount of blocks on the image, and the size of the compressed data
+    uint64_t physical;
+    uint64_t compressed_size;
+    // Only used for packed extents: where the file's data is in the block
+    uint64_t offset;
+    uint64_t size;
+} ewsfs_file_extent_t;
+
+// A file's allocation array in order, in a form that's easier to split and rebuild than the cJSON array
+typedef struct {
+    ewsfs_file_extent_t* items;
+    size_t count;
+    size_t capacity;
+} ewsfs_file_extent_list_t;
 
-        // Go over all blocks in this allocation item
-        for (uint64_t i = from; i < from + length; ++i) {
-            // Read this block into the temporary buffer
-            int error = ewsfs_block_read(fsfile, i, (uint8_t*) temp_buffer);
-            if (error)
-                return -error;
-            // Copy the temporary buffer into the file_handle buffer, until file_size is reached
-            for (size_t j = 0; j < ewsfs_block_get_size(); ++j) {
-                done = read_size >= file_size;
-                if (done)
-                    break;
-                if (read_size < file_handle->buffer.count)
-                    file_handle->buffer.items[read_size] = temp_buffer[j];
-                else
-                    da_append(&file_handle->buffer, temp_buffer[j]);
-                ++read_size;
-            }
-            if (done)
-                break;
+typedef struct {
+    cJSON* item;
+    // The whole file. It's loaded from the image as it's read, `loaded` is how much of it is there already.
+    // Once all of it is, `loaded` is FILE_HANDLE_LOADED and the buffer can be changed.
+    String_Builder buffer;
+    uint64_t loaded;
+    // The file's extents when it was opened, to load the rest of the buffer from
+    ewsfs_file_extent_list_t extents;
+    // Set while the buffer is being loaded, by a read or by the read-ahead thread
+    bool loading;
+    // Where the read-ahead thread has to load the buffer up to
+    uint64_t prefetch_end;
+    ewsfs_readahead_t readahead;
+    int flags;
+    // Set by a truncate, so the next write to disk gives back the blocks past the new end of the file
+    bool truncated;
+    // Set by writes and truncates. Blocks are only picked when a dirty handle is flushed, once the final size is known.
+    bool dirty;
+} file_handle_t;
+
+#define MAX_FILE_HANDLES 1024
+#define FILE_HANDLE_LOADED UINT64_MAX
+static file_handle_t file_handles[MAX_FILE_HANDLES];
+// Protects `loaded`, `loading` and `prefetch_end` of the file handles, which the read-ahead thread uses as well
+static pthread_mutex_t handle_load_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handle_loaded = PTHREAD_COND_INITIALIZER;
+
+static ewsfs_file_extent_kind_t ewsfs_file_extent_kind(cJSON* alloc_item) {
+    if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(alloc_item, "hole")))
+        return EWSFS_FILE_EXTENT_HOLE;
+    if (cJSON_IsString(cJSON_GetObjectItemCaseSensitive(alloc_item, "codec")))
+        return EWSFS_FILE_EXTENT_COMPRESSED;
+    if (cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(alloc_item, "offset")))
+        return EWSFS_FILE_EXTENT_PACKED;
+    if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(alloc_item, "unwritten")))
+        return EWSFS_FILE_EXTENT_UNWRITTEN;
+    return EWSFS_FILE_EXTENT_DATA;
+}
+
+// Add an extent to the end of the list. If it continues the last extent, that extent is
+// extended instead, so sequentially allocated files stay a handful of allocation items.
+static void ewsfs_file_extents_append(ewsfs_file_extent_list_t* extents, ewsfs_file_extent_kind_t kind, uint64_t from, uint64_t length) {
+    if (length == 0)
+        return;
+    if (kind == EWSFS_FILE_EXTENT_HOLE)
+        from = 0;
+    if (extents->count > 0) {
+        ewsfs_file_extent_t* last = &extents->items[extents->count - 1];
+        if (last->kind == kind && (kind == EWSFS_FILE_EXTENT_HOLE || last->from + last->length == from)) {
+            last->length += length;
+            return;
         }
-        if (done)
+    }
+    da_append(extents, ((ewsfs_file_extent_t) {kind, from, length, 0, 0, 0, 0}));
+}
+
+// Compressed extents are never merged, each one is decompressed on its own
+static void ewsfs_file_extents_append_compressed(ewsfs_file_extent_list_t* extents, uint64_t from, uint64_t physical, uint64_t length, uint64_t compressed_size) {
+    da_append(extents, ((ewsfs_file_extent_t) {EWSFS_FILE_EXTENT_COMPRESSED, from, length, physical, compressed_size, 0, 0}));
+}
+
+static void ewsfs_file_extents_append_packed(ewsfs_file_extent_list_t* extents, uint64_t block, uint64_t offset, uint64_t size) {
+    da_append(extents, ((ewsfs_file_extent_t) {EWSFS_FILE_EXTENT_PACKED, block, 1, 0, 0, offset, size}));
+}
+
+// Add a copy of an extent of any kind
+static void ewsfs_file_extents_append_extent(ewsfs_file_extent_list_t* extents, const ewsfs_file_extent_t* extent) {
+    if (extent->kind == EWSFS_FILE_EXTENT_COMPRESSED)
+        ewsfs_file_extents_append_compressed(extents, extent->from, extent->physical, extent->length, extent->compressed_size);
+    else if (extent->kind == EWSFS_FILE_EXTENT_PACKED)
+        ewsfs_file_extents_append_packed(extents, extent->from, extent->offset, extent->size);
+    else
+        ewsfs_file_extents_append(extents, extent->kind, extent->from, extent->length);
+}
+
+// The amount of blocks an extent takes up on the image
+static uint64_t ewsfs_file_extent_physical(const ewsfs_file_extent_t* extent) {
+    switch (extent->kind) {
+        case EWSFS_FILE_EXTENT_HOLE:
+            return 0;
+        case EWSFS_FILE_EXTENT_COMPRESSED:
+            return extent->physical;
+        case EWSFS_FILE_EXTENT_DATA:
+        case EWSFS_FILE_EXTENT_UNWRITTEN:
+        case EWSFS_FILE_EXTENT_PACKED:
             break;
     }
-    return read_size;
+    return extent->length;
 }
 
-static int ewsfs_file_write_to_disk(file_handle_t* file_handle) {
-    uint8_t temp_buffer[ewsfs_block_get_size()];
-    size_t write_size = 0;
+static bool ewsfs_file_extents_compressed(const ewsfs_file_extent_list_t* extents) {
+    for (size_t i = 0; i < extents->count; ++i) {
+        if (extents->items[i].kind == EWSFS_FILE_EXTENT_COMPRESSED)
+            return true;
+    }
+    return false;
+}
 
-    // Add necessary alloc items
-    cJSON* allocation = cJSON_GetObjectItemCaseSensitive(file_handle->item, "allocation");
-    cJSON* alloc_item = NULL;
-    uint64_t alloc_count = 0;
-    cJSON_ArrayForEach(alloc_item, allocation) {
-        alloc_count += (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "length"));
-    }
-    bool should_write_fact = false;
-    while (alloc_count * ewsfs_block_get_size() < file_handle->buffer.count) {
-        should_write_fact = true;
-        alloc_item = cJSON_CreateObject();
-        uint64_t new_block_index = 0;
-        if (!ewsfs_block_get_next_free_index(&used_block_indexes, &new_block_index))
-            return -ENOSPC;
-        cJSON_AddNumberToObject(alloc_item, "from", (double) new_block_index);
-        // TODO: use length properly
-        cJSON_AddNumberToObject(alloc_item, "length", 1.0);
+static bool ewsfs_file_extents_packed(const ewsfs_file_extent_list_t* extents) {
+    return extents->count > 0 && extents->items[0].kind == EWSFS_FILE_EXTENT_PACKED;
+}
 
-        cJSON_AddItemToArray(allocation, alloc_item);
-        ++alloc_count;
+static bool ewsfs_file_extents_preallocated(const ewsfs_file_extent_list_t* extents) {
+    for (size_t i = 0; i < extents->count; ++i) {
+        if (extents->items[i].kind == EWSFS_FILE_EXTENT_UNWRITTEN)
+            return true;
     }
-    if (should_write_fact)
-        ewsfs_fact_save_to_disk();
+    return false;
+}
+
+// A file stops using a range of blocks. Blocks that other files still use through the dedup index are kept,
+// the rest is freed with the next FACT commit.
+static void ewsfs_file_release_blocks(uint64_t from, uint64_t length) {
+    if (dedup_index.blocks.count == 0) {
+        ewsfs_extent_set_add(&freed_extents, from, length);
+        return;
+    }
+    for (uint64_t block = from; block < from + length; ++block) {
+        // The last reference takes the block out of the index
+        if (ewsfs_dedup_refs(&dedup_index, block) == 1)
+            dedup_changed = true;
+        if (ewsfs_dedup_unref(&dedup_index, block))
+            ewsfs_extent_set_add(&freed_extents, block, 1);
+    }
+}
+
+// A file stops using its part of a packed block. The block is freed with the next FACT commit once no file uses it.
+static void ewsfs_file_release_packed(const ewsfs_file_extent_t* extent) {
+    if (ewsfs_pack_remove(&pack_index, extent->from, extent->size))
+        ewsfs_extent_set_add(&freed_extents, extent->from, 1);
+}
 
-    // Same as in `ewsfs_file_read_from_disk`, but with writing instead
-    bool done = false;
+static void ewsfs_file_extents_load(cJSON* allocation, ewsfs_file_extent_list_t* extents) {
+    extents->count = 0;
+    cJSON* alloc_item = NULL;
     cJSON_ArrayForEach(alloc_item, allocation) {
         uint64_t from = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "from"));
         uint64_t length = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "length"));
+        ewsfs_file_extent_kind_t kind = ewsfs_file_extent_kind(alloc_item);
+        if (kind == EWSFS_FILE_EXTENT_COMPRESSED) {
+            // "length" is the amount of blocks on the image, like for the other extents
+            uint64_t logical_length = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "logical_length"));
+            uint64_t compressed_size = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "compressed_size"));
+            ewsfs_file_extents_append_compressed(extents, from, length, logical_length, compressed_size);
+        } else if (kind == EWSFS_FILE_EXTENT_PACKED) {
+            uint64_t offset = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "offset"));
+            uint64_t size = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "size"));
+            ewsfs_file_extents_append_packed(extents, from, offset, size);
+        } else {
+            ewsfs_file_extents_append(extents, kind, from, length);
+        }
+    }
+}
 
-        for (uint64_t i = from; i < from + length; ++i) {
-            for (size_t j = 0; j < ewsfs_block_get_size(); ++j) {
-                done = write_size >= file_handle->buffer.count;
-                if (done) {
-                    temp_buffer[j] = 0;
-                    continue;
-                }
-                temp_buffer[j] = file_handle->buffer.items[write_size];
-                ++write_size;
-            }
-            int error = ewsfs_block_write(fsfile, i, temp_buffer);
-            if (error)
-                return -error;
-            if (done)
-                break;
+// Replace the contents of a file's allocation array with the extents
+static void ewsfs_file_extents_store(cJSON* allocation, const ewsfs_file_extent_list_t* extents) {
+    while (allocation->child)
+        cJSON_DeleteItemFromArray(allocation, 0);
+    for (size_t i = 0; i < extents->count; ++i) {
+        const ewsfs_file_extent_t* extent = &extents->items[i];
+        cJSON* alloc_item = cJSON_CreateObject();
+        if (extent->kind == EWSFS_FILE_EXTENT_HOLE) {
+            cJSON_AddBoolToObject(alloc_item, "hole", true);
+        } else {
+            cJSON_AddNumberToObject(alloc_item, "from", (double) extent->from);
         }
-        if (done)
-            break;
+        if (extent->kind == EWSFS_FILE_EXTENT_COMPRESSED) {
+            cJSON_AddNumberToObject(alloc_item, "length", (double) extent->physical);
+            cJSON_AddStringToObject(alloc_item, "codec", EWSFS_LZ_CODEC);
+            cJSON_AddNumberToObject(alloc_item, "logical_length", (double) extent->length);
+            cJSON_AddNumberToObject(alloc_item, "compressed_size", (double) extent->compressed_size);
+        } else {
+            cJSON_AddNumberToObject(alloc_item, "length", (double) extent->length);
+        }
+        if (extent->kind == EWSFS_FILE_EXTENT_UNWRITTEN)
+            cJSON_AddBoolToObject(alloc_item, "unwritten", true);
+        if (extent->kind == EWSFS_FILE_EXTENT_PACKED) {
+            cJSON_AddNumberToObject(alloc_item, "offset", (double) extent->offset);
+            cJSON_AddNumberToObject(alloc_item, "size", (double) extent->size);
+        }
+        cJSON_AddItemToArray(allocation, alloc_item);
     }
+}
 
-    // Set the new file size based on the amount of bytes written
-    cJSON_SetNumberValue(cJSON_GetObjectItemCaseSensitive(file_handle->item, "file_size"), (double) write_size);
-    // Save the FACT to the disk (this also flushes the device or image file)
-    ewsfs_fact_save_to_disk();
-    return write_size;
+// The amount of blocks of the file the extents cover, including holes
+static uint64_t ewsfs_file_extents_blocks(const ewsfs_file_extent_list_t* extents) {
+    uint64_t blocks = 0;
+    for (size_t i = 0; i < extents->count; ++i)
+        blocks += extents->items[i].length;
+    return blocks;
 }
 
-int ewsfs_file_mknod(const char* path, mode_t mode, dev_t dev) {
-#ifdef EWSFS_LOG
-    if (strcmp(path, "/"EWSFS_LOG_FILE_NAME) == 0) {
-        return -EEXIST;
+// Make sure an extent starts at block `block_index` of the file, splitting the extent it's in if needed.
+// Returns the index of that extent, or the amount of extents if the file isn't that long.
+static size_t ewsfs_file_extents_split(ewsfs_file_extent_list_t* extents, uint64_t block_index) {
+    uint64_t position = 0;
+    for (size_t i = 0; i < extents->count; ++i) {
+        ewsfs_file_extent_t extent = extents->items[i];
+        if (position == block_index)
+            return i;
+        // A compressed extent can't be split, so the boundary moves to its end
+        if (block_index < position + extent.length && extent.kind == EWSFS_FILE_EXTENT_COMPRESSED)
+            return i + 1;
+        if (block_index < position + extent.length) {
+            uint64_t first_length = block_index - position;
+            ewsfs_file_extent_t second = {extent.kind, extent.kind == EWSFS_FILE_EXTENT_HOLE ? 0 : extent.from + first_length, extent.length - first_length, 0, 0, 0, 0};
+            extents->items[i].length = first_length;
+            da_append(extents, second);
+            memmove(&extents->items[i + 2], &extents->items[i + 1], (extents->count - i - 2)*sizeof(*extents->items));
+            extents->items[i + 1] = second;
+            return i + 1;
+        }
+        position += extent.length;
     }
-#endif // EWSFS_LOG
+    return extents->count;
+}
 
-    ewsfs_log("[MKNOD] ewsfs_file_mknod: %s", path);
+// Free the blocks of the extents past the first `keep_count` blocks of the file. The extent that contains the
+// boundary is shortened (or kept if it's compressed), and the extents after it are removed.
+static void ewsfs_file_extents_trim(ewsfs_file_extent_list_t* extents, uint64_t keep_count) {
+    size_t first_removed = ewsfs_file_extents_split(extents, keep_count);
+    for (size_t i = first_removed; i < extents->count; ++i) {
+        if (extents->items[i].kind == EWSFS_FILE_EXTENT_PACKED)
+            ewsfs_file_release_packed(&extents->items[i]);
+        else if (extents->items[i].kind != EWSFS_FILE_EXTENT_HOLE)
+            ewsfs_file_release_blocks(extents->items[i].from, ewsfs_file_extent_physical(&extents->items[i]));
+    }
+    extents->count = first_removed;
+}
 
-    // We don't support creating anything but normal files as of now
-    if (!(mode & S_IFREG)) {
-        ewsfs_log("[MKNOD] Unsupported file type");
-        return -EINVAL;
+// Same as `ewsfs_file_extents_trim`, but on a file's allocation array
+static void ewsfs_file_trim_allocation(cJSON* allocation, uint64_t keep_count) {
+    if (!allocation)
+        return;
+    ewsfs_file_extent_list_t extents = {0};
+    ewsfs_file_extents_load(allocation, &extents);
+    ewsfs_file_extents_trim(&extents, keep_count);
+    ewsfs_file_extents_store(allocation, &extents);
+    da_free(extents);
+}
+
+// Compressed extents can only be read as a whole, so a read that ends inside one goes on to its end
+static uint64_t ewsfs_file_extents_read_end(const ewsfs_file_extent_list_t* extents, uint64_t end_block) {
+    uint64_t position = 0;
+    for (size_t i = 0; i < extents->count && position < end_block; position += extents->items[i++].length) {
+        if (extents->items[i].kind == EWSFS_FILE_EXTENT_COMPRESSED && end_block < position + extents->items[i].length)
+            return position + extents->items[i].length;
     }
-    (void) dev;
+    return end_block;
+}
 
-    cJSON* item = ewsfs_file_get_item(path);
-    if (!item) {
-        int result = 0;
+// The part of a file its extents cover, which is all of it unless the FACT is damaged
+static uint64_t ewsfs_file_loadable_size(cJSON* item, const ewsfs_file_extent_list_t* extents) {
+    uint64_t file_size = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(item, "file_size"));
+    uint64_t extents_size = ewsfs_file_extents_blocks(extents)*ewsfs_block_get_size();
+    return file_size < extents_size ? file_size : extents_size;
+}
 
-        // Extract the directory and basename from the path
-        String_View sv_path = sv_from_cstr(path);
-        String_Builder sb_path_basename = {0};
-        String_Builder sb_path_dir = {0}; {
-            size_t i = sv_path.count - 1;
-            while (i != 0 && sv_path.data[i] != '/')
-                --i;
-            if (i == sv_path.count - 1) {
-                ewsfs_log("[MKNOD] Item is a directory");
-                return_defer(-EISDIR);
+// Small files are kept in their FACT item as `"inline_data"`, base64 encoded, instead of in blocks
+static cJSON* ewsfs_file_inline_data(cJSON* item) {
+    cJSON* inline_data = cJSON_GetObjectItemCaseSensitive(item, "inline_data");
+    return cJSON_IsString(inline_data) ? inline_data : NULL;
+}
+
+static int ewsfs_file_read_inline(cJSON* inline_data, String_Builder* buffer) {
+    const char* text = cJSON_GetStringValue(inline_data);
+    size_t length = strlen(text);
+    size_t size = 0;
+    buffer->count = 0;
+    ewsfs_file_buffer_reserve(buffer, ewsfs_base64_max_decoded_size(length));
+    if (!ewsfs_base64_decode(text, length, (uint8_t*) buffer->items, &size)) {
+        ewsfs_log("[READ] Inline data is corrupt");
+        return -EIO;
+    }
+    buffer->count = size;
+    return size;
+}
+
+// Read blocks `first_block` up to `end_block` of a file into `buffer`, which holds the first `file_size` bytes of the file.
+// `first_block` can't be inside a compressed extent, and `end_block` has to come from ewsfs_file_extents_read_end.
+static int ewsfs_file_read_blocks(const ewsfs_file_extent_list_t* extents, uint8_t* buffer, uint64_t file_size, uint64_t first_block, uint64_t end_block) {
+    uint64_t block_size = ewsfs_block_get_size();
+    if (end_block*block_size > file_size)
+        end_block = (file_size + block_size - 1) / block_size;
+
+    // A temporary buffer for the last block, which is only partially part of the file
+    uint8_t tail_buffer[block_size];
+    size_t tail_size = 0;
+    uint64_t tail_position = 0;
+    // A packed extent's block goes into a buffer of its own, only the file's part of it is copied after the batch
+    uint8_t packed_buffer[block_size];
+    const uint8_t* packed_source = NULL;
+    uint64_t packed_offset = 0;
+    uint64_t packed_size = 0;
+
+    // The block ranges of all extents with data are collected first, so they can be read as one batch.
+    // Each range needs at most two iovecs: one for the full blocks and one for the tail buffer.
+    ewsfs_block_range_t* ranges = malloc(extents->count*sizeof(*ranges));
+    struct iovec* iovs = malloc(2*extents->count*sizeof(*iovs));
+    size_t range_count = 0;
+    size_t iov_count = 0;
+
+    // Compressed extents are read into a scratch buffer as part of the same batch, and decompressed after it
+    uint64_t compressed_blocks = 0;
+    uint64_t position = 0;
+    for (size_t i = 0; i < extents->count && position < end_block; position += extents->items[i++].length) {
+        if (extents->items[i].kind == EWSFS_FILE_EXTENT_COMPRESSED && position >= first_block)
+            compressed_blocks += extents->items[i].physical;
+    }
+    uint8_t* compressed = compressed_blocks > 0 ? malloc(compressed_blocks*block_size) : NULL;
+    uint64_t compressed_offset = 0;
+    ewsfs_file_extent_t* decompress_extents = malloc(extents->count*sizeof(*decompress_extents));
+    const uint8_t** decompress_sources = malloc(extents->count*sizeof(*decompress_sources));
+    uint64_t* decompress_positions = malloc(extents->count*sizeof(*decompress_positions));
+    size_t decompress_count = 0;
+
+    position = 0;
+    for (size_t i = 0; i < extents->count && position < end_block; position += extents->items[i++].length) {
+        if (position + extents->items[i].length <= first_block)
+            continue;
+        // The part of the extent that's read, in blocks and bytes of the file
+        uint64_t start = position > first_block ? position : first_block;
+        uint64_t end = position + extents->items[i].length < end_block ? position + extents->items[i].length : end_block;
+        uint64_t start_byte = start*block_size;
+        uint64_t end_byte = end*block_size < file_size ? end*block_size : file_size;
+        uint64_t full_blocks = (end_byte - start_byte) / block_size;
+        size_t item_tail_size = (end_byte - start_byte) % block_size;
+        uint64_t from = extents->items[i].from + (start - position);
+
+        if (extents->items[i].kind == EWSFS_FILE_EXTENT_COMPRESSED) {
+            uint64_t physical = extents->items[i].physical;
+            const uint8_t* source = ewsfs_block_get_mapped(fsdevice, from, physical);
+            if (!source) {
+                source = compressed + compressed_offset;
+                ewsfs_block_range_t* range = &ranges[range_count++];
+                range->block_index = from;
+                range->block_count = physical;
+                range->iov = &iovs[iov_count];
+                range->iov_count = 1;
+                iovs[iov_count++] = (struct iovec) {compressed + compressed_offset, physical*block_size};
+                compressed_offset += physical*block_size;
             }
-            da_append_many(&sb_path_dir, sv_path.data, i == 0 ? 1 : i);
-            sb_append_null(&sb_path_dir);
+            decompress_extents[decompress_count] = extents->items[i];
+            decompress_sources[decompress_count] = source;
+            decompress_positions[decompress_count++] = start_byte;
+            continue;
+        }
 
-            da_append_many(&sb_path_basename, &sv_path.data[i+1], sv_path.count - i - 1);
-            sb_append_null(&sb_path_basename);
+        if (extents->items[i].kind == EWSFS_FILE_EXTENT_PACKED) {
+            packed_source = ewsfs_block_get_mapped(fsdevice, from, 1);
+            if (!packed_source) {
+                packed_source = packed_buffer;
+                ewsfs_block_range_t* range = &ranges[range_count++];
+                range->block_index = from;
+                range->block_count = 1;
+                range->iov = &iovs[iov_count];
+                range->iov_count = 1;
+                iovs[iov_count++] = (struct iovec) {packed_buffer, block_size};
+            }
+            // Past the end of the packed data, the file is zeroes
+            packed_offset = extents->items[i].offset;
+            packed_size = extents->items[i].size < end_byte - start_byte ? extents->items[i].size : end_byte - start_byte;
+            memset(buffer + start_byte + packed_size, 0, end_byte - start_byte - packed_size);
+            continue;
         }
 
-        cJSON* dir = ewsfs_file_get_item(sb_path_dir.items);
-        if (!dir) {
-            ewsfs_log("[MKNOD] Item %s not found", sb_path_dir.items);
-            return_defer(-ENOENT);
+        // Holes and unwritten extents don't have anything on the image yet
+        if (extents->items[i].kind != EWSFS_FILE_EXTENT_DATA) {
+            memset(buffer + start_byte, 0, end_byte - start_byte);
+            continue;
         }
-        if (dir != fact_root && !cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(dir, "is_dir"))) {
-            ewsfs_log("[MKNOD] Item %s not a directory", sb_path_dir.items);
-            return_defer(-ENOTDIR);
+
+        // If the image is mapped, copy the data straight from the mapping
+        const uint8_t* mapped = ewsfs_block_get_mapped(fsdevice, from, full_blocks + (item_tail_size > 0));
+        if (mapped) {
+            memcpy(buffer + start_byte, mapped, end_byte - start_byte);
+            continue;
         }
 
-        // Create the new cJSON object for this new file
-        item = cJSON_CreateObject();
-        cJSON_AddStringToObject(item, "name", sb_path_basename.items);
-        cJSON_AddBoolToObject(item, "is_dir", false);
-        cJSON_AddNumberToObject(item, "file_size", 0.0);
-        // We don't need to add attributes, as they're added during validation if they're missing
-        cJSON_AddArrayToObject(item, "allocation");
+        // Otherwise, read the whole extent at once: full blocks go into the buffer directly,
+        // and if file_size ends inside this extent, the last block goes into the tail buffer
+        ewsfs_block_range_t* range = &ranges[range_count++];
+        range->block_index = from;
+        range->block_count = full_blocks + (item_tail_size > 0);
+        range->iov = &iovs[iov_count];
+        range->iov_count = 0;
+        if (full_blocks > 0)
+            iovs[iov_count + range->iov_count++] = (struct iovec) {buffer + start_byte, full_blocks*block_size};
+        if (item_tail_size > 0)
+            iovs[iov_count + range->iov_count++] = (struct iovec) {tail_buffer, block_size};
+        iov_count += range->iov_count;
+        tail_size = item_tail_size;
+        tail_position = end_byte - item_tail_size;
+    }
+
+    int error = ewsfs_block_read_ranges(fsdevice, ranges, range_count);
+    for (size_t i = 0; i < decompress_count && !error; ++i) {
+        // The data may end before the extent's part of the file does, if the file grew since it was compressed.
+        // Everything past the end of the data is zeroes then. If the file was truncated, only the start of the data is used.
+        uint64_t position = decompress_positions[i];
+        uint64_t extent_size = decompress_extents[i].length*block_size;
+        uint64_t capacity = file_size - position < extent_size ? file_size - position : extent_size;
+        uint8_t* dst = capacity < extent_size ? malloc(extent_size) : buffer + position;
+        size_t decompressed_size = 0;
+        if (decompress_extents[i].compressed_size > decompress_extents[i].physical*block_size
+         || !ewsfs_lz_decompress(decompress_sources[i], decompress_extents[i].compressed_size, dst, extent_size, &decompressed_size)) {
+            ewsfs_log("[READ] Compressed extent at block %"PRIu64" is corrupt", decompress_extents[i].from);
+            error = EIO;
+        } else if (decompressed_size < capacity) {
+            memset(dst + decompressed_size, 0, capacity - decompressed_size);
+        }
+        if (dst != buffer + position) {
+            if (!error)
+                memcpy(buffer + position, dst, capacity);
+            free(dst);
+        }
+    }
+    free(ranges);
+    free(iovs);
+    free(compressed);
+    free(decompress_extents);
+    free(decompress_sources);
+    free(decompress_positions);
+    if (error)
+        return -error;
+    if (tail_size > 0)
+        memcpy(buffer + tail_position, tail_buffer, tail_size);
+    if (packed_source)
+        memcpy(buffer, packed_source + packed_offset, packed_size);
+    return 0;
+}
 
-        // Add it to the directory's `contents` list
-        cJSON_AddItemToArray(cJSON_GetObjectItemCaseSensitive(dir, "contents"), item);
+// Read a whole file into a file handle that isn't in `file_handles`
+static int ewsfs_file_read_from_disk(file_handle_t* file_handle) {
+    cJSON* inline_data = ewsfs_file_inline_data(file_handle->item);
+    if (inline_data) {
+        file_handle->loaded = FILE_HANDLE_LOADED;
+        return ewsfs_file_read_inline(inline_data, &file_handle->buffer);
+    }
 
-        ewsfs_fact_save_to_disk();
+    ewsfs_file_extent_list_t extents = {0};
+    ewsfs_file_extents_load(cJSON_GetObjectItemCaseSensitive(file_handle->item, "allocation"), &extents);
+    uint64_t file_size = ewsfs_file_loadable_size(file_handle->item, &extents);
 
-    defer:
-        // Cleanup
-        da_free(sb_path_dir);
-        da_free(sb_path_basename);
-        return result;
-    }
-    ewsfs_log("[MKNOD] Item already exists");
-    return -EEXIST;
+    // The whole file is read straight into the file_handle buffer, so reserve enough space for it
+    file_handle->buffer.count = 0;
+    ewsfs_file_buffer_reserve(&file_handle->buffer, file_size);
+
+    int error = ewsfs_file_read_blocks(&extents, (uint8_t*) file_handle->buffer.items, file_size, 0, ewsfs_file_extents_blocks(&extents));
+    da_free(extents);
+    if (error < 0)
+        return error;
+    file_handle->buffer.count = file_size;
+    file_handle->loaded = FILE_HANDLE_LOADED;
+    return file_size;
 }
 
-int ewsfs_file_unlink(const char* path) {
-#ifdef EWSFS_LOG
-    if (strcmp(path, "/"EWSFS_LOG_FILE_NAME) == 0) {
-        return -EPERM;
+// Load the buffer of an open file up to byte `end`. If another thread is loading it already, that's waited for first.
+static int ewsfs_file_load(uint64_t fh, uint64_t end) {
+    file_handle_t* file_handle = &file_handles[fh];
+    uint64_t block_size = ewsfs_block_get_size();
+
+    pthread_mutex_lock(&handle_load_lock);
+    // A loaded buffer can be changed by its handle, so its size is only looked at while it isn't loaded yet
+    if (file_handle->loaded != FILE_HANDLE_LOADED && end > file_handle->buffer.count)
+        end = file_handle->buffer.count;
+    while (file_handle->loading && file_handle->loaded < end)
+        pthread_cond_wait(&handle_loaded, &handle_load_lock);
+    if (file_handle->loaded >= end) {
+        pthread_mutex_unlock(&handle_load_lock);
+        return 0;
     }
-#endif // EWSFS_LOG
+    uint64_t first_block = file_handle->loaded / block_size;
+    uint64_t end_block = ewsfs_file_extents_read_end(&file_handle->extents, (end + block_size - 1) / block_size);
+    file_handle->loading = true;
+    pthread_mutex_unlock(&handle_load_lock);
 
-    ewsfs_log("[UNLINK] ewsfs_file_unlink: %s", path);
+    int error = ewsfs_file_read_blocks(&file_handle->extents, (uint8_t*) file_handle->buffer.items, file_handle->buffer.count, first_block, end_block);
 
-    // Check if the file exists and isn't a directory
-    cJSON* item = ewsfs_file_get_item(path);
-    if (!item) {
-        ewsfs_log("[UNLINK] Item not found");
-        return -ENOENT;
+    pthread_mutex_lock(&handle_load_lock);
+    if (!error)
+        file_handle->loaded = end_block*block_size < file_handle->buffer.count ? end_block*block_size : FILE_HANDLE_LOADED;
+    file_handle->loading = false;
+    pthread_cond_broadcast(&handle_loaded);
+    pthread_mutex_unlock(&handle_load_lock);
+    return error;
+}
+
+// Load the rest of every open handle of a file (or of every file if `item` is NULL), before its blocks change
+static int ewsfs_file_load_handles(cJSON* item) {
+    for (uint64_t i = 0; i < MAX_FILE_HANDLES; ++i) {
+        if (!file_handles[i].item || (item && file_handles[i].item != item))
+            continue;
+        int error = ewsfs_file_load(i, UINT64_MAX);
+        if (error < 0) {
+            ewsfs_log("[LOAD] Loading file handle %"PRIu64" failed with error %d", i, error);
+            return error;
+        }
+    }
+    return 0;
+}
+
+// The amount of blocks the read-ahead thread loads at once, so a reader that catches up doesn't wait for the whole window
+#define PREFETCH_STEP_BLOCKS 32
+
+uint64_t ewsfs_file_prefetch(uint64_t fh) {
+    uint64_t step = PREFETCH_STEP_BLOCKS*ewsfs_block_get_size();
+    uint64_t loaded = 0;
+    pthread_mutex_lock(&handle_load_lock);
+    for (;;) {
+        // A handle that was released meanwhile has nothing to load, its `prefetch_end` is 0
+        file_handle_t* file_handle = &file_handles[fh];
+        uint64_t start = file_handle->loaded;
+        if (start >= file_handle->prefetch_end)
+            break;
+        uint64_t end = file_handle->prefetch_end - start > step ? start + step : file_handle->prefetch_end;
+        pthread_mutex_unlock(&handle_load_lock);
+        int error = ewsfs_file_load(fh, end);
+        pthread_mutex_lock(&handle_load_lock);
+        if (error < 0) {
+            ewsfs_log("[READAHEAD] Loading file handle %"PRIu64" failed with error %d", fh, error);
+            break;
+        }
+        uint64_t now_loaded = file_handle->loaded == FILE_HANDLE_LOADED ? file_handle->buffer.count : file_handle->loaded;
+        if (now_loaded <= start)
+            break;
+        loaded += now_loaded - start;
+    }
+    pthread_mutex_unlock(&handle_load_lock);
+    return loaded;
+}
+
+// Pick the allocation group for a file's new blocks. A file that already has blocks grows in the group
+// right after its last extent, so it can be extended in place; new files are spread over the groups by name,
+// so concurrent writers of different files don't contend for the same group.
+static uint64_t ewsfs_file_alloc_hint(cJSON* item) {
+    cJSON* last_item = NULL;
+    cJSON* alloc_item = NULL;
+    cJSON_ArrayForEach(alloc_item, cJSON_GetObjectItemCaseSensitive(item, "allocation")) {
+        if (ewsfs_file_extent_kind(alloc_item) != EWSFS_FILE_EXTENT_HOLE)
+            last_item = alloc_item;
+    }
+    if (last_item) {
+        uint64_t from = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(last_item, "from"));
+        uint64_t length = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(last_item, "length"));
+        return ewsfs_alloc_hint_for_block(&block_allocator, from + length);
+    }
+
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const char* name = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(item, "name"));
+    for (const char* c = name ? name : ""; *c; ++c)
+        hash = (hash ^ (uint8_t) *c) * 0x100000001b3ull;
+    return hash;
+}
+
+// Allocate `count` blocks for a file and add them to the end of the extent list as `kind` extents.
+// The last extent is grown in place if the blocks after it are free, otherwise runs as long as possible are taken.
+// The new blocks are also added to `new_blocks`, unless it's NULL.
+// Returns the amount of blocks that were allocated, which is less than `count` if the image is full.
+static uint64_t ewsfs_file_extents_allocate(ewsfs_file_extent_list_t* extents, uint64_t hint, ewsfs_file_extent_kind_t kind, uint64_t count, ewsfs_extent_set_t* new_blocks) {
+    uint64_t allocated = 0;
+    if (extents->count > 0 && extents->items[extents->count - 1].kind == kind && kind != EWSFS_FILE_EXTENT_HOLE) {
+        ewsfs_file_extent_t* last = &extents->items[extents->count - 1];
+        uint64_t length = 0;
+        if (ewsfs_block_extend_extent(&block_allocator, last->from + last->length, count, &length)) {
+            if (new_blocks)
+                ewsfs_extent_set_add(new_blocks, last->from + last->length, length);
+            last->length += length;
+            allocated += length;
+        }
+    }
+    while (allocated < count) {
+        uint64_t from = 0;
+        uint64_t length = 0;
+        if (!ewsfs_block_allocate_extent(&block_allocator, hint, count - allocated, &from, &length))
+            break;
+        ewsfs_file_extents_append(extents, kind, from, length);
+        if (new_blocks)
+            ewsfs_extent_set_add(new_blocks, from, length);
+        hint = ewsfs_alloc_hint_for_block(&block_allocator, from + length);
+        allocated += length;
+    }
+    return allocated;
+}
+
+// Whether block `block_index` of a file buffer is all zeroes (or past the end of the buffer)
+static bool ewsfs_file_block_is_zero(const String_Builder* buffer, uint64_t block_index, uint64_t block_size) {
+    uint64_t start = block_index*block_size;
+    if (start >= buffer->count)
+        return true;
+    uint64_t size = buffer->count - start < block_size ? buffer->count - start : block_size;
+    const char* data = buffer->items + start;
+    return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
+
+// What a write to disk changes besides the file's extent list, so it can be undone if the image is full
+// or the blocks couldn't be written
+typedef struct {
+    // Blocks that were allocated for the write
+    ewsfs_extent_set_t new_blocks;
+    // Blocks that got a reference (or got indexed) for the write
+    ewsfs_block_index_list_t referenced;
+    // Blocks that already hold the right data, so they aren't written
+    ewsfs_extent_set_t unchanged;
+    // Blocks the file stops using once the write is done
+    ewsfs_block_index_list_t released;
+} ewsfs_file_write_t;
+
+// Copy block `block_index` of a file buffer, padded with zeroes like on the image
+static void ewsfs_file_copy_block(const String_Builder* buffer, uint64_t block_index, uint64_t block_size, uint8_t* data) {
+    uint64_t start = block_index*block_size;
+    uint64_t size = buffer->count - start < block_size ? buffer->count - start : block_size;
+    memcpy(data, buffer->items + start, size);
+    memset(data + size, 0, block_size - size);
+}
+
+// Find the block of the file that data block `block` holds
+static bool ewsfs_file_extents_find(const ewsfs_file_extent_list_t* extents, uint64_t block, uint64_t* position) {
+    *position = 0;
+    for (size_t i = 0; i < extents->count; ++i) {
+        const ewsfs_file_extent_t* extent = &extents->items[i];
+        if (extent->kind == EWSFS_FILE_EXTENT_DATA && extent->from <= block && block < extent->from + extent->length) {
+            *position += block - extent->from;
+            return true;
+        }
+        *position += extent->length;
+    }
+    return false;
+}
+
+// Whether block `block` holds `data`. Hashes can collide, so the contents are always compared.
+// Blocks that are already in the file's new extent list get their data from the file buffer with this write.
+static bool ewsfs_file_dedup_matches(const ewsfs_file_extent_list_t* extents, const String_Builder* buffer, uint64_t block, const uint8_t* data) {
+    uint64_t block_size = ewsfs_block_get_size();
+    uint8_t block_data[block_size];
+    uint64_t position = 0;
+    if (ewsfs_file_extents_find(extents, block, &position)) {
+        ewsfs_file_copy_block(buffer, position, block_size, block_data);
+        return memcmp(block_data, data, block_size) == 0;
+    }
+    if (ewsfs_block_read(fsdevice, block, block_data) != 0)
+        return false;
+    return memcmp(block_data, data, block_size) == 0;
+}
+
+// Use indexed block `block` for the next block of the file, which has the same contents
+static void ewsfs_file_extents_reference(ewsfs_file_extent_list_t* extents, uint64_t block, ewsfs_file_write_t* write) {
+    // A block that's already in the extent list is written (or not) for its first use
+    uint64_t position = 0;
+    if (!ewsfs_file_extents_find(extents, block, &position))
+        ewsfs_extent_set_add(&write->unchanged, block, 1);
+    ewsfs_dedup_ref(&dedup_index, block);
+    da_append(&write->referenced, block);
+    ewsfs_file_extents_append(extents, EWSFS_FILE_EXTENT_DATA, block, 1);
+}
+
+// Add data extents for `count` blocks of a file, starting at block `position` of the buffer.
+// With dedup, a block with the same contents as an indexed one gets a reference to it instead of a new block,
+// and new blocks are indexed. Otherwise this is `ewsfs_file_extents_allocate`.
+// Returns the amount of blocks that were added, which is less than `count` if the image is full.
+static uint64_t ewsfs_file_extents_allocate_data(ewsfs_file_extent_list_t* extents, const String_Builder* buffer, uint64_t position, uint64_t count, uint64_t hint, ewsfs_file_write_t* write) {
+    if (!dedup_files)
+        return ewsfs_file_extents_allocate(extents, hint, EWSFS_FILE_EXTENT_DATA, count, &write->new_blocks);
+
+    uint64_t block_size = ewsfs_block_get_size();
+    uint8_t data[block_size];
+    for (uint64_t i = 0; i < count; ++i) {
+        ewsfs_file_copy_block(buffer, position + i, block_size, data);
+        uint64_t hash = ewsfs_dedup_hash(data, block_size);
+        uint64_t block = 0;
+        if (ewsfs_dedup_find(&dedup_index, hash, &block) && ewsfs_file_dedup_matches(extents, buffer, block, data)) {
+            ewsfs_file_extents_reference(extents, block, write);
+            continue;
+        }
+        if (ewsfs_file_extents_allocate(extents, hint, EWSFS_FILE_EXTENT_DATA, 1, &write->new_blocks) < 1)
+            return i;
+        ewsfs_file_extent_t* last = &extents->items[extents->count - 1];
+        if (ewsfs_dedup_insert(&dedup_index, hash, last->from + last->length - 1, 1))
+            dedup_changed = true;
+    }
+    return count;
+}
+
+// Keep the blocks of a data extent that starts at block `position` of the file. Blocks that are shared with
+// other files are copied on write: they're only kept if their contents didn't change. With dedup, blocks that
+// aren't indexed yet get indexed, or replaced by an indexed block with the same contents.
+// Returns false if the image is full.
+static bool ewsfs_file_extents_keep_data(ewsfs_file_extent_list_t* extents, const String_Builder* buffer, ewsfs_file_extent_t extent, uint64_t position, uint64_t hint, ewsfs_file_write_t* write) {
+    uint64_t block_size = ewsfs_block_get_size();
+    uint64_t buffer_blocks = (buffer->count + block_size - 1) / block_size;
+    if (!dedup_files && dedup_index.blocks.count == 0) {
+        ewsfs_file_extents_append(extents, EWSFS_FILE_EXTENT_DATA, extent.from, extent.length);
+        return true;
+    }
+
+    uint8_t data[block_size];
+    for (uint64_t i = 0; i < extent.length; ++i) {
+        uint64_t block = extent.from + i;
+        uint64_t refs = ewsfs_dedup_refs(&dedup_index, block);
+        // Blocks past the end of the file aren't written, and private blocks are written in place
+        if (position + i >= buffer_blocks || (refs == 0 && !dedup_files)) {
+            ewsfs_file_extents_append(extents, EWSFS_FILE_EXTENT_DATA, block, 1);
+            continue;
+        }
+        ewsfs_file_copy_block(buffer, position + i, block_size, data);
+        if (refs == 0) {
+            uint64_t hash = ewsfs_dedup_hash(data, block_size);
+            uint64_t indexed = 0;
+            if (ewsfs_dedup_find(&dedup_index, hash, &indexed) && indexed != block && ewsfs_file_dedup_matches(extents, buffer, indexed, data)) {
+                ewsfs_file_extents_reference(extents, indexed, write);
+                da_append(&write->released, block);
+                continue;
+            }
+            if (ewsfs_dedup_insert(&dedup_index, hash, block, 1)) {
+                dedup_changed = true;
+                da_append(&write->referenced, block);
+            }
+            ewsfs_file_extents_append(extents, EWSFS_FILE_EXTENT_DATA, block, 1);
+            continue;
+        }
+        if (ewsfs_file_dedup_matches(extents, buffer, block, data)) {
+            ewsfs_extent_set_add(&write->unchanged, block, 1);
+            ewsfs_file_extents_append(extents, EWSFS_FILE_EXTENT_DATA, block, 1);
+            continue;
+        }
+        da_append(&write->released, block);
+        if (ewsfs_file_extents_allocate_data(extents, buffer, position + i, 1, hint, write) < 1)
+            return false;
+    }
+    return true;
+}
+
+// Allocate `count` contiguous blocks, right after the last extent if possible. Returns false if there's no such run.
+static bool ewsfs_file_extents_allocate_run(ewsfs_file_extent_list_t* extents, uint64_t hint, uint64_t count, uint64_t* from) {
+    uint64_t length = 0;
+    if (extents->count > 0 && extents->items[extents->count - 1].kind != EWSFS_FILE_EXTENT_HOLE) {
+        ewsfs_file_extent_t* last = &extents->items[extents->count - 1];
+        *from = last->from + ewsfs_file_extent_physical(last);
+        if (ewsfs_block_extend_extent(&block_allocator, *from, count, &length)) {
+            if (length == count)
+                return true;
+            ewsfs_alloc_set_free(&block_allocator, *from, length);
+        }
+        hint = ewsfs_alloc_hint_for_block(&block_allocator, *from);
+    }
+    if (!ewsfs_block_allocate_extent(&block_allocator, hint, count, from, &length))
+        return false;
+    if (length == count)
+        return true;
+    ewsfs_alloc_set_free(&block_allocator, *from, length);
+    return false;
+}
+
+#define COMPRESS_CHUNK_BLOCKS 16
+
+// Build the extents of a whole file with compression, in chunks of COMPRESS_CHUNK_BLOCKS blocks.
+// Chunks of zeroes become holes, and chunks that don't save at least a block are stored as normal data.
+// The compressed data of every compressed extent is put in `compressed`, padded to whole blocks.
+static int ewsfs_file_compress_extents(const String_Builder* buffer, uint64_t hint, ewsfs_file_extent_list_t* extents, ewsfs_file_write_t* write, uint8_t* compressed) {
+    uint64_t block_size = ewsfs_block_get_size();
+    uint64_t needed_count = (buffer->count + block_size - 1) / block_size;
+    uint64_t compressed_count = 0;
+    for (uint64_t position = 0; position < needed_count; position += COMPRESS_CHUNK_BLOCKS) {
+        uint64_t length = needed_count - position < COMPRESS_CHUNK_BLOCKS ? needed_count - position : COMPRESS_CHUNK_BLOCKS;
+        bool is_zero = true;
+        for (uint64_t i = 0; i < length && is_zero; ++i)
+            is_zero = ewsfs_file_block_is_zero(buffer, position + i, block_size);
+        if (is_zero) {
+            ewsfs_file_extents_append(extents, EWSFS_FILE_EXTENT_HOLE, 0, length);
+            continue;
+        }
+
+        uint64_t start = position*block_size;
+        uint64_t size = buffer->count - start < length*block_size ? buffer->count - start : length*block_size;
+        uint8_t* dst = compressed + compressed_count*block_size;
+        size_t compressed_size = ewsfs_lz_compress((const uint8_t*) buffer->items + start, size, dst, (length - 1)*block_size);
+        uint64_t physical = (compressed_size + block_size - 1) / block_size;
+        uint64_t from = 0;
+        if (compressed_size > 0 && ewsfs_file_extents_allocate_run(extents, hint, physical, &from)) {
+            memset(dst + compressed_size, 0, physical*block_size - compressed_size);
+            ewsfs_file_extents_append_compressed(extents, from, physical, length, compressed_size);
+            ewsfs_extent_set_add(&write->new_blocks, from, physical);
+            compressed_count += physical;
+            continue;
+        }
+        if (ewsfs_file_extents_allocate_data(extents, buffer, position, length, hint, write) < length)
+            return -ENOSPC;
+    }
+    return 0;
+}
+
+// Give back the blocks a write picked, the FACT doesn't point to them yet
+static void ewsfs_file_write_abort(const ewsfs_file_write_t* write) {
+    for (size_t i = 0; i < write->referenced.count; ++i)
+        ewsfs_dedup_unref(&dedup_index, write->referenced.items[i]);
+    for (size_t i = 0; i < write->new_blocks.count; ++i) {
+        for (uint64_t block = write->new_blocks.items[i].from; block < write->new_blocks.items[i].from + write->new_blocks.items[i].length; ++block)
+            ewsfs_dedup_unref(&dedup_index, block);
+        ewsfs_alloc_set_free(&block_allocator, write->new_blocks.items[i].from, write->new_blocks.items[i].length);
+    }
+}
+
+// Put `size` bytes of a small file at the end of the current pack block, or at the start of a new block if they
+// don't fit in it anymore. The rest of the block is written back as it is, the FACT still points to it.
+static int ewsfs_file_pack(const uint8_t* data, uint64_t size, uint64_t hint, ewsfs_file_extent_t* extent) {
+    uint64_t block_size = ewsfs_block_get_size();
+    uint8_t block_data[block_size];
+    uint64_t block = 0;
+    uint64_t offset = 0;
+    bool is_new = !ewsfs_pack_find(&pack_index, block_size, size, &block, &offset);
+    int error = 0;
+    if (is_new) {
+        uint64_t length = 0;
+        if (!ewsfs_block_allocate_extent(&block_allocator, hint, 1, &block, &length))
+            return -ENOSPC;
+        memset(block_data, 0, block_size);
+    } else {
+        error = ewsfs_block_read(fsdevice, block, block_data);
+        if (error)
+            return -error;
+    }
+    memcpy(block_data + offset, data, size);
+    error = ewsfs_block_write(fsdevice, block, block_data);
+    if (error) {
+        if (is_new)
+            ewsfs_alloc_set_free(&block_allocator, block, 1);
+        return -error;
+    }
+    ewsfs_pack_add(&pack_index, block, offset, size);
+    if (is_new)
+        ewsfs_pack_set_current(&pack_index, block);
+    *extent = (ewsfs_file_extent_t) {EWSFS_FILE_EXTENT_PACKED, block, 1, 0, 0, offset, size};
+    return 0;
+}
+
+static int ewsfs_file_write_to_disk(file_handle_t* file_handle) {
+    uint64_t block_size = ewsfs_block_get_size();
+    uint8_t tail_buffer[block_size];
+    uint64_t needed_count = (file_handle->buffer.count + block_size - 1) / block_size;
+    uint64_t hint = ewsfs_file_alloc_hint(file_handle->item);
+    int result = 0;
+
+    // Other handles of the file can't load their buffers from blocks that are about to change
+    int error = ewsfs_file_load_handles(file_handle->item);
+    if (error < 0)
+        return error;
+
+    // Rebuild the extent list: blocks of holes and unwritten extents that now hold data get written.
+    // Missing blocks at the end start out as a hole, so a file that was extended with zeroes stays sparse.
+    // Parts that are still all zeroes stay as they are.
+    cJSON* allocation = cJSON_GetObjectItemCaseSensitive(file_handle->item, "allocation");
+    ewsfs_file_extent_list_t old_extents = {0};
+    ewsfs_file_extent_list_t extents = {0};
+    ewsfs_file_write_t write = {0};
+    uint8_t* compressed = NULL;
+    ewsfs_file_extents_load(allocation, &old_extents);
+
+    // Small files go into their FACT item, so they don't take up a block or need a block read.
+    // Preallocated blocks are kept for the data they were meant for.
+    if (file_handle->buffer.count > 0 && file_handle->buffer.count <= inline_limit && !ewsfs_file_extents_preallocated(&old_extents)) {
+        ewsfs_file_extents_trim(&old_extents, 0);
+        ewsfs_file_extents_store(allocation, &old_extents);
+        char* text = malloc(ewsfs_base64_encoded_size(file_handle->buffer.count) + 1);
+        ewsfs_base64_encode((const uint8_t*) file_handle->buffer.items, file_handle->buffer.count, text);
+        cJSON_DeleteItemFromObjectCaseSensitive(file_handle->item, "inline_data");
+        cJSON_AddStringToObject(file_handle->item, "inline_data", text);
+        free(text);
+        cJSON_SetNumberValue(cJSON_GetObjectItemCaseSensitive(file_handle->item, "file_size"), (double) file_handle->buffer.count);
+        ewsfs_fact_save_to_disk();
+        return_defer((int) file_handle->buffer.count);
+    }
+
+    // Files that are too big for that but smaller than a block share a block with other small files.
+    // The old blocks (or the old place in a packed block) are given up once the data is in its new place.
+    if (file_handle->buffer.count > 0 && file_handle->buffer.count <= pack_limit && file_handle->buffer.count < block_size
+     && !ewsfs_file_extents_preallocated(&old_extents)) {
+        ewsfs_file_extent_t packed = {0};
+        result = ewsfs_file_pack((const uint8_t*) file_handle->buffer.items, file_handle->buffer.count, hint, &packed);
+        if (result < 0)
+            return_defer(result);
+        ewsfs_file_extents_trim(&old_extents, 0);
+        da_append(&old_extents, packed);
+        ewsfs_file_extents_store(allocation, &old_extents);
+        cJSON_DeleteItemFromObjectCaseSensitive(file_handle->item, "inline_data");
+        cJSON_SetNumberValue(cJSON_GetObjectItemCaseSensitive(file_handle->item, "file_size"), (double) file_handle->buffer.count);
+        ewsfs_fact_save_to_disk();
+        return_defer((int) file_handle->buffer.count);
+    }
+    // A packed file that outgrew its block gets blocks of its own, and leaves the packed block after the write
+    ewsfs_file_extent_t unpacked = {0};
+    bool was_packed = ewsfs_file_extents_packed(&old_extents);
+    if (was_packed) {
+        unpacked = old_extents.items[0];
+        old_extents.items[0] = (ewsfs_file_extent_t) {EWSFS_FILE_EXTENT_HOLE, 0, 1, 0, 0, 0, 0};
+    }
+
+    // Compressed extents can't be partially overwritten, so a file that has them (or is going to) is
+    // written to new blocks as a whole. The old blocks are only freed once the new ones are written.
+    bool rewrite = compress_files || ewsfs_file_extents_compressed(&old_extents);
+    if (rewrite) {
+        for (size_t i = 0; i < old_extents.count; ++i) {
+            for (uint64_t j = 0; old_extents.items[i].kind != EWSFS_FILE_EXTENT_HOLE && j < ewsfs_file_extent_physical(&old_extents.items[i]); ++j)
+                da_append(&write.released, old_extents.items[i].from + j);
+        }
+        old_extents.count = 0;
+    }
+    if (compress_files) {
+        compressed = malloc(needed_count*block_size);
+        result = ewsfs_file_compress_extents(&file_handle->buffer, hint, &extents, &write, compressed);
+    }
+    uint64_t old_count = ewsfs_file_extents_blocks(&old_extents);
+    if (!compress_files && old_count < needed_count)
+        ewsfs_file_extents_append(&old_extents, EWSFS_FILE_EXTENT_HOLE, 0, needed_count - old_count);
+    uint64_t position = 0;
+    for (size_t i = 0; i < old_extents.count; ++i) {
+        ewsfs_file_extent_t extent = old_extents.items[i];
+        if (result != 0)
+            break;
+        if (extent.kind == EWSFS_FILE_EXTENT_DATA) {
+            if (!ewsfs_file_extents_keep_data(&extents, &file_handle->buffer, extent, position, hint, &write))
+                result = -ENOSPC;
+            position += extent.length;
+            continue;
+        }
+
+        uint64_t run_start = 0;
+        while (run_start < extent.length) {
+            bool is_zero = ewsfs_file_block_is_zero(&file_handle->buffer, position + run_start, block_size);
+            uint64_t run_end = run_start + 1;
+            while (run_end < extent.length && ewsfs_file_block_is_zero(&file_handle->buffer, position + run_end, block_size) == is_zero)
+                ++run_end;
+            uint64_t run_length = run_end - run_start;
+
+            if (is_zero) {
+                ewsfs_file_extents_append(&extents, extent.kind, extent.from + run_start, run_length);
+            } else if (extent.kind == EWSFS_FILE_EXTENT_UNWRITTEN) {
+                // The blocks are already there, they just become normal data blocks
+                ewsfs_file_extents_append(&extents, EWSFS_FILE_EXTENT_DATA, extent.from + run_start, run_length);
+            } else {
+                if (ewsfs_file_extents_allocate_data(&extents, &file_handle->buffer, position + run_start, run_length, hint, &write) < run_length) {
+                    result = -ENOSPC;
+                    break;
+                }
+            }
+            run_start = run_end;
+        }
+        position += extent.length;
+    }
+    // The new blocks were never written, so hand them straight back and leave the file as it was
+    if (result != 0) {
+        ewsfs_file_write_abort(&write);
+        return_defer(result);
+    }
+    // Same as in `ewsfs_file_read_from_disk`, but with writing instead.
+    // The tail buffer holds the last, partial block of the file, padded with zeroes.
+    // Unchanged blocks are skipped, which splits an extent into at most one range more per unchanged run.
+    size_t range_capacity = extents.count + write.unchanged.count;
+    ewsfs_block_range_t* ranges = malloc(range_capacity*sizeof(*ranges));
+    struct iovec* iovs = malloc(2*range_capacity*sizeof(*iovs));
+    size_t range_count = 0;
+    size_t iov_count = 0;
+    uint64_t write_size = 0;
+    uint64_t compressed_offset = 0;
+    for (size_t i = 0; i < extents.count && write_size < file_handle->buffer.count; ++i) {
+        uint64_t from = extents.items[i].from;
+        uint64_t length = extents.items[i].length;
+
+        uint64_t remaining = file_handle->buffer.count - write_size;
+        uint64_t full_blocks = remaining / block_size < length ? remaining / block_size : length;
+        size_t tail_size = full_blocks < length ? remaining - full_blocks*block_size : 0;
+        if (extents.items[i].kind == EWSFS_FILE_EXTENT_COMPRESSED) {
+            uint64_t physical = extents.items[i].physical;
+            ewsfs_block_range_t* range = &ranges[range_count++];
+            range->block_index = from;
+            range->block_count = physical;
+            range->iov = &iovs[iov_count];
+            range->iov_count = 1;
+            iovs[iov_count++] = (struct iovec) {compressed + compressed_offset, physical*block_size};
+            compressed_offset += physical*block_size;
+            write_size += full_blocks*block_size + tail_size;
+            continue;
+        }
+        if (extents.items[i].kind != EWSFS_FILE_EXTENT_DATA) {
+            write_size += full_blocks*block_size + tail_size;
+            continue;
+        }
+
+        uint64_t block_count = full_blocks + (tail_size > 0);
+        uint64_t run_start = 0;
+        while (run_start < block_count) {
+            if (ewsfs_extent_set_contains(&write.unchanged, from + run_start)) {
+                ++run_start;
+                continue;
+            }
+            uint64_t run_end = run_start + 1;
+            while (run_end < block_count && !ewsfs_extent_set_contains(&write.unchanged, from + run_end))
+                ++run_end;
+            uint64_t run_full_blocks = (run_end < full_blocks ? run_end : full_blocks) - run_start;
+
+            ewsfs_block_range_t* range = &ranges[range_count++];
+            range->block_index = from + run_start;
+            range->block_count = run_end - run_start;
+            range->iov = &iovs[iov_count];
+            range->iov_count = 0;
+            if (run_full_blocks > 0)
+                iovs[iov_count + range->iov_count++] = (struct iovec) {file_handle->buffer.items + write_size + run_start*block_size, run_full_blocks*block_size};
+            if (run_end > full_blocks) {
+                memcpy(tail_buffer, file_handle->buffer.items + write_size + full_blocks*block_size, tail_size);
+                memset(tail_buffer + tail_size, 0, block_size - tail_size);
+                iovs[iov_count + range->iov_count++] = (struct iovec) {tail_buffer, block_size};
+            }
+            iov_count += range->iov_count;
+            run_start = run_end;
+        }
+        write_size += full_blocks*block_size + tail_size;
+    }
+
+    error = ewsfs_block_write_ranges(fsdevice, ranges, range_count);
+    free(ranges);
+    free(iovs);
+
+    // The new blocks may not hold the file's data, so on error they're given back and the FACT keeps
+    // pointing to the old ones (blocks that are written in place may have some of the new data)
+    if (error) {
+        ewsfs_file_write_abort(&write);
+        return_defer(-error);
+    }
+    // If the file got smaller, give back the blocks it doesn't need anymore (preallocated blocks past
+    // the end of the file are only given back by a truncate)
+    if (file_handle->truncated && !rewrite)
+        ewsfs_file_extents_trim(&extents, needed_count);
+    // The new allocation and file size go into the FACT together, after the data is on the disk,
+    // so there's a single FACT save per write to disk
+    ewsfs_file_extents_store(allocation, &extents);
+    cJSON_DeleteItemFromObjectCaseSensitive(file_handle->item, "inline_data");
+    if (was_packed)
+        ewsfs_file_release_packed(&unpacked);
+    cJSON_SetNumberValue(cJSON_GetObjectItemCaseSensitive(file_handle->item, "file_size"), (double) write_size);
+    for (size_t i = 0; i < write.released.count; ++i)
+        ewsfs_file_release_blocks(write.released.items[i], 1);
+    // Save the FACT to the disk
+    ewsfs_fact_save_to_disk();
+    result = (int) write_size;
+defer:
+    free(compressed);
+    da_free(write.new_blocks);
+    da_free(write.referenced);
+    da_free(write.unchanged);
+    da_free(write.released);
+    da_free(old_extents);
+    da_free(extents);
+    return result;
+}
+
+int ewsfs_file_mknod(const char* path, mode_t mode, dev_t dev) {
+#ifdef EWSFS_LOG
+    if (strcmp(path, "/"EWSFS_LOG_FILE_NAME) == 0) {
+        return -EEXIST;
+    }
+#endif // EWSFS_LOG
+
+    ewsfs_log("[MKNOD] ewsfs_file_mknod: %s", path);
+
+    // We don't support creating anything but normal files as of now
+    if (!(mode & S_IFREG)) {
+        ewsfs_log("[MKNOD] Unsupported file type");
+        return -EINVAL;
+    }
+    (void) dev;
+
+    cJSON* item = ewsfs_file_get_item(path);
+    if (!item) {
+        int result = 0;
+
+        // Extract the directory and basename from the path
+        String_View sv_path = sv_from_cstr(path);
+        String_Builder sb_path_basename = {0};
+        String_Builder sb_path_dir = {0}; {
+            size_t i = sv_path.count - 1;
+            while (i != 0 && sv_path.data[i] != '/')
+                --i;
+            if (i == sv_path.count - 1) {
+                ewsfs_log("[MKNOD] Item is a directory");
+                return_defer(-EISDIR);
+            }
+            da_append_many(&sb_path_dir, sv_path.data, i == 0 ? 1 : i);
+            sb_append_null(&sb_path_dir);
+
+            da_append_many(&sb_path_basename, &sv_path.data[i+1], sv_path.count - i - 1);
+            sb_append_null(&sb_path_basename);
+        }
+
+        cJSON* dir = ewsfs_file_get_item(sb_path_dir.items);
+        if (!dir) {
+            ewsfs_log("[MKNOD] Item %s not found", sb_path_dir.items);
+            return_defer(-ENOENT);
+        }
+        if (dir != fact_root && !cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(dir, "is_dir"))) {
+            ewsfs_log("[MKNOD] Item %s not a directory", sb_path_dir.items);
+            return_defer(-ENOTDIR);
+        }
+
+        // Create the new cJSON object for this new file
+        item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "name", sb_path_basename.items);
+        cJSON_AddBoolToObject(item, "is_dir", false);
+        cJSON_AddNumberToObject(item, "file_size", 0.0);
+        // We don't need to add attributes, as they're added during validation if they're missing
+        cJSON_AddArrayToObject(item, "allocation");
+
+        // Add it to the directory's `contents` list
+        cJSON_AddItemToArray(cJSON_GetObjectItemCaseSensitive(dir, "contents"), item);
+
+        ewsfs_fact_save_to_disk();
+
+    defer:
+        // Cleanup
+        da_free(sb_path_dir);
+        da_free(sb_path_basename);
+        return result;
+    }
+    ewsfs_log("[MKNOD] Item already exists");
+    return -EEXIST;
+}
+
+int ewsfs_file_unlink(const char* path) {
+#ifdef EWSFS_LOG
+    if (strcmp(path, "/"EWSFS_LOG_FILE_NAME) == 0) {
+        return -EPERM;
+    }
+#endif // EWSFS_LOG
+
+    ewsfs_log("[UNLINK] ewsfs_file_unlink: %s", path);
+
+    // Check if the file exists and isn't a directory
+    cJSON* item = ewsfs_file_get_item(path);
+    if (!item) {
+        ewsfs_log("[UNLINK] Item not found");
+        return -ENOENT;
     }
     if (item == fact_root || cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(item, "is_dir"))) {
         ewsfs_log("[UNLINK] Item is a directory");
@@ -563,6 +1935,12 @@ int ewsfs_file_unlink(const char* path) {
     int index = 0;
     cJSON_ArrayForEach(dir_item, dir_contents) {
         if (dir_item == item) {
+            // The blocks are freed for real once the FACT without this file is saved.
+            // Handles that are still open keep the file's contents in memory.
+            int error = ewsfs_file_load_handles(item);
+            if (error < 0)
+                return_defer(error);
+            ewsfs_file_trim_allocation(cJSON_GetObjectItemCaseSensitive(item, "allocation"), 0);
             cJSON_DeleteItemFromArray(dir_contents, index);
 
             ewsfs_fact_save_to_disk();
@@ -655,6 +2033,17 @@ int ewsfs_file_rename(const char* src_path, const char* dst_path) {
         return_defer(-ENOTDIR);
     }
 
+    // A file that is replaced by the rename loses its blocks
+    if (dst_item && !cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(dst_item, "is_dir"))) {
+        int error = ewsfs_file_load_handles(dst_item);
+        if (error < 0)
+            return_defer(error);
+        ewsfs_file_trim_allocation(cJSON_GetObjectItemCaseSensitive(dst_item, "allocation"), 0);
+    }
+    // Within the same directory, the destination item would otherwise stay next to the renamed one
+    if (dst_item && src_dir == dst_dir)
+        cJSON_Delete(cJSON_DetachItemViaPointer(cJSON_GetObjectItemCaseSensitive(dst_dir, "contents"), dst_item));
+
     // Change the name of the source item
     cJSON_SetValuestring(cJSON_GetObjectItemCaseSensitive(src_item, "name"), sb_dst_path_basename.items);
 
@@ -850,22 +2239,7 @@ int ewsfs_file_truncate(const char* path, off_t length) {
     }
 
     int result = 0;
-
-    // Read the file into a temporary file handle
     file_handle_t file_handle = {0};
-    file_handle.item = item;
-    int error = ewsfs_file_read_from_disk(&file_handle);
-    if (error < 0) {
-        ewsfs_log("[TRUNCATE] ewsfs_file_read_from_disk failed with error %d", error);
-        return_defer(error);
-    }
-
-    // Truncate the same way as in ewsfs_fact_file_truncate
-    off_t sizediff = length - file_handle.buffer.count;
-    for (off_t i = 0; i < sizediff; ++i) {
-        da_append(&file_handle.buffer, '\0');
-    }
-    file_handle.buffer.count = length;
 
     // [HACK] Also truncate all open files
     for (uint64_t i = 0; i < MAX_FILE_HANDLES; ++i) {
@@ -878,35 +2252,52 @@ int ewsfs_file_truncate(const char* path, off_t length) {
         }
     }
 
-    // Write the file back to the disk
-    error = ewsfs_file_write_to_disk(&file_handle);
-    if (error < 0) {
-        ewsfs_log("[TRUNCATE] ewsfs_file_write_to_disk failed with error %d", error);
-        return_defer(error);
-    }
+    cJSON* file_size = cJSON_GetObjectItemCaseSensitive(item, "file_size");
+    cJSON* allocation = cJSON_GetObjectItemCaseSensitive(item, "allocation");
+    ewsfs_file_extent_list_t extents = {0};
+    ewsfs_file_extents_load(allocation, &extents);
+    if ((uint64_t) length >= (uint64_t) cJSON_GetNumberValue(file_size) && !ewsfs_file_inline_data(item) && !ewsfs_file_extents_packed(&extents)) {
+        // Growing a file only adds a hole at the end. The rest of its last block is already zeroes,
+        // so nothing has to be read or written.
+        uint64_t block_size = ewsfs_block_get_size();
+        uint64_t needed_count = ((uint64_t) length + block_size - 1) / block_size;
+        uint64_t block_count = ewsfs_file_extents_blocks(&extents);
+        if (block_count < needed_count) {
+            ewsfs_file_extents_append(&extents, EWSFS_FILE_EXTENT_HOLE, 0, needed_count - block_count);
+            ewsfs_file_extents_store(allocation, &extents);
+        }
+        cJSON_SetNumberValue(file_size, (double) length);
+    } else {
+        // Read the file into a temporary file handle
+        file_handle.item = item;
+        file_handle.truncated = true;
+        int error = ewsfs_file_read_from_disk(&file_handle);
+        if (error < 0) {
+            ewsfs_log("[TRUNCATE] ewsfs_file_read_from_disk failed with error %d", error);
+            return_defer(error);
+        }
+        // Inline and packed files are written as a whole, also when they grow
+        if ((size_t) length > file_handle.buffer.count) {
+            ewsfs_file_buffer_reserve(&file_handle.buffer, length);
+            memset(file_handle.buffer.items + file_handle.buffer.count, 0, length - file_handle.buffer.count);
+        }
+        file_handle.buffer.count = length;
 
-    // Remove unnecessary alloc items
-    cJSON* allocation = cJSON_GetObjectItemCaseSensitive(file_handle.item, "allocation");
-    cJSON* alloc_item = NULL;
-    uint64_t alloc_count = 0;
-    int delete_from = 0;
-    cJSON_ArrayForEach(alloc_item, allocation) {
-        if (alloc_count * ewsfs_block_get_size() >= (uint64_t) file_handle.buffer.count) {
-            break;
+        // Write the file back to the disk, which also frees the blocks past the new end of the file
+        error = ewsfs_file_write_to_disk(&file_handle);
+        if (error < 0) {
+            ewsfs_log("[TRUNCATE] ewsfs_file_write_to_disk failed with error %d", error);
+            return_defer(error);
         }
-        alloc_count += (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc_item, "length"));
-        ++delete_from;
-    }
-    for (int i = cJSON_GetArraySize(allocation) - 1; i >= delete_from; --i) {
-        cJSON_DeleteItemFromArray(allocation, i);
     }
 
     // Set the date_modified attribute
-    cJSON* attributes = cJSON_GetObjectItemCaseSensitive(file_handle.item, "attributes");
+    cJSON* attributes = cJSON_GetObjectItemCaseSensitive(item, "attributes");
     cJSON_SetNumberValue(cJSON_GetObjectItemCaseSensitive(attributes, "date_modified"), (double) time(NULL));
 
     ewsfs_fact_save_to_disk();
 defer:
+    da_free(extents);
     da_free(file_handle.buffer);
     return result;
 }
@@ -949,13 +2340,28 @@ int ewsfs_file_open(const char* path, struct fuse_file_info* fi) {
     for (uint64_t i = 0; i < MAX_FILE_HANDLES; ++i) {
         if (!file_handles[i].item) {
             fi->fh = i;
-            file_handles[i].item = item;
-            file_handles[i].flags = fi->flags;
-            int error = ewsfs_file_read_from_disk(&file_handles[i]);
-            if (error < 0) {
-                ewsfs_log("[OPEN] ewsfs_file_read_from_disk failed with error %d", error);
-                return error;
+            // Nothing is read yet, the buffer is loaded as the file is read, see ewsfs_file_read.
+            // Inline files are already in memory, so they're copied right away.
+            file_handle_t file_handle = {.item = item, .flags = fi->flags};
+            cJSON* inline_data = ewsfs_file_inline_data(item);
+            if (inline_data) {
+                int error = ewsfs_file_read_inline(inline_data, &file_handle.buffer);
+                if (error < 0) {
+                    da_free(file_handle.buffer);
+                    return error;
+                }
+                file_handle.loaded = FILE_HANDLE_LOADED;
+            } else {
+                ewsfs_file_extents_load(cJSON_GetObjectItemCaseSensitive(item, "allocation"), &file_handle.extents);
+                uint64_t file_size = ewsfs_file_loadable_size(item, &file_handle.extents);
+                ewsfs_file_buffer_reserve(&file_handle.buffer, file_size);
+                file_handle.buffer.count = file_size;
+                if (file_size == 0)
+                    file_handle.loaded = FILE_HANDLE_LOADED;
             }
+            pthread_mutex_lock(&handle_load_lock);
+            file_handles[i] = file_handle;
+            pthread_mutex_unlock(&handle_load_lock);
 
             // Set the date_accessed attribute
             cJSON* attributes = cJSON_GetObjectItemCaseSensitive(item, "attributes");
@@ -993,13 +2399,20 @@ int ewsfs_file_ftruncate(off_t length, struct fuse_file_info* fi) {
         ewsfs_log("[FTRUNCATE] File handle not writable");
         return -EBADF;
     }
+    int error = ewsfs_file_load(fi->fh, FILE_HANDLE_LOADED);
+    if (error < 0) {
+        ewsfs_log("[FTRUNCATE] ewsfs_file_load failed with error %d", error);
+        return error;
+    }
 
-    // Same as in `ewsfs_file_truncate`
-    off_t sizediff = length - file_handle->buffer.count;
-    for (off_t i = 0; i < sizediff; ++i) {
-        da_append(&file_handle->buffer, '\0');
+    // The new part is zeroes, which become a hole when the file is written to disk
+    if ((size_t) length > file_handle->buffer.count) {
+        ewsfs_file_buffer_reserve(&file_handle->buffer, length);
+        memset(file_handle->buffer.items + file_handle->buffer.count, 0, length - file_handle->buffer.count);
     }
     file_handle->buffer.count = length;
+    file_handle->truncated = true;
+    file_handle->dirty = true;
 
     // Set the date_modified attribute
     cJSON* attributes = cJSON_GetObjectItemCaseSensitive(file_handle->item, "attributes");
@@ -1008,6 +2421,174 @@ int ewsfs_file_ftruncate(off_t length, struct fuse_file_info* fi) {
     return 0;
 }
 
+int ewsfs_file_fallocate(const char* path, int mode, off_t offset, off_t length) {
+#ifdef EWSFS_LOG
+    if (strcmp(path, "/"EWSFS_LOG_FILE_NAME) == 0) {
+        return -EPERM;
+    }
+#endif // EWSFS_LOG
+
+    ewsfs_log("[FALLOCATE] ewsfs_file_fallocate: %s; %d; %ld; %ld", path, mode, offset, length);
+
+    if (offset < 0 || length <= 0) {
+        ewsfs_log("[FALLOCATE] Invalid offset or length");
+        return -EINVAL;
+    }
+    // Punching a hole never changes the file size, see fallocate(2)
+    if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+     || ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))) {
+        ewsfs_log("[FALLOCATE] Unsupported mode");
+        return -EOPNOTSUPP;
+    }
+
+    cJSON* item = ewsfs_file_get_item(path);
+    if (!item) {
+        ewsfs_log("[FALLOCATE] Item not found");
+        return -ENOENT;
+    }
+    if (item == fact_root || cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(item, "is_dir"))) {
+        ewsfs_log("[FALLOCATE] Item is a directory");
+        return -EISDIR;
+    }
+    int error = ewsfs_file_load_handles(item);
+    if (error < 0)
+        return error;
+
+    int result = 0;
+    uint64_t block_size = ewsfs_block_get_size();
+    uint64_t file_size = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(item, "file_size"));
+    uint64_t end = (uint64_t) offset + (uint64_t) length;
+    cJSON* allocation = cJSON_GetObjectItemCaseSensitive(item, "allocation");
+    ewsfs_file_extent_list_t extents = {0};
+    ewsfs_file_extent_list_t new_extents = {0};
+    ewsfs_file_extents_load(allocation, &extents);
+    file_handle_t file_handle = {0};
+    // Compressed files are rewritten on every flush, so preallocated blocks wouldn't be kept
+    bool compressed = ewsfs_file_extents_compressed(&extents);
+    bool is_inline = ewsfs_file_inline_data(item) != NULL;
+    bool packed = ewsfs_file_extents_packed(&extents);
+    if (!(mode & FALLOC_FL_PUNCH_HOLE) && (compressed || compress_files)) {
+        ewsfs_log("[FALLOCATE] Can't preallocate compressed files");
+        return_defer(-EOPNOTSUPP);
+    }
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        // Blocks that are completely inside the range lose their blocks
+        uint64_t first_block = ((uint64_t) offset + block_size - 1) / block_size;
+        uint64_t end_block = end / block_size;
+        uint64_t block_count = ewsfs_file_extents_blocks(&extents);
+        if (end_block > block_count)
+            end_block = block_count;
+        if (first_block < end_block && !compressed) {
+            size_t first = ewsfs_file_extents_split(&extents, first_block);
+            size_t last = ewsfs_file_extents_split(&extents, end_block);
+            for (size_t i = first; i < last; ++i) {
+                // A packed block is shared, the file's part of it is zeroed by rewriting the file below
+                if (extents.items[i].kind == EWSFS_FILE_EXTENT_PACKED)
+                    continue;
+                if (extents.items[i].kind != EWSFS_FILE_EXTENT_HOLE)
+                    ewsfs_file_release_blocks(extents.items[i].from, extents.items[i].length);
+                extents.items[i].kind = EWSFS_FILE_EXTENT_HOLE;
+            }
+            // Rebuild the list to merge the new hole with the ones next to it
+            for (size_t i = 0; i < extents.count; ++i)
+                ewsfs_file_extents_append_extent(&new_extents, &extents.items[i]);
+            ewsfs_file_extents_store(allocation, &new_extents);
+        }
+
+        // Open files see the zeroes right away, so they don't write the old data back into the hole
+        uint64_t zero_end = end < file_size ? end : file_size;
+        for (size_t i = 0; i < MAX_FILE_HANDLES; ++i) {
+            if (file_handles[i].item != item || (uint64_t) offset >= file_handles[i].buffer.count)
+                continue;
+            uint64_t handle_end = zero_end < file_handles[i].buffer.count ? zero_end : file_handles[i].buffer.count;
+            memset(file_handles[i].buffer.items + offset, 0, handle_end - offset);
+        }
+
+        // The partial blocks at the edges of the range still hold data, so zero those parts on the image.
+        // Compressed extents can't be split, so for those the whole range is zeroed and the file is rewritten,
+        // the same as inline and packed files.
+        if ((uint64_t) offset < file_size && (compressed || is_inline || packed || (uint64_t) offset % block_size != 0 || zero_end % block_size != 0)) {
+            file_handle.item = item;
+            error = ewsfs_file_read_from_disk(&file_handle);
+            if (error < 0)
+                return_defer(error);
+            memset(file_handle.buffer.items + offset, 0, zero_end - offset);
+            error = ewsfs_file_write_to_disk(&file_handle);
+            if (error < 0)
+                return_defer(error);
+        }
+    } else {
+        // Holes in the range get unwritten blocks, and so does the part past the end of the allocation
+        uint64_t first_block = (uint64_t) offset / block_size;
+        uint64_t end_block = (end + block_size - 1) / block_size;
+        uint64_t block_count = ewsfs_file_extents_blocks(&extents);
+        if (block_count < end_block)
+            ewsfs_file_extents_append(&extents, EWSFS_FILE_EXTENT_HOLE, 0, end_block - block_count);
+        size_t first = ewsfs_file_extents_split(&extents, first_block);
+        size_t last = ewsfs_file_extents_split(&extents, end_block);
+
+        uint64_t hint = ewsfs_file_alloc_hint(item);
+        for (size_t i = 0; i < extents.count; ++i) {
+            ewsfs_file_extent_t extent = extents.items[i];
+            if (i < first || i >= last || extent.kind != EWSFS_FILE_EXTENT_HOLE || result != 0) {
+                ewsfs_file_extents_append_extent(&new_extents, &extent);
+                continue;
+            }
+            uint64_t allocated = ewsfs_file_extents_allocate(&new_extents, hint, EWSFS_FILE_EXTENT_UNWRITTEN, extent.length, NULL);
+            if (allocated < extent.length) {
+                ewsfs_file_extents_append(&new_extents, EWSFS_FILE_EXTENT_HOLE, 0, extent.length - allocated);
+                result = -ENOSPC;
+            }
+        }
+        // Holes past the end of the file aren't part of it, so drop them again if the allocation failed
+        while (new_extents.count > 0 && new_extents.items[new_extents.count - 1].kind == EWSFS_FILE_EXTENT_HOLE
+            && (ewsfs_file_extents_blocks(&new_extents) - new_extents.items[new_extents.count - 1].length)*block_size >= file_size)
+            --new_extents.count;
+        ewsfs_file_extents_store(allocation, &new_extents);
+
+        if (result == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && end > file_size) {
+            cJSON_SetNumberValue(cJSON_GetObjectItemCaseSensitive(item, "file_size"), (double) end);
+            // Grow the open files along with it, otherwise their next flush would shrink the file again
+            for (size_t i = 0; i < MAX_FILE_HANDLES; ++i) {
+                if (file_handles[i].item != item || file_handles[i].buffer.count >= end)
+                    continue;
+                ewsfs_file_buffer_reserve(&file_handles[i].buffer, end);
+                memset(file_handles[i].buffer.items + file_handles[i].buffer.count, 0, end - file_handles[i].buffer.count);
+                file_handles[i].buffer.count = end;
+            }
+        }
+
+        // The data of an inline or packed file moves into blocks of its own, next to the preallocated ones
+        if (result == 0 && (is_inline || packed)) {
+            file_handle.item = item;
+            error = ewsfs_file_read_from_disk(&file_handle);
+            if (error < 0)
+                return_defer(error);
+            uint64_t new_size = (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(item, "file_size"));
+            if (new_size > file_handle.buffer.count) {
+                ewsfs_file_buffer_reserve(&file_handle.buffer, new_size);
+                memset(file_handle.buffer.items + file_handle.buffer.count, 0, new_size - file_handle.buffer.count);
+                file_handle.buffer.count = new_size;
+            }
+            error = ewsfs_file_write_to_disk(&file_handle);
+            if (error < 0)
+                return_defer(error);
+        }
+    }
+
+    // Set the date_modified attribute
+    cJSON* attributes = cJSON_GetObjectItemCaseSensitive(item, "attributes");
+    cJSON_SetNumberValue(cJSON_GetObjectItemCaseSensitive(attributes, "date_modified"), (double) time(NULL));
+
+    ewsfs_fact_save_to_disk();
+defer:
+    da_free(extents);
+    da_free(new_extents);
+    da_free(file_handle.buffer);
+    return result;
+}
+
 int ewsfs_file_read(char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) {
 #ifdef EWSFS_LOG
     if (fi->fh == MAX_FILE_HANDLES) {
@@ -1038,20 +2619,37 @@ int ewsfs_file_read(char* buffer, size_t size, off_t offset, struct fuse_file_in
         ewsfs_log("[READ] File handle too large");
         return -EBADF;
     }
-    const file_handle_t file_handle = file_handles[fi->fh];
-    if (file_handle.flags & O_WRONLY) {
+    file_handle_t* file_handle = &file_handles[fi->fh];
+    if (file_handle->flags & O_WRONLY) {
         ewsfs_log("[READ] File handle not readable");
         return -EBADF;
     }
+    uint64_t file_size = file_handle->buffer.count;
+    if ((uint64_t) offset >= file_size) {
+        ewsfs_log("[READ] Read 0 bytes");
+        return 0;
+    }
+    size_t read_size = file_size - offset < size ? file_size - offset : size;
 
-    // Copy from the buffer in the file_handle to the provided buffer
-    size_t read_size = 0;
-    for (size_t i = offset; i < offset + size; ++i) {
-        if (i >= file_handle.buffer.count)
-            break;
-        buffer[i - offset] = file_handle.buffer.items[i];
-        read_size++;
+    // A sequential reader gets the blocks after this read loaded in the background, a growing window ahead of it
+    pthread_mutex_lock(&handle_load_lock);
+    uint64_t window = ewsfs_readahead_update(&file_handle->readahead, offset, read_size);
+    uint64_t prefetch_end = file_size - offset - read_size > window ? offset + read_size + window : file_size;
+    bool prefetch = window > 0 && file_handle->loaded < prefetch_end && file_handle->prefetch_end < prefetch_end;
+    if (prefetch)
+        file_handle->prefetch_end = prefetch_end;
+    pthread_mutex_unlock(&handle_load_lock);
+
+    int error = ewsfs_file_load(fi->fh, offset + read_size);
+    if (error < 0) {
+        ewsfs_log("[READ] ewsfs_file_load failed with error %d", error);
+        return error;
     }
+    if (prefetch)
+        ewsfs_readahead_queue(fi->fh);
+
+    // Copy from the buffer in the file_handle to the provided buffer
+    memcpy(buffer, file_handle->buffer.items + offset, read_size);
     ewsfs_log("[READ] Read %zu bytes", read_size);
     return read_size;
 }
@@ -1074,6 +2672,11 @@ int ewsfs_file_write(const char* buffer, size_t size, off_t offset, struct fuse_
         ewsfs_log("[WRITE] File handle not writable");
         return -EBADF;
     }
+    int error = ewsfs_file_load(fi->fh, FILE_HANDLE_LOADED);
+    if (error < 0) {
+        ewsfs_log("[WRITE] ewsfs_file_load failed with error %d", error);
+        return error;
+    }
 
     // Copy from the provided buffer to the file_handle buffer
     size_t write_size = 0;
@@ -1089,6 +2692,8 @@ int ewsfs_file_write(const char* buffer, size_t size, off_t offset, struct fuse_
     cJSON* attributes = cJSON_GetObjectItemCaseSensitive(file_handle->item, "attributes");
     cJSON_SetNumberValue(cJSON_GetObjectItemCaseSensitive(attributes, "date_modified"), (double) time(NULL));
 
+    file_handle->dirty = true;
+
     ewsfs_log("[WRITE] Wrote %zu bytes", write_size);
     return write_size;
 }
@@ -1112,12 +2717,20 @@ int ewsfs_file_flush(struct fuse_file_info* fi) {
         return -EBADF;
     }
 
+    // Nothing changed since the last flush, so there's nothing to allocate or write
+    if (!file_handle.dirty) {
+        ewsfs_log("[FLUSH] File handle not dirty");
+        return 0;
+    }
+
     // Write the file_handle buffer to disk
     int error = ewsfs_file_write_to_disk(&file_handle);
     if (error < 0) {
         ewsfs_log("[FLUSH] ewsfs_file_write_to_disk failed with error %d", error);
         return error;
     }
+    file_handles[fi->fh].truncated = false;
+    file_handles[fi->fh].dirty = false;
     return 0;
 }
 
@@ -1140,20 +2753,474 @@ int ewsfs_file_release(struct fuse_file_info* fi) {
         return -EBADF;
     }
 
-    // Free the memory and mark this file handle as unused
-    da_free(file_handle.buffer);
+    // Free the memory and mark this file handle as unused, once the read-ahead thread isn't loading into it anymore
+    pthread_mutex_lock(&handle_load_lock);
+    while (file_handles[fi->fh].loading)
+        pthread_cond_wait(&handle_loaded, &handle_load_lock);
+    da_free(file_handles[fi->fh].buffer);
+    da_free(file_handles[fi->fh].extents);
     file_handles[fi->fh] = (file_handle_t) {0};
+    pthread_mutex_unlock(&handle_load_lock);
+    return 0;
+}
+
+
+void ewsfs_fact_lock(bool exclusive) {
+    if (exclusive)
+        pthread_rwlock_wrlock(&fact_lock);
+    else
+        pthread_rwlock_rdlock(&fact_lock);
+}
+
+void ewsfs_fact_unlock() {
+    pthread_rwlock_unlock(&fact_lock);
+}
+
+// The amount of blocks copied at once when a file is moved
+#define DEFRAG_CHUNK_BLOCKS 256
+
+// Move the blocks of a file with at least `min_fragments` fragments into one free run.
+// The data is copied first and the old blocks are only freed after the next FACT commit,
+// so the FACT on the image points to a complete copy at all times.
+// Returns 1 if the file was moved, 0 if it was left alone, or a negative errno.
+static int ewsfs_file_defrag(cJSON* item, uint64_t min_fragments) {
+    uint64_t block_size = ewsfs_block_get_size();
+    cJSON* allocation = cJSON_GetObjectItemCaseSensitive(item, "allocation");
+    ewsfs_file_extent_list_t extents = {0};
+    ewsfs_file_extent_list_t new_extents = {0};
+    uint8_t* buffer = NULL;
+    int result = 0;
+    ewsfs_file_extents_load(allocation, &extents);
+
+    // A fragment is a run of blocks that doesn't start right where the previous one ended
+    uint64_t fragments = 0;
+    uint64_t allocated = 0;
+    uint64_t next_block = 0;
+    for (size_t i = 0; i < extents.count; ++i) {
+        if (extents.items[i].kind == EWSFS_FILE_EXTENT_HOLE)
+            continue;
+        if (fragments == 0 || extents.items[i].from != next_block)
+            ++fragments;
+        next_block = extents.items[i].from + ewsfs_file_extent_physical(&extents.items[i]);
+        allocated += ewsfs_file_extent_physical(&extents.items[i]);
+    }
+    if (fragments < min_fragments || fragments < 2)
+        return_defer(0);
+    // Blocks shared with other files have to stay where they are
+    for (size_t i = 0; i < extents.count && dedup_index.blocks.count > 0; ++i) {
+        if (extents.items[i].kind == EWSFS_FILE_EXTENT_HOLE || extents.items[i].kind == EWSFS_FILE_EXTENT_UNWRITTEN)
+            continue;
+        for (uint64_t block = extents.items[i].from; block < extents.items[i].from + ewsfs_file_extent_physical(&extents.items[i]); ++block) {
+            if (ewsfs_dedup_refs(&dedup_index, block) > 1)
+                return_defer(0);
+        }
+    }
+    // Open handles would load the rest of their buffers from the old blocks
+    int error = ewsfs_file_load_handles(item);
+    if (error < 0)
+        return_defer(error);
+
+    uint64_t from = 0;
+    uint64_t length = 0;
+    if (!ewsfs_block_allocate_extent(&block_allocator, ewsfs_file_alloc_hint(item), allocated, &from, &length))
+        return_defer(0);
+    if (length < allocated) {
+        // There's no free run that's long enough, try again when there is
+        ewsfs_alloc_set_free(&block_allocator, from, length);
+        return_defer(0);
+    }
+
+    buffer = malloc(DEFRAG_CHUNK_BLOCKS*block_size);
+    uint64_t position = from;
+    for (size_t i = 0; i < extents.count; ++i) {
+        ewsfs_file_extent_t extent = extents.items[i];
+        if (extent.kind == EWSFS_FILE_EXTENT_HOLE) {
+            ewsfs_file_extents_append(&new_extents, extent.kind, 0, extent.length);
+            continue;
+        }
+        // Unwritten blocks read as zeroes anyway, so only their place in the new run matters.
+        // Compressed extents are moved as they are.
+        uint64_t physical = ewsfs_file_extent_physical(&extent);
+        for (uint64_t done = 0; extent.kind != EWSFS_FILE_EXTENT_UNWRITTEN && done < physical; done += DEFRAG_CHUNK_BLOCKS) {
+            uint64_t count = physical - done < DEFRAG_CHUNK_BLOCKS ? physical - done : DEFRAG_CHUNK_BLOCKS;
+            struct iovec iov = {buffer, count*block_size};
+            error = ewsfs_block_read_range(fsdevice, extent.from + done, count, &iov, 1);
+            if (!error)
+                error = ewsfs_block_write_range(fsdevice, position + done, count, &iov, 1);
+            if (error) {
+                ewsfs_alloc_set_free(&block_allocator, from, length);
+                return_defer(-error);
+            }
+        }
+        if (extent.kind == EWSFS_FILE_EXTENT_COMPRESSED)
+            ewsfs_file_extents_append_compressed(&new_extents, position, physical, extent.length, extent.compressed_size);
+        else
+            ewsfs_file_extents_append(&new_extents, extent.kind, position, extent.length);
+        position += physical;
+    }
+
+    // Indexed blocks only have this file's reference, so their index entries move along with them
+    position = from;
+    for (size_t i = 0; i < extents.count && dedup_index.blocks.count > 0; ++i) {
+        for (uint64_t block = 0; extents.items[i].kind == EWSFS_FILE_EXTENT_DATA && block < extents.items[i].length; ++block) {
+            if (ewsfs_dedup_refs(&dedup_index, extents.items[i].from + block) > 0) {
+                ewsfs_dedup_move(&dedup_index, extents.items[i].from + block, position + block);
+                dedup_changed = true;
+            }
+        }
+        position += ewsfs_file_extent_physical(&extents.items[i]);
+    }
+    for (size_t i = 0; i < extents.count; ++i) {
+        if (extents.items[i].kind != EWSFS_FILE_EXTENT_HOLE)
+            ewsfs_file_release_blocks(extents.items[i].from, ewsfs_file_extent_physical(&extents.items[i]));
+    }
+    ewsfs_file_extents_store(allocation, &new_extents);
+    ewsfs_log("[DEFRAG] Moved %s from %"PRIu64" fragments to block %"PRIu64, cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(item, "name")), fragments, from);
+    result = 1;
+defer:
+    free(buffer);
+    da_free(extents);
+    da_free(new_extents);
+    return result;
+}
+
+static int ewsfs_fact_defrag_dir(cJSON* dir, uint64_t min_fragments, uint64_t max_files, uint64_t* moved_count) {
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, cJSON_GetObjectItemCaseSensitive(dir, "contents")) {
+        if (*moved_count >= max_files)
+            return 0;
+        int result = 0;
+        if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(item, "is_dir")))
+            result = ewsfs_fact_defrag_dir(item, min_fragments, max_files, moved_count);
+        else
+            result = ewsfs_file_defrag(item, min_fragments);
+        if (result < 0)
+            return result;
+        *moved_count += result > 0;
+    }
     return 0;
 }
 
+int ewsfs_fact_defrag(uint64_t min_fragments, uint64_t max_files, uint64_t* moved_count) {
+    *moved_count = 0;
+    int result = ewsfs_fact_defrag_dir(fact_root, min_fragments, max_files, moved_count);
+    // One commit swaps the allocations of all moved files and frees their old blocks
+    if (*moved_count > 0)
+        ewsfs_fact_save_to_disk();
+    return result;
+}
+
+// A packed file that's moved by compacting, with its packed extent
+typedef struct {
+    cJSON* item;
+    ewsfs_file_extent_t extent;
+} ewsfs_packed_file_t;
+
+typedef struct {
+    ewsfs_packed_file_t* items;
+    size_t count;
+    size_t capacity;
+} ewsfs_packed_file_list_t;
+
+// Collect the packed files in `dir` whose blocks are less than half full.
+// The current pack block is left alone, that's where they're moved to.
+static void ewsfs_fact_collect_sparse_packed(cJSON* dir, ewsfs_packed_file_list_t* files) {
+    uint64_t block_size = ewsfs_block_get_size();
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, cJSON_GetObjectItemCaseSensitive(dir, "contents")) {
+        if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(item, "is_dir"))) {
+            ewsfs_fact_collect_sparse_packed(item, files);
+            continue;
+        }
+        cJSON* allocation = cJSON_GetObjectItemCaseSensitive(item, "allocation");
+        if (!allocation || !allocation->child || ewsfs_file_extent_kind(allocation->child) != EWSFS_FILE_EXTENT_PACKED)
+            continue;
+        ewsfs_file_extent_t extent = {
+            EWSFS_FILE_EXTENT_PACKED,
+            (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(allocation->child, "from")), 1, 0, 0,
+            (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(allocation->child, "offset")),
+            (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(allocation->child, "size")),
+        };
+        const ewsfs_pack_block_t* pack = ewsfs_pack_get(&pack_index, extent.from);
+        if (!pack || pack->used*2 >= block_size || (pack_index.has_current && pack_index.current == extent.from))
+            continue;
+        da_append(files, ((ewsfs_packed_file_t) {item, extent}));
+    }
+}
+
+static int ewsfs_packed_file_compare(const void* a, const void* b) {
+    uint64_t a_block = ((const ewsfs_packed_file_t*) a)->extent.from;
+    uint64_t b_block = ((const ewsfs_packed_file_t*) b)->extent.from;
+    return (a_block > b_block) - (a_block < b_block);
+}
+
+int ewsfs_fact_grow(uint64_t* old_count, uint64_t* new_count) {
+    *old_count = ewsfs_block_get_count();
+    *new_count = *old_count;
+    // Loads in the background read from the mapped image, which can move
+    if (ewsfs_file_load_handles(NULL) < 0)
+        return -EIO;
+
+    // The used blocks stay as they are, the allocator only gets free blocks at its end
+    int result = 0;
+    ewsfs_block_hold_discard(fsdevice);
+    int error = ewsfs_block_grow(fsdevice, new_count);
+    if (error) {
+        *new_count = *old_count;
+        result = -error;
+    } else if (!ewsfs_alloc_grow(&block_allocator, *new_count)) {
+        // Only the blocks the allocator got can be used
+        *new_count = block_allocator.block_count;
+        ewsfs_block_set_count(*new_count);
+        result = -ENOMEM;
+    }
+    ewsfs_block_release_discard(fsdevice);
+    if (*new_count == *old_count)
+        return result;
 
-bool ewsfs_fact_init(FILE* file) {
+    // Like mkfs.ewsfs, the size includes the 8 reserved bytes with the block size
+    cJSON* fs_info = cJSON_GetObjectItemCaseSensitive(fact_root, "filesystem_info");
+    cJSON_SetNumberValue(cJSON_GetObjectItemCaseSensitive(fs_info, "size"), (double) (*new_count*ewsfs_block_get_size() + 8));
+    ewsfs_fact_save_to_disk();
+    ewsfs_log("[FACT] Grew from %"PRIu64" to %"PRIu64" blocks", *old_count, *new_count);
+    return result;
+}
+
+int ewsfs_fact_compact(uint64_t max_blocks, uint64_t* freed_count) {
+    *freed_count = 0;
+    uint64_t block_size = ewsfs_block_get_size();
+    uint8_t block_data[block_size];
+    ewsfs_packed_file_list_t files = {0};
+    ewsfs_file_extent_list_t extents = {0};
+    uint64_t moved_count = 0;
+    int result = 0;
+    ewsfs_fact_collect_sparse_packed(fact_root, &files);
+    if (files.count == 0)
+        return_defer(0);
+    // The files of each block are moved together, so the block is read once
+    qsort(files.items, files.count, sizeof(*files.items), ewsfs_packed_file_compare);
+    // Moving the files of a single block to a new one wouldn't free anything
+    if (files.items[0].extent.from == files.items[files.count - 1].extent.from) {
+        uint64_t block = 0;
+        uint64_t offset = 0;
+        if (!ewsfs_pack_find(&pack_index, block_size, ewsfs_pack_get(&pack_index, files.items[0].extent.from)->used, &block, &offset))
+            return_defer(0);
+    }
+
+    uint64_t block_count = 0;
+    for (size_t i = 0; i < files.count; ++i) {
+        cJSON* item = files.items[i].item;
+        ewsfs_file_extent_t extent = files.items[i].extent;
+        if (i == 0 || extent.from != files.items[i - 1].extent.from) {
+            if (block_count >= max_blocks)
+                break;
+            ++block_count;
+            int error = ewsfs_block_read(fsdevice, extent.from, block_data);
+            if (error) {
+                result = -error;
+                break;
+            }
+        }
+        // Open handles would load the rest of their buffers from the old place
+        int error = ewsfs_file_load_handles(item);
+        ewsfs_file_extent_t packed = {0};
+        if (!error)
+            error = ewsfs_file_pack(block_data + extent.offset, extent.size, ewsfs_file_alloc_hint(item), &packed);
+        if (error < 0) {
+            result = error;
+            break;
+        }
+        cJSON* allocation = cJSON_GetObjectItemCaseSensitive(item, "allocation");
+        ewsfs_file_extents_load(allocation, &extents);
+        extents.items[0] = packed;
+        ewsfs_file_extents_store(allocation, &extents);
+        ewsfs_file_release_packed(&extent);
+        if (!ewsfs_pack_get(&pack_index, extent.from))
+            ++*freed_count;
+        ++moved_count;
+    }
+    // One commit moves all files and frees the blocks they left
+    if (moved_count > 0) {
+        ewsfs_log("[COMPACT] Moved %"PRIu64" packed files, freed %"PRIu64" blocks", moved_count, *freed_count);
+        ewsfs_fact_save_to_disk();
+    }
+defer:
+    da_free(files);
+    da_free(extents);
+    return result;
+}
+
+// Make `dst_path` a copy of `src_path` that shares all of its blocks. The blocks are copied when either file
+// writes to them, see ewsfs_file_extents_keep_data.
+int ewsfs_fact_reflink(const char* src_path, const char* dst_path, uint64_t* shared_count) {
+    ewsfs_log("[REFLINK] ewsfs_fact_reflink: %s; %s", src_path, dst_path);
+    *shared_count = 0;
+
+    cJSON* src = ewsfs_file_get_item(src_path);
+    if (!src) {
+        ewsfs_log("[REFLINK] Item not found");
+        return -ENOENT;
+    }
+    if (src == fact_root || cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(src, "is_dir"))) {
+        ewsfs_log("[REFLINK] Item is a directory");
+        return -EISDIR;
+    }
+
+    // Writes that weren't flushed yet are part of the copy
+    for (uint64_t i = 0; i < MAX_FILE_HANDLES; ++i) {
+        if (file_handles[i].item != src || !file_handles[i].dirty)
+            continue;
+        int error = ewsfs_file_flush(&((struct fuse_file_info){.fh = i}));
+        if (error < 0) {
+            ewsfs_log("[REFLINK] ewsfs_file_flush failed with error %d", error);
+            return error;
+        }
+    }
+
+    cJSON* dst = ewsfs_file_get_item(dst_path);
+    if (dst == src) {
+        ewsfs_log("[REFLINK] Source and destination are the same file");
+        return -EINVAL;
+    }
+    if (!dst) {
+        int error = ewsfs_file_mknod(dst_path, S_IFREG | 0644, 0);
+        if (error < 0) {
+            ewsfs_log("[REFLINK] ewsfs_file_mknod failed with error %d", error);
+            return error;
+        }
+        dst = ewsfs_file_get_item(dst_path);
+    } else if (dst == fact_root || cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(dst, "is_dir"))) {
+        ewsfs_log("[REFLINK] Destination is a directory");
+        return -EISDIR;
+    }
+    // An open handle would write its old contents back over the copy
+    for (uint64_t i = 0; i < MAX_FILE_HANDLES; ++i) {
+        if (file_handles[i].item == dst) {
+            ewsfs_log("[REFLINK] Destination is open");
+            return -EBUSY;
+        }
+    }
+
+    cJSON* dst_allocation = cJSON_GetObjectItemCaseSensitive(dst, "allocation");
+    ewsfs_file_trim_allocation(dst_allocation, 0);
+    // Inline data has no blocks to share, so it's copied
+    cJSON_DeleteItemFromObjectCaseSensitive(dst, "inline_data");
+    cJSON* inline_data = ewsfs_file_inline_data(src);
+    if (inline_data)
+        cJSON_AddStringToObject(dst, "inline_data", cJSON_GetStringValue(inline_data));
+
+    ewsfs_file_extent_list_t extents = {0};
+    ewsfs_file_extent_list_t cloned = {0};
+    ewsfs_file_extents_load(cJSON_GetObjectItemCaseSensitive(src, "allocation"), &extents);
+    for (size_t i = 0; i < extents.count; ++i) {
+        ewsfs_file_extent_t extent = extents.items[i];
+        // Unwritten blocks read as zeroes, a hole does the same without sharing them
+        if (extent.kind == EWSFS_FILE_EXTENT_HOLE || extent.kind == EWSFS_FILE_EXTENT_UNWRITTEN) {
+            ewsfs_file_extents_append(&cloned, EWSFS_FILE_EXTENT_HOLE, 0, extent.length);
+            continue;
+        }
+        ewsfs_file_extents_append_extent(&cloned, &extent);
+        // The pack index counts the bytes files use, so a packed block stays until both files leave it
+        if (extent.kind == EWSFS_FILE_EXTENT_PACKED) {
+            ewsfs_pack_add(&pack_index, extent.from, extent.offset, extent.size);
+            *shared_count += 1;
+            continue;
+        }
+        uint64_t physical = ewsfs_file_extent_physical(&extent);
+        for (uint64_t block = extent.from; block < extent.from + physical; ++block)
+            ewsfs_dedup_share(&dedup_index, block);
+        *shared_count += physical;
+        dedup_changed = true;
+    }
+    ewsfs_file_extents_store(dst_allocation, &cloned);
+    da_free(extents);
+    da_free(cloned);
+
+    cJSON_SetNumberValue(cJSON_GetObjectItemCaseSensitive(dst, "file_size"), cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(src, "file_size")));
+    cJSON* attributes = cJSON_GetObjectItemCaseSensitive(dst, "attributes");
+    cJSON_SetNumberValue(cJSON_GetObjectItemCaseSensitive(attributes, "date_modified"), (double) time(NULL));
+
+    ewsfs_fact_save_to_disk();
+    return 0;
+}
+
+static const char* ewsfs_fact_layout_name(ewsfs_block_layout_t layout) {
+    switch (layout) {
+        case EWSFS_BLOCK_LAYOUT_STRIPE:
+            return "stripe";
+        case EWSFS_BLOCK_LAYOUT_MIRROR:
+            return "mirror";
+    }
+    return "unknown";
+}
+
+// A filesystem on several images remembers how its blocks are spread over them, so it can't be mounted any other way.
+// It's stored with the next commit.
+static bool ewsfs_fact_check_layout(cJSON* root, ewsfs_block_device_t* device) {
+    ewsfs_block_layout_t layout = EWSFS_BLOCK_LAYOUT_STRIPE;
+    uint64_t images = 1;
+    uint64_t stripe_blocks = 0;
+    ewsfs_block_get_layout(device, &layout, &images, &stripe_blocks);
+    bool mirrored = layout == EWSFS_BLOCK_LAYOUT_MIRROR;
+    cJSON* fs_info = cJSON_GetObjectItemCaseSensitive(root, "filesystem_info");
+    cJSON* stored_images = cJSON_GetObjectItemCaseSensitive(fs_info, "images");
+    cJSON* stored_stripe_blocks = cJSON_GetObjectItemCaseSensitive(fs_info, "stripe_blocks");
+    if (!cJSON_IsNumber(stored_images)) {
+        if (images == 1 && !mirrored)
+            return true;
+        // The blocks of a single image would end up on the wrong images, or only on one of them
+        if (cJSON_GetArraySize(cJSON_GetObjectItemCaseSensitive(root, "contents")) > 0) {
+            nob_log(ERROR, "Only an empty filesystem can be spread over several images");
+            return false;
+        }
+        cJSON_AddStringToObject(fs_info, "layout", ewsfs_fact_layout_name(layout));
+        cJSON_AddNumberToObject(fs_info, "images", images);
+        if (!mirrored)
+            cJSON_AddNumberToObject(fs_info, "stripe_blocks", stripe_blocks);
+        return true;
+    }
+    // Filesystems that were striped before mirroring was added don't have a layout
+    cJSON* stored_layout = cJSON_GetObjectItemCaseSensitive(fs_info, "layout");
+    const char* expected_layout = cJSON_IsString(stored_layout) ? cJSON_GetStringValue(stored_layout) : "stripe";
+    uint64_t expected_images = cJSON_GetNumberValue(stored_images);
+    uint64_t expected_stripe_blocks = cJSON_IsNumber(stored_stripe_blocks) ? cJSON_GetNumberValue(stored_stripe_blocks) : 0;
+    if (strcmp(expected_layout, ewsfs_fact_layout_name(layout)) != 0) {
+        nob_log(ERROR, "The filesystem is a %s of %"PRIu64" images, it's mounted as a %s", expected_layout, expected_images, ewsfs_fact_layout_name(layout));
+        return false;
+    }
+    if (mirrored) {
+        // A mirror still has all blocks with one image left; an image can only be added by copying one that's in it
+        if (images > expected_images) {
+            nob_log(ERROR, "The filesystem is a mirror of %"PRIu64" images, not %"PRIu64, expected_images, images);
+            return false;
+        }
+        if (images < expected_images)
+            nob_log(WARNING, "Only %"PRIu64" of the %"PRIu64" images of the mirror are mounted", images, expected_images);
+        return true;
+    }
+    if (expected_images != images || (images > 1 && expected_stripe_blocks != stripe_blocks)) {
+        nob_log(ERROR, "The filesystem is striped across %"PRIu64" images with a stripe of %"PRIu64" blocks, not %"PRIu64" images with a stripe of %"PRIu64" blocks",
+                expected_images, expected_stripe_blocks, images, stripe_blocks);
+        return false;
+    }
+    return true;
+}
+
+// Read, parse and validate the FACT, starting over with the used blocks
+static bool ewsfs_fact_load_from_image(ewsfs_block_device_t* device) {
     ewsfs_log("[BLOCK] Reset used blocks");
     fact_block_indexes.count = 0;
-    used_block_indexes.count = 0;
+    freed_extents.count = 0;
+    ewsfs_alloc_uninit(&block_allocator);
+    if (!ewsfs_alloc_init(&block_allocator, ewsfs_block_get_count()))
+        return false;
+    if (fact_root) {
+        cJSON_Delete(fact_root);
+        fact_root = NULL;
+    }
 
     fact_file_buffer.count = 0;
-    ewsfs_fact_read_from_image(file, &fact_file_buffer);
+    ewsfs_fact_read_from_image(device, &fact_file_buffer);
 
     // Copy the buffer to the current_file_on_disk buffer as well
     fact_current_file_on_disk.count = 0;
@@ -1162,26 +3229,163 @@ bool ewsfs_fact_init(FILE* file) {
     fact_root = cJSON_ParseWithLength((char*) fact_file_buffer.items, fact_file_buffer.count);
     if (!fact_root)
         return false;
+    return ewsfs_fact_validate(fact_root);
+}
 
+// Whether an image of a mirror has the same FACT chain as the one that was loaded. The FACT has the generation,
+// so an image that missed a commit doesn't match.
+static bool ewsfs_fact_replica_matches(ewsfs_block_device_t* device, size_t replica) {
+    if (!ewsfs_block_pin_replica(device, replica))
+        return true;
+    ewsfs_fact_buffer_t buffer = {0};
+    ewsfs_block_index_list_t indexes = {0};
+    bool matches = ewsfs_fact_read_chain(device, &buffer, &indexes)
+        && buffer.count == fact_current_file_on_disk.count
+        && memcmp(buffer.items, fact_current_file_on_disk.items, buffer.count) == 0
+        && indexes.count == fact_block_indexes.count
+        && memcmp(indexes.items, fact_block_indexes.items, indexes.count*sizeof(*indexes.items)) == 0;
+    ewsfs_block_unpin_replica(device);
+    da_free(buffer);
+    da_free(indexes);
+    return matches;
+}
 
-    if (!ewsfs_fact_validate(fact_root))
+// Copy the used blocks of image `from` of a mirror to image `to`, which missed commits. Its data blocks can be as
+// old as its FACT, so they're all copied. The FACT chain starts at block 0, which goes last: if the copy is
+// interrupted, the image still has its old (or a broken) FACT at the next mount. An image that can't be written
+// to isn't used anymore.
+static void ewsfs_fact_resync_replica(ewsfs_block_device_t* device, size_t from, size_t to) {
+    uint64_t block_count = ewsfs_block_get_count();
+    uint64_t copied = 1;
+    int error = 0;
+    for (uint64_t block = 1; block < block_count && !error;) {
+        if (!ewsfs_alloc_is_used(&block_allocator, block)) {
+            ++block;
+            continue;
+        }
+        uint64_t run_end = block + 1;
+        while (run_end < block_count && ewsfs_alloc_is_used(&block_allocator, run_end))
+            ++run_end;
+        error = ewsfs_block_copy_replica(device, from, to, block, run_end - block);
+        copied += run_end - block;
+        block = run_end;
+    }
+    if (!error)
+        error = ewsfs_block_sync(device);
+    if (!error)
+        error = ewsfs_block_copy_replica(device, from, to, 0, 1);
+    if (!error)
+        error = ewsfs_block_sync(device);
+    if (error) {
+        nob_log(ERROR, "Couldn't copy the blocks of image %zu of the mirror to image %zu (%s), it won't be used", from + 1, to + 1, strerror(error));
+        ewsfs_block_fail_replica(device, to);
+        return;
+    }
+    ewsfs_log("[FACT] Copied %"PRIu64" blocks from image %zu to image %zu", copied, from + 1, to + 1);
+}
+
+bool ewsfs_fact_init(ewsfs_block_device_t* device) {
+    // Every image of a mirror has its own copy of the FACT. They're the same, unless an image missed commits (it
+    // failed, wasn't mounted, or a commit was interrupted); the valid one with the newest generation is used then.
+    uint64_t replicas = 1;
+    uint64_t failed_replicas = 0;
+    ewsfs_block_get_replicas(device, &replicas, &failed_replicas);
+    size_t newest = replicas;
+    size_t loaded_replica = replicas;
+    uint64_t newest_generation = 0;
+    for (size_t replica = 0; replica < replicas; ++replica) {
+        if (replicas > 1)
+            ewsfs_block_pin_replica(device, replica);
+        bool loaded = ewsfs_fact_load_from_image(device);
+        ewsfs_block_unpin_replica(device);
+        if (!loaded) {
+            if (replicas > 1)
+                nob_log(WARNING, "Image %zu of the mirror doesn't have a valid FACT", replica + 1);
+            continue;
+        }
+        loaded_replica = replica;
+        uint64_t generation = ewsfs_fact_get_generation(fact_root);
+        if (newest == replicas || generation > newest_generation) {
+            newest = replica;
+            newest_generation = generation;
+        }
+    }
+    if (newest == replicas)
+        return false;
+    if (loaded_replica != newest) {
+        ewsfs_block_pin_replica(device, newest);
+        bool loaded = ewsfs_fact_load_from_image(device);
+        ewsfs_block_unpin_replica(device);
+        if (!loaded)
+            return false;
+    }
+    fact_generation = newest_generation;
+    if (!ewsfs_fact_check_layout(fact_root, device))
         return false;
+    for (size_t other = 0; other < replicas; ++other) {
+        if (other == newest || ewsfs_fact_replica_matches(device, other))
+            continue;
+        nob_log(WARNING, "Image %zu of the mirror is out of date, copying the used blocks of image %zu to it", other + 1, newest + 1);
+        ewsfs_fact_resync_replica(device, newest, other);
+    }
+    ewsfs_fact_load_dedup(device, fact_root);
+    ewsfs_fact_load_pack_index(fact_root);
 #ifdef DEBUG
     printf("%s\n", cJSON_Print(fact_root));
 #endif
 
-    fsfile = file;
+    fsdevice = device;
 
     return true;
 }
 
+bool ewsfs_fact_start_discard() {
+    return ewsfs_block_start_discard(fsdevice, &block_allocator);
+}
+
+void ewsfs_fact_set_compression(bool enabled) {
+    compress_files = enabled;
+}
+
+void ewsfs_fact_set_dedup(bool enabled) {
+    dedup_files = enabled;
+}
+
+void ewsfs_fact_set_inline_limit(uint64_t limit) {
+    inline_limit = limit;
+}
+
+void ewsfs_fact_set_pack_limit(uint64_t limit) {
+    pack_limit = limit;
+}
+
+void ewsfs_fact_get_dedup_stats(uint64_t* unique_blocks, uint64_t* references) {
+    *unique_blocks = dedup_index.blocks.count;
+    *references = dedup_index.references;
+}
+
+void ewsfs_fact_get_pack_stats(uint64_t* blocks, uint64_t* used_bytes) {
+    *blocks = pack_index.count;
+    *used_bytes = 0;
+    for (size_t i = 0; i < pack_index.count; ++i)
+        *used_bytes += pack_index.items[i].used;
+}
+
 void ewsfs_fact_uninit() {
+    // The discard thread frees into the allocator, so it has to be done first
+    if (fsdevice)
+        ewsfs_block_stop_discard(fsdevice);
     if (fact_root)
         cJSON_Delete(fact_root);
+    fact_root = NULL;
     da_free(fact_block_indexes);
-    da_free(used_block_indexes);
+    ewsfs_alloc_uninit(&block_allocator);
+    da_free(freed_extents);
+    ewsfs_dedup_free(&dedup_index);
+    ewsfs_pack_free(&pack_index);
     for (size_t i = 0; i < MAX_FILE_HANDLES; ++i) {
         da_free(file_handles[i].buffer);
+        da_free(file_handles[i].extents);
     }
 #ifdef EWSFS_LOG
     for (size_t i = 0; i < ewsfs_log_list.count; ++i) {
@@ -1198,6 +3402,54 @@ bool ewsfs_fact_validate(cJSON* root) {
         nob_log(ERROR, "Filesystem Info not valid.");
         return false;
     }
+    // The dedup index is optional; older FACTs keep it in `"dedup"` and `"shared"`
+    cJSON* dedup = cJSON_GetObjectItemCaseSensitive(root, "dedup");
+    if (dedup && !cJSON_IsArray(dedup)) {
+        nob_log(ERROR, "Dedup index is not an array.");
+        return false;
+    }
+    size_t index = 0;
+    cJSON* entry = NULL;
+    cJSON_ArrayForEach(entry, dedup) {
+        if (!cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(entry, "block")) || !cJSON_IsString(cJSON_GetObjectItemCaseSensitive(entry, "hash"))) {
+            nob_log(ERROR, "Entry at index %zu of the dedup index is missing `block` or `hash`", index);
+            return false;
+        }
+        index++;
+    }
+    cJSON* shared = cJSON_GetObjectItemCaseSensitive(root, "shared");
+    if (shared && !cJSON_IsArray(shared)) {
+        nob_log(ERROR, "Shared block list is not an array.");
+        return false;
+    }
+    index = 0;
+    cJSON_ArrayForEach(entry, shared) {
+        if (!cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(entry, "from")) || !cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(entry, "length"))) {
+            nob_log(ERROR, "Entry at index %zu of the shared block list is missing `from` or `length`", index);
+            return false;
+        }
+        index++;
+    }
+    cJSON* dedup_stored = cJSON_GetObjectItemCaseSensitive(root, "dedup_index");
+    cJSON* dedup_allocation = cJSON_GetObjectItemCaseSensitive(dedup_stored, "allocation");
+    if (dedup_stored && (!cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(dedup_stored, "size")) || !cJSON_IsArray(dedup_allocation))) {
+        nob_log(ERROR, "Dedup index is missing `size` or `allocation`.");
+        return false;
+    }
+    index = 0;
+    cJSON_ArrayForEach(entry, dedup_allocation) {
+        cJSON* from = cJSON_GetObjectItemCaseSensitive(entry, "from");
+        cJSON* length = cJSON_GetObjectItemCaseSensitive(entry, "length");
+        if (!cJSON_IsNumber(from) || !cJSON_IsNumber(length)) {
+            nob_log(ERROR, "Entry at index %zu of the dedup index allocation is missing `from` or `length`", index);
+            return false;
+        }
+        if (!ewsfs_alloc_set_used(&block_allocator, (uint64_t) cJSON_GetNumberValue(from), (uint64_t) cJSON_GetNumberValue(length))) {
+            nob_log(ERROR, "Entry at index %zu of the dedup index allocation is outside of the image", index);
+            return false;
+        }
+        index++;
+    }
     if (!ewsfs_fact_validate_dir(root))
         return false;
     return true;
@@ -1266,9 +3518,34 @@ bool ewsfs_fact_validate_file(cJSON* file) {
         return false;
     }
 
+    // Inline data has to hold the whole file
+    cJSON* inline_data = cJSON_GetObjectItemCaseSensitive(file, "inline_data");
+    if (inline_data) {
+        const char* text = cJSON_GetStringValue(inline_data);
+        size_t length = text ? strlen(text) : 0;
+        uint8_t* data = malloc(ewsfs_base64_max_decoded_size(length) + 1);
+        size_t size = 0;
+        bool valid = text && ewsfs_base64_decode(text, length, data, &size)
+                  && size == (uint64_t) cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(file, "file_size"));
+        free(data);
+        if (!valid) {
+            nob_log(ERROR, "`inline_data` of file %s is not valid", cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(file, "name")));
+            return false;
+        }
+    }
+
     size_t index = 0;
     cJSON* alloc = NULL;
     cJSON_ArrayForEach(alloc, cJSON_GetObjectItemCaseSensitive(file, "allocation")) {
+        // Holes only have a length, there are no blocks behind them
+        if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(alloc, "hole"))) {
+            if (!cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(alloc, "length"))) {
+                nob_log(ERROR, "`length` field of hole at index %zu of file %s is not a valid number", index, cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(file, "name")));
+                return false;
+            }
+            index++;
+            continue;
+        }
         if (!cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(alloc, "from"))) {
             nob_log(ERROR, "`from` field of allocation at index %zu of file %s is not a valid number", index, cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(file, "name")));
             return false;
@@ -1277,11 +3554,34 @@ bool ewsfs_fact_validate_file(cJSON* file) {
             nob_log(ERROR, "`length` field of allocation at index %zu of file %s is not a valid number", index, cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(file, "name")));
             return false;
         }
+        // Compressed extents also need to know how much of the file they hold and how much data is in them
+        cJSON* codec = cJSON_GetObjectItemCaseSensitive(alloc, "codec");
+        if (codec && (!cJSON_IsString(codec) || strcmp(cJSON_GetStringValue(codec), EWSFS_LZ_CODEC) != 0)) {
+            nob_log(ERROR, "`codec` field of allocation at index %zu of file %s is not a supported codec", index, cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(file, "name")));
+            return false;
+        }
+        if (codec && (!cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(alloc, "logical_length")) || !cJSON_IsNumber(cJSON_GetObjectItemCaseSensitive(alloc, "compressed_size")))) {
+            nob_log(ERROR, "Compressed allocation at index %zu of file %s is missing `logical_length` or `compressed_size`", index, cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(file, "name")));
+            return false;
+        }
+        // A packed allocation is the start of its file, in one block
+        cJSON* offset = cJSON_GetObjectItemCaseSensitive(alloc, "offset");
+        if (offset) {
+            cJSON* size = cJSON_GetObjectItemCaseSensitive(alloc, "size");
+            if (index != 0 || codec || !cJSON_IsNumber(offset) || !cJSON_IsNumber(size)
+             || cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc, "length")) != 1
+             || cJSON_GetNumberValue(offset) < 0 || cJSON_GetNumberValue(size) < 0
+             || cJSON_GetNumberValue(offset) + cJSON_GetNumberValue(size) > ewsfs_block_get_size()) {
+                nob_log(ERROR, "Packed allocation at index %zu of file %s is not valid", index, cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(file, "name")));
+                return false;
+            }
+        }
 
         uint64_t from = cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc, "from"));
         uint64_t length = cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(alloc, "length"));
-        for (uint64_t i = from; i < from + length; ++i) {
-            da_append(&used_block_indexes, i);
+        if (!ewsfs_alloc_set_used(&block_allocator, from, length)) {
+            nob_log(ERROR, "Allocation at index %zu of file %s is outside of the image", index, cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(file, "name")));
+            return false;
         }
 
         index++;
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include "lib/cJSON.h"
+#include "block.h"
 
 #define EWSFS_FACT_FILE "fact.json"
 
@@ -17,7 +18,7 @@ typedef struct {
 int ewsfs_fact_file_truncate(off_t length);
 int ewsfs_fact_file_read(char* buffer, size_t size, off_t offset);
 int ewsfs_fact_file_write(const char* buffer, size_t size, off_t offset);
-int ewsfs_fact_file_flush(FILE* file);
+int ewsfs_fact_file_flush(ewsfs_block_device_t* device);
 long ewsfs_fact_file_size();
 
 // All other file operations
@@ -33,13 +34,50 @@ int ewsfs_file_rmdir(const char* path);
 int ewsfs_file_truncate(const char* path, off_t length);
 int ewsfs_file_open(const char* path, struct fuse_file_info* fi);
 int ewsfs_file_ftruncate(off_t length, struct fuse_file_info* fi);
+int ewsfs_file_fallocate(const char* path, int mode, off_t offset, off_t length);
 int ewsfs_file_read(char* buffer, size_t size, off_t offset, struct fuse_file_info* fi);
 int ewsfs_file_write(const char* buffer, size_t size, off_t offset, struct fuse_file_info* fi);
 int ewsfs_file_flush(struct fuse_file_info* fi);
 int ewsfs_file_release(struct fuse_file_info* fi);
+// Load the buffer of an open file up to where the read-ahead window of its last read ends.
+// Used by the read-ahead thread, without the FACT lock. Returns the amount of bytes that were loaded.
+uint64_t ewsfs_file_prefetch(uint64_t fh);
+
+// The FACT and the file handles are shared by the FUSE threads and the defragmenter.
+// Only getattr, readdir and read take the lock shared. Anything that changes the FACT tree, the file handles or the
+// blocks of the image takes it exclusively.
+void ewsfs_fact_lock(bool exclusive);
+void ewsfs_fact_unlock();
+// Move the blocks of files with at least `min_fragments` fragments into one free run each, stopping after `max_files` files.
+// `moved_count` is set to the amount of files that were moved. Needs the exclusive lock.
+int ewsfs_fact_defrag(uint64_t min_fragments, uint64_t max_files, uint64_t* moved_count);
+// Move the files out of packed blocks that are less than half full, stopping after `max_blocks` blocks, so the blocks
+// they leave are freed. `freed_count` is set to the amount of freed blocks. Needs the exclusive lock.
+int ewsfs_fact_compact(uint64_t max_blocks, uint64_t* freed_count);
+// Make `dst_path` a copy of `src_path` that shares its blocks until either of them is written to. `dst_path` is
+// created or replaced, and can't be open. `shared_count` is set to the amount of shared blocks. Needs the exclusive lock.
+int ewsfs_fact_reflink(const char* src_path, const char* dst_path, uint64_t* shared_count);
+// Take the blocks that were added to the end of the image since it was mounted, and store the new size in the
+// filesystem info. `old_count` and `new_count` are set to the block counts before and after. Needs the exclusive lock.
+int ewsfs_fact_grow(uint64_t* old_count, uint64_t* new_count);
 
 // FACT intialisation and validation functions
-bool ewsfs_fact_init(FILE* file);
+bool ewsfs_fact_init(ewsfs_block_device_t* device);
+// Send freed blocks through the device's discard queue, see ewsfs_block_start_discard
+bool ewsfs_fact_start_discard();
+// Store file data compressed from now on. Files that were already compressed can always be read.
+void ewsfs_fact_set_compression(bool enabled);
+// Share blocks with the same contents between files from now on. Shared blocks stay shared without it.
+void ewsfs_fact_set_dedup(bool enabled);
+// Keep the data of files up to `limit` bytes in the FACT instead of in blocks, from their next write on. 0 disables it.
+void ewsfs_fact_set_inline_limit(uint64_t limit);
+// Pack files of up to `limit` bytes (and smaller than a block) together into shared blocks, from their next write on.
+// 0 disables it.
+void ewsfs_fact_set_pack_limit(uint64_t limit);
+// The amount of blocks in the dedup index and the amount of times files use them
+void ewsfs_fact_get_dedup_stats(uint64_t* unique_blocks, uint64_t* references);
+// The amount of packed blocks and the amount of bytes files use in them
+void ewsfs_fact_get_pack_stats(uint64_t* blocks, uint64_t* used_bytes);
 void ewsfs_fact_uninit();
 bool ewsfs_fact_validate(cJSON* root);
 bool ewsfs_fact_validate_attributes(cJSON* item, bool is_dir);
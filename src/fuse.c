@@ -1,18 +1,27 @@
 #define FUSE_USE_VERSION 29
 #include <fuse.h>
+#include <fuse_opt.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include "block.h"
+#include "ctl.h"
+#include "defrag.h"
 #include "fact.h"
+#include "readahead.h"
+#include "stats.h"
 
 #define NOB_IMPLEMENTATION
 #define NOB_STRIP_PREFIX
 #include "nob.h"
 #undef rename
 
-char* devfile = NULL;
-FILE* fsfile = NULL;
+// The device or image files, more than one if the blocks are striped across them or mirrored
+File_Paths devfiles = {0};
+ewsfs_block_device_t fsdevice = {0};
+static unsigned int defrag_interval = 0;
+static bool discard_blocks = false;
 
 static int ewsfs_getattr(const char* path, struct stat* st) {
     if (strcmp(path, "/") == 0) {
@@ -24,10 +33,28 @@ static int ewsfs_getattr(const char* path, struct stat* st) {
         // It's the FACT file
         st->st_mode = S_IFREG | 0644;
         st->st_nlink = 2;
+        ewsfs_fact_lock(false);
         st->st_size = ewsfs_fact_file_size();
+        ewsfs_fact_unlock();
+    } else if (strcmp(path, "/"EWSFS_STATS_FILE) == 0) {
+        // It's the read-only statistics file
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 2;
+        ewsfs_fact_lock(false);
+        st->st_size = ewsfs_stats_file_size(&fsdevice);
+        ewsfs_fact_unlock();
+    } else if (strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
+        // It's the control file
+        st->st_mode = S_IFREG | 0600;
+        st->st_nlink = 2;
+        ewsfs_fact_lock(false);
+        st->st_size = ewsfs_ctl_file_size();
+        ewsfs_fact_unlock();
     } else {
-        // It's neither of the above, so redirect to `ewsfs_file_getattr`
+        // It's none of the above, so redirect to `ewsfs_file_getattr`
+        ewsfs_fact_lock(false);
         int result = ewsfs_file_getattr(path, st);
+        ewsfs_fact_unlock();
         if (result != 0) return result;
     }
     // User and group. we use the user's id who is executing the FUSE driver
@@ -44,109 +71,264 @@ static int ewsfs_readdir(const char* path, void* buffer, fuse_fill_dir_t filler,
 
     if (strcmp(path, "/") == 0) {
         filler(buffer, EWSFS_FACT_FILE, NULL, 0);
+        filler(buffer, EWSFS_STATS_FILE, NULL, 0);
+        filler(buffer, EWSFS_CTL_FILE, NULL, 0);
     }
-    return ewsfs_file_readdir(path, buffer, filler);
+    ewsfs_fact_lock(false);
+    int result = ewsfs_file_readdir(path, buffer, filler);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_utimens(const char* path, const struct timespec tv[2]) {
-    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0) {
+    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0
+     || strcmp(path, "/"EWSFS_STATS_FILE) == 0
+     || strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
         return -EPERM;
     }
-    return ewsfs_file_utimens(path, tv);
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_utimens(path, tv);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_read(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) {
     if (strcmp(path, "/"EWSFS_FACT_FILE) == 0) {
         // If path points to the FACT file, redirect to an `ewsfs_fact_file_*` function or return an error
-        return ewsfs_fact_file_read(buffer, size, offset);
+        ewsfs_fact_lock(false);
+        int result = ewsfs_fact_file_read(buffer, size, offset);
+        ewsfs_fact_unlock();
+        return result;
+    }
+    if (strcmp(path, "/"EWSFS_STATS_FILE) == 0) {
+        ewsfs_fact_lock(false);
+        int result = ewsfs_stats_file_read(&fsdevice, buffer, size, offset);
+        ewsfs_fact_unlock();
+        return result;
+    }
+    if (strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
+        ewsfs_fact_lock(false);
+        int result = ewsfs_ctl_file_read(buffer, size, offset);
+        ewsfs_fact_unlock();
+        return result;
     }
     // If path doesn't point to the FACT file, redirect to an `ewsfs_file_*` function
-    return ewsfs_file_read(buffer, size, offset, fi);
+    ewsfs_fact_lock(false);
+    int result = ewsfs_file_read(buffer, size, offset, fi);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_mknod(const char* path, mode_t mode, dev_t dev) {
-    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0) {
+    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0
+     || strcmp(path, "/"EWSFS_STATS_FILE) == 0
+     || strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
         return -EEXIST;
     }
-    return ewsfs_file_mknod(path, mode, dev);
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_mknod(path, mode, dev);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_unlink(const char* path) {
-    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0) {
+    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0
+     || strcmp(path, "/"EWSFS_STATS_FILE) == 0
+     || strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
         return -EPERM;
     }
-    return ewsfs_file_unlink(path);
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_unlink(path);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_rename(const char* oldpath, const char* newpath) {
     if (strcmp(oldpath, "/"EWSFS_FACT_FILE) == 0
-     || strcmp(newpath, "/"EWSFS_FACT_FILE) == 0) {
+     || strcmp(newpath, "/"EWSFS_FACT_FILE) == 0
+     || strcmp(oldpath, "/"EWSFS_STATS_FILE) == 0
+     || strcmp(newpath, "/"EWSFS_STATS_FILE) == 0
+     || strcmp(oldpath, "/"EWSFS_CTL_FILE) == 0
+     || strcmp(newpath, "/"EWSFS_CTL_FILE) == 0) {
         return -EPERM;
     }
-    return ewsfs_file_rename(oldpath, newpath);
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_rename(oldpath, newpath);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_mkdir(const char* path, mode_t mode) {
-    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0) {
+    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0
+     || strcmp(path, "/"EWSFS_STATS_FILE) == 0
+     || strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
         return -EEXIST;
     }
-    return ewsfs_file_mkdir(path, mode);
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_mkdir(path, mode);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_rmdir(const char* path) {
-    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0) {
+    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0
+     || strcmp(path, "/"EWSFS_STATS_FILE) == 0
+     || strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
         return -ENOTDIR;
     }
-    return ewsfs_file_rmdir(path);
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_rmdir(path);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_open(const char* path, struct fuse_file_info* fi) {
     if (strcmp(path, "/"EWSFS_FACT_FILE) == 0) {
         return 0;
     }
-    return ewsfs_file_open(path, fi);
+    if (strcmp(path, "/"EWSFS_STATS_FILE) == 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        // The contents change all the time, so don't let the kernel cut reads off at a stale size
+        fi->direct_io = 1;
+        return 0;
+    }
+    if (strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
+        // Same as the statistics file, the result of a command can be read right after writing it
+        fi->direct_io = 1;
+        return 0;
+    }
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_open(path, fi);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_truncate(const char* path, off_t length) {
     if (strcmp(path, "/"EWSFS_FACT_FILE) == 0) {
-        return ewsfs_fact_file_truncate(length);
+        ewsfs_fact_lock(true);
+        int result = ewsfs_fact_file_truncate(length);
+        ewsfs_fact_unlock();
+        return result;
+    }
+    if (strcmp(path, "/"EWSFS_STATS_FILE) == 0) {
+        return -EPERM;
     }
-    return ewsfs_file_truncate(path, length);
+    if (strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
+        // Allows `echo command > ewsfs.ctl`, the file doesn't hold anything that could be truncated
+        return 0;
+    }
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_truncate(path, length);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_ftruncate(const char* path, off_t length, struct fuse_file_info* fi) {
     if (strcmp(path, "/"EWSFS_FACT_FILE) == 0) {
-        return ewsfs_fact_file_truncate(length);
+        ewsfs_fact_lock(true);
+        int result = ewsfs_fact_file_truncate(length);
+        ewsfs_fact_unlock();
+        return result;
+    }
+    if (strcmp(path, "/"EWSFS_STATS_FILE) == 0) {
+        return -EPERM;
+    }
+    if (strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
+        // Allows `echo command > ewsfs.ctl`, the file doesn't hold anything that could be truncated
+        return 0;
+    }
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_ftruncate(length, fi);
+    ewsfs_fact_unlock();
+    return result;
+}
+
+static int ewsfs_fallocate(const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* fi) {
+    (void) fi;
+    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0
+     || strcmp(path, "/"EWSFS_STATS_FILE) == 0
+     || strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
+        return -EOPNOTSUPP;
     }
-    return ewsfs_file_ftruncate(length, fi);
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_fallocate(path, mode, offset, length);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_write(const char* path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) {
     if (strcmp(path, "/"EWSFS_FACT_FILE) == 0) {
-        return ewsfs_fact_file_write(buffer, size, offset);
+        ewsfs_fact_lock(true);
+        int result = ewsfs_fact_file_write(buffer, size, offset);
+        ewsfs_fact_unlock();
+        return result;
+    }
+    if (strcmp(path, "/"EWSFS_STATS_FILE) == 0) {
+        return -EPERM;
+    }
+    if (strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
+        // Commands move blocks around, so nothing else may run at the same time
+        ewsfs_fact_lock(true);
+        int result = ewsfs_ctl_file_write(buffer, size, offset);
+        ewsfs_fact_unlock();
+        return result;
     }
-    return ewsfs_file_write(buffer, size, offset, fi);
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_write(buffer, size, offset, fi);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_flush(const char* path, struct fuse_file_info* fi) {
     if (strcmp(path, "/"EWSFS_FACT_FILE) == 0) {
-        int result = ewsfs_fact_file_flush(fsfile);
-        fflush(fsfile);
+        // The FACT is replaced as a whole, so nothing else may use it at the same time
+        ewsfs_fact_lock(true);
+        int result = ewsfs_fact_file_flush(&fsdevice);
+        ewsfs_fact_unlock();
         return result;
     }
-    return ewsfs_file_flush(fi);
+    if (strcmp(path, "/"EWSFS_STATS_FILE) == 0
+     || strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
+        return 0;
+    }
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_flush(fi);
+    ewsfs_fact_unlock();
+    return result;
 }
 
 static int ewsfs_release(const char* path, struct fuse_file_info* fi) {
-    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0) {
+    if (strcmp(path, "/"EWSFS_FACT_FILE) == 0
+     || strcmp(path, "/"EWSFS_STATS_FILE) == 0
+     || strcmp(path, "/"EWSFS_CTL_FILE) == 0) {
         return 0;
     }
-    return ewsfs_file_release(fi);
+    ewsfs_fact_lock(true);
+    int result = ewsfs_file_release(fi);
+    ewsfs_fact_unlock();
+    return result;
+}
+
+static void* ewsfs_init(struct fuse_conn_info* conn) {
+    (void) conn;
+    // FUSE has forked into the background by now, so the I/O threads of the images and the defragmenter thread can be started
+    if (!ewsfs_block_start_workers(&fsdevice))
+        nob_log(WARNING, "Couldn't start the I/O threads of the images, they're used one after another");
+    if (!ewsfs_defrag_start(defrag_interval))
+        nob_log(WARNING, "Couldn't start the defragmenter");
+    if (discard_blocks && !ewsfs_fact_start_discard())
+        nob_log(WARNING, "Couldn't start discarding freed blocks");
+    if (!ewsfs_readahead_start())
+        nob_log(WARNING, "Couldn't start the read-ahead thread");
+    return NULL;
 }
 
 static void ewsfs_destroy() {
+    ewsfs_defrag_stop();
+    ewsfs_readahead_stop();
     ewsfs_fact_uninit();
-    fclose(fsfile);
+    ewsfs_block_close(&fsdevice);
 }
 
 static struct fuse_operations ewsfs_ops = {
@@ -162,36 +344,155 @@ static struct fuse_operations ewsfs_ops = {
     .rmdir = ewsfs_rmdir,
     .truncate = ewsfs_truncate,
     .ftruncate = ewsfs_ftruncate,
+    .fallocate = ewsfs_fallocate,
     .write = ewsfs_write,
     .flush = ewsfs_flush,
     .release = ewsfs_release,
+    .init = ewsfs_init,
     .destroy = ewsfs_destroy,
 };
 
 
+// The default amount of consecutive blocks per image when the blocks are striped across several
+#define EWSFS_DEFAULT_STRIPE_BLOCKS 16
+// The default size of the block cache, in blocks
+#define EWSFS_DEFAULT_CACHE_BLOCKS 1024
+// The default number of requests the uring backend keeps in flight
+#define EWSFS_DEFAULT_QUEUE_DEPTH 32
+// The default time between background defragmentation passes, in seconds
+#define EWSFS_DEFAULT_DEFRAG_INTERVAL 60
+// The default maximum read-ahead window, in blocks
+#define EWSFS_DEFAULT_READAHEAD_BLOCKS 1024
+// Files up to this many bytes are kept in the FACT by default
+#define EWSFS_DEFAULT_INLINE_SIZE 256
+// Files up to this many bytes share blocks by default
+#define EWSFS_DEFAULT_PACK_SIZE 3072
+
+typedef struct {
+    char* backend;
+    unsigned int cache_blocks;
+    unsigned int queue_depth;
+    int direct;
+    int exclusive;
+    unsigned int defrag_interval;
+    int discard;
+    int compress;
+    int dedup;
+    unsigned int readahead_blocks;
+    unsigned int inline_size;
+    unsigned int pack_size;
+    unsigned int stripe_blocks;
+    int mirror;
+} ewsfs_options_t;
+
+static struct fuse_opt ewsfs_opts[] = {
+    {"backend=%s", offsetof(ewsfs_options_t, backend), 0},
+    {"cache=%u", offsetof(ewsfs_options_t, cache_blocks), 0},
+    {"queue_depth=%u", offsetof(ewsfs_options_t, queue_depth), 0},
+    {"odirect", offsetof(ewsfs_options_t, direct), 1},
+    {"exclusive", offsetof(ewsfs_options_t, exclusive), 1},
+    {"defrag=%u", offsetof(ewsfs_options_t, defrag_interval), 0},
+    {"discard", offsetof(ewsfs_options_t, discard), 1},
+    {"compress", offsetof(ewsfs_options_t, compress), 1},
+    {"dedup", offsetof(ewsfs_options_t, dedup), 1},
+    {"readahead=%u", offsetof(ewsfs_options_t, readahead_blocks), 0},
+    {"inline=%u", offsetof(ewsfs_options_t, inline_size), 0},
+    {"pack=%u", offsetof(ewsfs_options_t, pack_size), 0},
+    {"stripe=%u", offsetof(ewsfs_options_t, stripe_blocks), 0},
+    {"mirror", offsetof(ewsfs_options_t, mirror), 1},
+    FUSE_OPT_END,
+};
+
+static int ewsfs_opt_proc(void* data, const char* arg, int key, struct fuse_args* outargs) {
+    (void) data;
+    (void) outargs;
+    // The first argument that isn't an option is the device or image file, or a comma separated list of them.
+    // The rest is for FUSE.
+    if (key == FUSE_OPT_KEY_NONOPT && devfiles.count == 0) {
+        String_View list = sv_from_cstr(arg);
+        while (list.count > 0) {
+            String_View path = sv_chop_by_delim(&list, ',');
+            char* name = strndup(path.data, path.count);
+            char* devfile = realpath(name, NULL);
+            if (devfile == NULL)
+                devfile = name;
+            else
+                free(name);
+            da_append(&devfiles, devfile);
+        }
+        return 0;
+    }
+    return 1;
+}
+
 int main(int argc, char** argv) {
-    int i;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    ewsfs_options_t options = {
+        .cache_blocks = EWSFS_DEFAULT_CACHE_BLOCKS,
+        .queue_depth = EWSFS_DEFAULT_QUEUE_DEPTH,
+        .defrag_interval = EWSFS_DEFAULT_DEFRAG_INTERVAL,
+        .readahead_blocks = EWSFS_DEFAULT_READAHEAD_BLOCKS,
+        .inline_size = EWSFS_DEFAULT_INLINE_SIZE,
+        .pack_size = EWSFS_DEFAULT_PACK_SIZE,
+        .stripe_blocks = EWSFS_DEFAULT_STRIPE_BLOCKS,
+    };
+
+    // Get the device or image filename and our own options from the arguments
+    if (fuse_opt_parse(&args, &options, ewsfs_opts, ewsfs_opt_proc) != 0)
+        return 1;
+    if (devfiles.count == 0) {
+        nob_log(ERROR, "No device or image file specified");
+        return 1;
+    }
 
-    // Get the device or image filename from the arguments
-    for (i = 1; i < argc && argv[i][0] == '-'; ++i);
-    if (i < argc) {
-        devfile = realpath(argv[i], NULL);
-        memcpy(&argv[i], &argv[i+1], (argc-i)*sizeof(argv[0]));
-        argc--;
+    ewsfs_block_options_t block_options = {
+        .backend = EWSFS_BLOCK_BACKEND_PIO,
+        .queue_depth = options.queue_depth,
+        .direct = options.direct,
+        .exclusive = options.exclusive,
+        .layout = options.mirror ? EWSFS_BLOCK_LAYOUT_MIRROR : EWSFS_BLOCK_LAYOUT_STRIPE,
+        .stripe_blocks = options.stripe_blocks,
+    };
+    if (options.backend && !ewsfs_block_backend_from_name(options.backend, &block_options.backend)) {
+        nob_log(ERROR, "Unknown block backend %s", options.backend);
+        return 1;
+    }
+    if (options.queue_depth == 0) {
+        nob_log(ERROR, "queue_depth must be at least 1");
+        return 1;
+    }
+    if (options.stripe_blocks == 0) {
+        nob_log(ERROR, "stripe must be at least 1");
+        return 1;
     }
 
-    fsfile = fopen(devfile, "rb+");
-    if (fsfile == NULL) {
-        nob_log(ERROR, "Couldn't open input file %s", devfile);
+    if (!ewsfs_block_open_images(&fsdevice, devfiles.items, devfiles.count, &block_options)) {
+        if (devfiles.count == 1)
+            nob_log(ERROR, "Couldn't open input file %s", devfiles.items[0]);
+        else
+            nob_log(ERROR, "Couldn't open the %zu input files", devfiles.count);
         return 1;
     }
 
     // Initialise the block size and the FACT
-    if (!ewsfs_block_read_size(fsfile))
+    if (!ewsfs_block_read_size(&fsdevice))
         return 3;
-    if (!ewsfs_fact_init(fsfile))
+    if (options.cache_blocks > 0 && !ewsfs_block_enable_cache(&fsdevice, options.cache_blocks)) {
+        nob_log(ERROR, "Couldn't allocate a block cache of %u blocks", options.cache_blocks);
+        return 1;
+    }
+    if (!ewsfs_fact_init(&fsdevice))
         return 2;
+    ewsfs_fact_set_compression(options.compress);
+    ewsfs_fact_set_dedup(options.dedup);
+    ewsfs_fact_set_inline_limit(options.inline_size);
+    ewsfs_fact_set_pack_limit(options.pack_size);
+    ewsfs_readahead_set_max_window((uint64_t) options.readahead_blocks*ewsfs_block_get_size());
+    defrag_interval = options.defrag_interval;
+    discard_blocks = options.discard;
 
     // Leave the rest to FUSE
-    return fuse_main(argc, argv, &ewsfs_ops, NULL);
+    int result = fuse_main(args.argc, args.argv, &ewsfs_ops, NULL);
+    fuse_opt_free_args(&args);
+    return result;
 }
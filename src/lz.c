@@ -0,0 +1,141 @@
+#include <string.h>
+#include "lz.h"
+
+// A sequence is a run of literals followed by a match of at least LZ_MIN_MATCH bytes. The last sequence
+// only has literals. As in LZ4, the last LZ_LAST_LITERALS bytes are always literals and a match can't start
+// in the last LZ_MATCH_LIMIT bytes, so decoders may copy in bigger steps.
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+static uint32_t lz_read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t value) {
+    return (value*2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write a length that doesn't fit in the token's 4 bits as a run of bytes that are added up
+static bool lz_write_length(uint8_t* dst, size_t dst_capacity, size_t* out, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (*out >= dst_capacity)
+            return false;
+        dst[(*out)++] = 255;
+    }
+    if (*out >= dst_capacity)
+        return false;
+    dst[(*out)++] = (uint8_t) length;
+    return true;
+}
+
+static bool lz_write_sequence(uint8_t* dst, size_t dst_capacity, size_t* out, const uint8_t* literals, size_t literal_count, size_t offset, size_t match_length) {
+    if (*out >= dst_capacity)
+        return false;
+    size_t token = *out;
+    dst[(*out)++] = (uint8_t) ((literal_count < 15 ? literal_count : 15) << 4);
+    if (literal_count >= 15 && !lz_write_length(dst, dst_capacity, out, literal_count - 15))
+        return false;
+    if (literal_count > dst_capacity - *out)
+        return false;
+    memcpy(dst + *out, literals, literal_count);
+    *out += literal_count;
+    // The last sequence ends after its literals
+    if (match_length == 0)
+        return true;
+
+    if (dst_capacity - *out < 2)
+        return false;
+    dst[(*out)++] = (uint8_t) offset;
+    dst[(*out)++] = (uint8_t) (offset >> 8);
+    match_length -= LZ_MIN_MATCH;
+    dst[token] |= (uint8_t) (match_length < 15 ? match_length : 15);
+    if (match_length >= 15 && !lz_write_length(dst, dst_capacity, out, match_length - 15))
+        return false;
+    return true;
+}
+
+size_t ewsfs_lz_compress(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_capacity) {
+    // The last position each hashed 4 bytes were seen at
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+    size_t out = 0;
+    size_t anchor = 0;
+    size_t position = 0;
+    if (src_size > LZ_MATCH_LIMIT) {
+        size_t match_start_limit = src_size - LZ_MATCH_LIMIT;
+        size_t match_end_limit = src_size - LZ_LAST_LITERALS;
+        while (position <= match_start_limit) {
+            uint32_t sequence = lz_read32(src + position);
+            uint32_t hash = lz_hash(sequence);
+            size_t candidate = table[hash];
+            table[hash] = (uint32_t) position;
+            if (candidate >= position || position - candidate > LZ_MAX_OFFSET || lz_read32(src + candidate) != sequence) {
+                ++position;
+                continue;
+            }
+
+            size_t match_length = LZ_MIN_MATCH;
+            while (position + match_length < match_end_limit && src[candidate + match_length] == src[position + match_length])
+                ++match_length;
+            if (!lz_write_sequence(dst, dst_capacity, &out, src + anchor, position - anchor, position - candidate, match_length))
+                return 0;
+            position += match_length;
+            anchor = position;
+        }
+    }
+    if (!lz_write_sequence(dst, dst_capacity, &out, src + anchor, src_size - anchor, 0, 0))
+        return 0;
+    return out;
+}
+
+// Read a length that continues after the token's 4 bits
+static bool lz_read_length(const uint8_t* src, size_t src_size, size_t* in, size_t* length) {
+    uint8_t byte;
+    do {
+        if (*in >= src_size)
+            return false;
+        byte = src[(*in)++];
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool ewsfs_lz_decompress(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_capacity, size_t* dst_size) {
+    size_t in = 0;
+    size_t out = 0;
+    while (in < src_size) {
+        uint8_t token = src[in++];
+        size_t literal_count = token >> 4;
+        if (literal_count == 15 && !lz_read_length(src, src_size, &in, &literal_count))
+            return false;
+        if (literal_count > src_size - in || literal_count > dst_capacity - out)
+            return false;
+        memcpy(dst + out, src + in, literal_count);
+        in += literal_count;
+        out += literal_count;
+        if (in == src_size)
+            break;
+
+        if (src_size - in < 2)
+            return false;
+        size_t offset = src[in] | (src[in + 1] << 8);
+        in += 2;
+        if (offset == 0 || offset > out)
+            return false;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !lz_read_length(src, src_size, &in, &match_length))
+            return false;
+        match_length += LZ_MIN_MATCH;
+        if (match_length > dst_capacity - out)
+            return false;
+        // The match can overlap the bytes it produces, so it's copied one byte at a time
+        for (size_t i = 0; i < match_length; ++i, ++out)
+            dst[out] = dst[out - offset];
+    }
+    *dst_size = out;
+    return true;
+}
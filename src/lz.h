@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// The name of the codec in the FACT. The compressed data is in the LZ4 block format.
+#define EWSFS_LZ_CODEC "lz4"
+
+// Compress `src` into `dst`. Returns the compressed size, or 0 if it doesn't fit in `dst_capacity` bytes.
+size_t ewsfs_lz_compress(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_capacity);
+// Decompress `src` into `dst`. Returns false if the data is corrupt or doesn't fit in `dst_capacity` bytes.
+bool ewsfs_lz_decompress(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_capacity, size_t* dst_size);
@@ -0,0 +1,88 @@
+#include <string.h>
+#include "pack.h"
+#define NOB_STRIP_PREFIX
+#include "nob.h"
+
+// The position of `block` in the index, or where it would go
+static size_t ewsfs_pack_position(const ewsfs_pack_index_t* index, uint64_t block) {
+    size_t low = 0;
+    size_t high = index->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (index->items[middle].block < block)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+void ewsfs_pack_clear(ewsfs_pack_index_t* index) {
+    index->count = 0;
+    index->has_current = false;
+}
+
+void ewsfs_pack_free(ewsfs_pack_index_t* index) {
+    da_free(*index);
+    *index = (ewsfs_pack_index_t) {0};
+}
+
+const ewsfs_pack_block_t* ewsfs_pack_get(const ewsfs_pack_index_t* index, uint64_t block) {
+    size_t i = ewsfs_pack_position(index, block);
+    return i < index->count && index->items[i].block == block ? &index->items[i] : NULL;
+}
+
+void ewsfs_pack_add(ewsfs_pack_index_t* index, uint64_t block, uint64_t offset, uint64_t size) {
+    size_t i = ewsfs_pack_position(index, block);
+    if (i == index->count || index->items[i].block != block) {
+        ewsfs_pack_block_t added = {block, 0, 0};
+        da_append(index, added);
+        memmove(&index->items[i + 1], &index->items[i], (index->count - 1 - i)*sizeof(*index->items));
+        index->items[i] = added;
+    }
+    index->items[i].used += size;
+    if (offset + size > index->items[i].end)
+        index->items[i].end = offset + size;
+}
+
+bool ewsfs_pack_remove(ewsfs_pack_index_t* index, uint64_t block, uint64_t size) {
+    size_t i = ewsfs_pack_position(index, block);
+    if (i == index->count || index->items[i].block != block)
+        return false;
+    index->items[i].used = index->items[i].used > size ? index->items[i].used - size : 0;
+    if (index->items[i].used > 0)
+        return false;
+    memmove(&index->items[i], &index->items[i + 1], (index->count - i - 1)*sizeof(*index->items));
+    index->count--;
+    if (index->has_current && index->current == block)
+        index->has_current = false;
+    return true;
+}
+
+bool ewsfs_pack_find(const ewsfs_pack_index_t* index, uint64_t block_size, uint64_t size, uint64_t* block, uint64_t* offset) {
+    if (!index->has_current)
+        return false;
+    const ewsfs_pack_block_t* current = ewsfs_pack_get(index, index->current);
+    if (!current || current->end + size > block_size)
+        return false;
+    *block = current->block;
+    *offset = current->end;
+    return true;
+}
+
+void ewsfs_pack_set_current(ewsfs_pack_index_t* index, uint64_t block) {
+    index->current = block;
+    index->has_current = true;
+}
+
+void ewsfs_pack_pick_current(ewsfs_pack_index_t* index, uint64_t block_size) {
+    index->has_current = false;
+    uint64_t most_room = 0;
+    for (size_t i = 0; i < index->count; ++i) {
+        uint64_t room = block_size - index->items[i].end;
+        if (room > most_room) {
+            most_room = room;
+            ewsfs_pack_set_current(index, index->items[i].block);
+        }
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// A block that small files are packed into
+typedef struct {
+    uint64_t block;
+    // The amount of bytes of the block that files use
+    uint64_t used;
+    // Where the last file in the block ends. New files only go after it, so the space of files that
+    // are gone is only reused once the block is empty, or by compacting.
+    uint64_t end;
+} ewsfs_pack_block_t;
+
+// The packed blocks, sorted by block index. Nothing of it is stored, it's rebuilt from the allocations of a FACT.
+typedef struct {
+    ewsfs_pack_block_t* items;
+    size_t count;
+    size_t capacity;
+    // The block new files are packed into
+    uint64_t current;
+    bool has_current;
+} ewsfs_pack_index_t;
+
+void ewsfs_pack_clear(ewsfs_pack_index_t* index);
+void ewsfs_pack_free(ewsfs_pack_index_t* index);
+const ewsfs_pack_block_t* ewsfs_pack_get(const ewsfs_pack_index_t* index, uint64_t block);
+// A file uses `size` bytes at `offset` in `block`. The block is added if it isn't packed yet.
+void ewsfs_pack_add(ewsfs_pack_index_t* index, uint64_t block, uint64_t offset, uint64_t size);
+// A file stops using `size` bytes of `block`. Returns true if no file uses the block anymore, it's removed then.
+bool ewsfs_pack_remove(ewsfs_pack_index_t* index, uint64_t block, uint64_t size);
+// Find room for `size` bytes at the end of the current block. Returns false if a new block is needed.
+bool ewsfs_pack_find(const ewsfs_pack_index_t* index, uint64_t block_size, uint64_t size, uint64_t* block, uint64_t* offset);
+void ewsfs_pack_set_current(ewsfs_pack_index_t* index, uint64_t block);
+// Make the block with the most room at its end the current one, e.g. after loading the index
+void ewsfs_pack_pick_current(ewsfs_pack_index_t* index, uint64_t block_size);
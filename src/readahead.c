@@ -0,0 +1,103 @@
+#include <pthread.h>
+#include <string.h>
+#include "readahead.h"
+#include "fact.h"
+#define NOB_STRIP_PREFIX
+#include "nob.h"
+
+typedef struct {
+    uint64_t* items;
+    size_t count;
+    size_t capacity;
+} ewsfs_readahead_queue_t;
+
+static pthread_t readahead_thread;
+static pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readahead_wake = PTHREAD_COND_INITIALIZER;
+static bool readahead_running = false;
+static uint64_t readahead_max_window = 0;
+static uint64_t readahead_loaded = 0;
+// File handles whose window has to be loaded, oldest first
+static ewsfs_readahead_queue_t readahead_queue = {0};
+
+void ewsfs_readahead_set_max_window(uint64_t max_window) {
+    readahead_max_window = max_window;
+}
+
+uint64_t ewsfs_readahead_update(ewsfs_readahead_t* readahead, uint64_t offset, uint64_t size) {
+    if (offset != readahead->next_offset) {
+        readahead->window = 0;
+    } else if (readahead->window == 0) {
+        readahead->window = EWSFS_READAHEAD_MIN_WINDOW;
+    } else {
+        readahead->window *= 2;
+    }
+    if (readahead->window > readahead_max_window)
+        readahead->window = readahead_max_window;
+    readahead->next_offset = offset + size;
+    return readahead->window;
+}
+
+static void* ewsfs_readahead_thread(void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&readahead_lock);
+    for (;;) {
+        while (readahead_running && readahead_queue.count == 0)
+            pthread_cond_wait(&readahead_wake, &readahead_lock);
+        if (!readahead_running)
+            break;
+        uint64_t fh = readahead_queue.items[0];
+        readahead_queue.count--;
+        memmove(readahead_queue.items, readahead_queue.items + 1, readahead_queue.count*sizeof(*readahead_queue.items));
+        pthread_mutex_unlock(&readahead_lock);
+
+        uint64_t loaded = ewsfs_file_prefetch(fh);
+
+        pthread_mutex_lock(&readahead_lock);
+        readahead_loaded += loaded;
+    }
+    pthread_mutex_unlock(&readahead_lock);
+    return NULL;
+}
+
+bool ewsfs_readahead_start() {
+    if (readahead_max_window == 0 || readahead_running)
+        return true;
+    readahead_running = true;
+    if (pthread_create(&readahead_thread, NULL, ewsfs_readahead_thread, NULL) != 0) {
+        readahead_running = false;
+        return false;
+    }
+    return true;
+}
+
+void ewsfs_readahead_stop() {
+    pthread_mutex_lock(&readahead_lock);
+    bool running = readahead_running;
+    readahead_running = false;
+    pthread_cond_signal(&readahead_wake);
+    pthread_mutex_unlock(&readahead_lock);
+    if (running)
+        pthread_join(readahead_thread, NULL);
+    da_free(readahead_queue);
+    readahead_queue = (ewsfs_readahead_queue_t) {0};
+}
+
+void ewsfs_readahead_queue(uint64_t fh) {
+    pthread_mutex_lock(&readahead_lock);
+    bool queued = false;
+    for (size_t i = 0; i < readahead_queue.count && !queued; ++i)
+        queued = readahead_queue.items[i] == fh;
+    if (readahead_running && !queued) {
+        da_append(&readahead_queue, fh);
+        pthread_cond_signal(&readahead_wake);
+    }
+    pthread_mutex_unlock(&readahead_lock);
+}
+
+uint64_t ewsfs_readahead_get_loaded() {
+    pthread_mutex_lock(&readahead_lock);
+    uint64_t loaded = readahead_loaded;
+    pthread_mutex_unlock(&readahead_lock);
+    return loaded;
+}
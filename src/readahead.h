@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// The first read-ahead window of a sequential reader, in bytes. It doubles with every sequential read.
+#define EWSFS_READAHEAD_MIN_WINDOW (128*1024)
+
+// Sequential read detection of one open file
+typedef struct {
+    // Where the next read starts if the file is read sequentially
+    uint64_t next_offset;
+    // The amount of bytes to have loaded past the end of the last read, 0 if it wasn't sequential
+    uint64_t window;
+} ewsfs_readahead_t;
+
+// The largest read-ahead window in bytes. 0 disables read-ahead, blocks are only loaded when they're read then.
+void ewsfs_readahead_set_max_window(uint64_t max_window);
+// Update the window for a read of `size` bytes at `offset`, and return it
+uint64_t ewsfs_readahead_update(ewsfs_readahead_t* readahead, uint64_t offset, uint64_t size);
+
+// Start a thread that loads the windows of queued file handles, see ewsfs_file_prefetch.
+// Has to be called after FUSE has forked into the background, threads don't survive the fork.
+bool ewsfs_readahead_start();
+void ewsfs_readahead_stop();
+// Have the read-ahead thread load a file handle's window. Does nothing if the thread isn't running.
+void ewsfs_readahead_queue(uint64_t fh);
+// The amount of bytes loaded by the read-ahead thread
+uint64_t ewsfs_readahead_get_loaded();
@@ -0,0 +1,81 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "stats.h"
+#include "fact.h"
+#include "readahead.h"
+#define NOB_STRIP_PREFIX
+#include "nob.h"
+
+static void ewsfs_stats_append(String_Builder* sb, const char* name, uint64_t value) {
+    char line[128];
+    snprintf(line, sizeof(line), "%s: %"PRIu64"\n", name, value);
+    sb_append_cstr(sb, line);
+}
+
+static void ewsfs_stats_generate(ewsfs_block_device_t* device, String_Builder* sb) {
+    ewsfs_cache_stats_t cache_stats = {0};
+    if (ewsfs_block_get_cache_stats(device, &cache_stats)) {
+        ewsfs_stats_append(sb, "cache_capacity", cache_stats.capacity);
+        ewsfs_stats_append(sb, "cache_used", cache_stats.used);
+        ewsfs_stats_append(sb, "cache_dirty", cache_stats.dirty);
+        ewsfs_stats_append(sb, "cache_hits", cache_stats.hits);
+        ewsfs_stats_append(sb, "cache_misses", cache_stats.misses);
+        ewsfs_stats_append(sb, "cache_evictions", cache_stats.evictions);
+        ewsfs_stats_append(sb, "cache_write_backs", cache_stats.write_backs);
+    } else {
+        ewsfs_stats_append(sb, "cache_capacity", 0);
+    }
+    uint64_t discard_pending = 0;
+    uint64_t discarded = 0;
+    if (ewsfs_block_get_discard_stats(device, &discard_pending, &discarded)) {
+        ewsfs_stats_append(sb, "discard_pending_blocks", discard_pending);
+        ewsfs_stats_append(sb, "discarded_blocks", discarded);
+    }
+    // How many times the indexed blocks are used on average, as a percentage
+    uint64_t dedup_blocks = 0;
+    uint64_t dedup_references = 0;
+    ewsfs_fact_get_dedup_stats(&dedup_blocks, &dedup_references);
+    ewsfs_stats_append(sb, "dedup_blocks", dedup_blocks);
+    ewsfs_stats_append(sb, "dedup_references", dedup_references);
+    ewsfs_stats_append(sb, "dedup_ratio_percent", dedup_blocks > 0 ? dedup_references*100 / dedup_blocks : 100);
+    ewsfs_stats_append(sb, "readahead_bytes", ewsfs_readahead_get_loaded());
+    uint64_t packed_blocks = 0;
+    uint64_t packed_bytes = 0;
+    ewsfs_fact_get_pack_stats(&packed_blocks, &packed_bytes);
+    ewsfs_stats_append(sb, "packed_blocks", packed_blocks);
+    ewsfs_stats_append(sb, "packed_bytes", packed_bytes);
+    uint64_t replicas = 0;
+    uint64_t failed_replicas = 0;
+    ewsfs_block_get_replicas(device, &replicas, &failed_replicas);
+    if (replicas > 1) {
+        ewsfs_stats_append(sb, "mirror_images", replicas);
+        ewsfs_stats_append(sb, "mirror_failed_images", failed_replicas);
+        for (size_t i = 0; i < device->member_count; ++i) {
+            char name[64];
+            snprintf(name, sizeof(name), "image_%zu_read_blocks", i + 1);
+            ewsfs_stats_append(sb, name, ewsfs_block_get_blocks_read(device, i));
+        }
+    }
+}
+
+int ewsfs_stats_file_read(ewsfs_block_device_t* device, char* buffer, size_t size, off_t offset) {
+    String_Builder sb = {0};
+    ewsfs_stats_generate(device, &sb);
+
+    size_t bytecount = 0;
+    for (size_t i = offset; i < offset + size && i < sb.count; ++i) {
+        buffer[i - offset] = sb.items[i];
+        bytecount++;
+    }
+    sb_free(sb);
+    return bytecount;
+}
+
+long ewsfs_stats_file_size(ewsfs_block_device_t* device) {
+    String_Builder sb = {0};
+    ewsfs_stats_generate(device, &sb);
+    long size = sb.count;
+    sb_free(sb);
+    return size;
+}
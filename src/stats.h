@@ -0,0 +1,11 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+#include "block.h"
+
+#define EWSFS_STATS_FILE "ewsfs.stats"
+
+// ewsfs.stats file operations; the contents are generated on every call.
+// They include the dedup counters of the FACT, so the caller needs to hold the FACT lock.
+int ewsfs_stats_file_read(ewsfs_block_device_t* device, char* buffer, size_t size, off_t offset);
+long ewsfs_stats_file_size(ewsfs_block_device_t* device);
@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params* params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+bool ewsfs_uring_init(ewsfs_uring_t* ring, unsigned int queue_depth) {
+    *ring = (ewsfs_uring_t) {0};
+    struct io_uring_params params = {0};
+    ring->ring_fd = io_uring_setup(queue_depth, &params);
+    if (ring->ring_fd < 0)
+        return false;
+    // The kernel rounds the amount of entries up to a power of two
+    ring->queue_depth = params.sq_entries;
+
+    // Map the submission and completion queue rings and the submission queue entries
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(ring->ring_fd);
+        *ring = (ewsfs_uring_t) {0};
+        return false;
+    }
+
+    uint8_t* sq = ring->sq_ring;
+    ring->sq_head = (unsigned int*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int*) (sq + params.sq_off.tail);
+    ring->sq_ring_mask = (unsigned int*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*) (sq + params.sq_off.array);
+    uint8_t* cq = ring->cq_ring;
+    ring->cq_head = (unsigned int*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int*) (cq + params.cq_off.tail);
+    ring->cq_ring_mask = (unsigned int*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    pthread_mutex_init(&ring->lock, NULL);
+    return true;
+}
+
+void ewsfs_uring_uninit(ewsfs_uring_t* ring) {
+    if (ring->queue_depth == 0)
+        return;
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sqes, ring->sqes_size);
+    close(ring->ring_fd);
+    pthread_mutex_destroy(&ring->lock);
+    *ring = (ewsfs_uring_t) {0};
+}
+
+int ewsfs_uring_submit(ewsfs_uring_t* ring, int fd, ewsfs_uring_request_t* requests, size_t request_count) {
+    pthread_mutex_lock(&ring->lock);
+    int error = ring->failed;
+    if (error) {
+        pthread_mutex_unlock(&ring->lock);
+        return error;
+    }
+
+    size_t next_request = 0;
+    size_t completed = 0;
+    unsigned int in_flight = 0;
+    // Entries that were put in the submission queue, but haven't been consumed by the kernel yet
+    unsigned int unsubmitted = 0;
+    while (completed < request_count) {
+        // Fill the submission queue with as many requests as the queue depth allows
+        unsigned int tail = *ring->sq_tail;
+        while (next_request < request_count && in_flight + unsubmitted < ring->queue_depth) {
+            ewsfs_uring_request_t* request = &requests[next_request];
+            unsigned int index = tail & *ring->sq_ring_mask;
+            struct io_uring_sqe* sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->off = request->offset;
+            sqe->addr = (uint64_t) (uintptr_t) request->iov;
+            sqe->len = request->iov_count;
+            sqe->user_data = next_request;
+            ring->sq_array[index] = index;
+            ++tail;
+            ++unsubmitted;
+            ++next_request;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        // Submit them and wait for at least one completion
+        int result = io_uring_enter(ring->ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+        if (result < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            error = errno;
+            ring->failed = error;
+            // Requests that are already in flight still point to the caller's buffers, so wait for them
+            while (in_flight > 0 && io_uring_enter(ring->ring_fd, 0, in_flight, IORING_ENTER_GETEVENTS) < 0 && errno == EINTR);
+            break;
+        }
+        in_flight += result;
+        unsubmitted -= result;
+
+        // Reap all available completions together
+        unsigned int head = *ring->cq_head;
+        unsigned int cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != cq_tail) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_ring_mask];
+            requests[cqe->user_data].result = cqe->res;
+            ++head;
+            ++completed;
+            --in_flight;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&ring->lock);
+    return error;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+
+// A minimal io_uring wrapper on top of the raw system calls, so we don't depend on liburing
+typedef struct {
+    int ring_fd;
+    unsigned int queue_depth;
+    pthread_mutex_t lock;
+    // The error io_uring_enter failed with. The ring isn't used anymore after that, but it's only
+    // torn down by ewsfs_uring_uninit, since other threads may be waiting for the lock.
+    int failed;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_ring_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    void* cq_ring;
+    size_t cq_ring_size;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_ring_mask;
+    struct io_uring_cqe* cqes;
+} ewsfs_uring_t;
+
+typedef struct {
+    bool write;
+    off_t offset;
+    const struct iovec* iov;
+    int iov_count;
+    // Filled in by ewsfs_uring_submit: the amount of bytes transferred, or a negative errno value
+    ssize_t result;
+} ewsfs_uring_request_t;
+
+bool ewsfs_uring_init(ewsfs_uring_t* ring, unsigned int queue_depth);
+void ewsfs_uring_uninit(ewsfs_uring_t* ring);
+// Submit all requests on fd, at most queue_depth at a time, and wait until they're all completed.
+// Once it failed, it keeps returning that error.
+int ewsfs_uring_submit(ewsfs_uring_t* ring, int fd, ewsfs_uring_request_t* requests, size_t request_count);
@@ -0,0 +1,109 @@
+#!/bin/sh
+# Formats and mounts a loop device with `exclusive`, checks that a second mount of it is refused, that the
+# filesystem has the size of the device, also after growing it, and that a file survives a remount. Then does
+# the same write and remount on two striped images, and on a mirror of two images.
+# Without losetup (or the rights to use it) a plain image file stands in for the device.
+# Usage: ./test_blockdev.sh [ewsfs_fuse], or `./nob test`
+set -u
+
+FUSE=${1:-./build/ewsfs_fuse}
+BLOCK_SIZE=4096
+WORK=$(mktemp -d)
+IMAGE=$WORK/ewsfs.img
+MNT=$WORK/mnt
+MNT2=$WORK/mnt2
+DEVICE=
+
+cleanup() {
+    fusermount -u "$MNT2" 2>/dev/null
+    fusermount -u "$MNT" 2>/dev/null
+    [ -n "$DEVICE" ] && losetup -d "$DEVICE"
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+mkdir "$MNT" "$MNT2"
+# Not a whole amount of blocks, so the size has to be rounded down
+truncate -s $((64*1024*1024 + 1024)) "$IMAGE" || fail "creating $IMAGE"
+
+if DEVICE=$(losetup --find --show "$IMAGE" 2>/dev/null); then
+    TARGET=$DEVICE
+    SIZE=$(blockdev --getsize64 "$DEVICE")
+    echo "Using loop device $DEVICE"
+else
+    DEVICE=
+    TARGET=$IMAGE
+    SIZE=$(stat -c %s "$IMAGE")
+    echo "Can't set up a loop device, using $IMAGE instead"
+fi
+
+./mkfs.ewsfs "$TARGET" >/dev/null || fail "mkfs.ewsfs $TARGET"
+"$FUSE" "$TARGET" "$MNT" -o exclusive || fail "mounting $TARGET"
+if "$FUSE" "$TARGET" "$MNT2" -o exclusive 2>/dev/null; then
+    fail "a second mount of $TARGET with exclusive succeeded"
+fi
+echo "A second mount with exclusive is refused"
+
+# The size in the FACT, and the one a device of `$1` bytes should have: whole blocks plus the 8 bytes of the
+# block size, like mkfs.ewsfs
+fact_size() {
+    sed -n 's/.*"size":[[:space:]]*\([0-9]*\).*/\1/p' "$MNT/fact.json" | head -n 1
+}
+expected_size() {
+    echo $((($1 - 8)/BLOCK_SIZE*BLOCK_SIZE + 8))
+}
+
+ACTUAL=$(fact_size)
+[ "$ACTUAL" = "$(expected_size "$SIZE")" ] || fail "the filesystem is ${ACTUAL:-?} bytes on a device of $SIZE bytes"
+echo "The filesystem is $ACTUAL bytes"
+
+# Growing takes the size from the device itself, with BLKGETSIZE64 for the loop device
+truncate -s $((80*1024*1024 + 1024)) "$IMAGE" || fail "growing $IMAGE"
+if [ -n "$DEVICE" ]; then
+    losetup --set-capacity "$DEVICE" || fail "resizing $DEVICE"
+    SIZE=$(blockdev --getsize64 "$DEVICE")
+else
+    SIZE=$(stat -c %s "$IMAGE")
+fi
+echo grow > "$MNT/ewsfs.ctl" || fail "growing the filesystem"
+ACTUAL=$(fact_size)
+[ "$ACTUAL" = "$(expected_size "$SIZE")" ] || fail "the filesystem grew to ${ACTUAL:-?} bytes on a device of $SIZE bytes"
+echo "The filesystem grew to $ACTUAL bytes"
+
+head -c $((3*1024*1024 + 123)) /dev/urandom > "$WORK/data"
+cp "$WORK/data" "$MNT/data" || fail "writing a file"
+fusermount -u "$MNT" || fail "unmounting $MNT"
+"$FUSE" "$TARGET" "$MNT" -o exclusive || fail "mounting $TARGET again"
+cmp -s "$WORK/data" "$MNT/data" || fail "the file changed after a remount"
+echo "A file survives a remount"
+
+# Two images mounted in the background like above, so the threads that use the images at the same time are
+# started after FUSE forks. The file is bigger than a stripe, so it's written to both images either way.
+# A transfer that's stuck on a missing thread is caught by the timeouts.
+two_images_check() {
+    rm -f "$WORK/a.img" "$WORK/b.img"
+    truncate -s $((32*1024*1024)) "$WORK/a.img" "$WORK/b.img" || fail "creating the images"
+    ./mkfs.ewsfs "$WORK/a.img" >/dev/null || fail "mkfs.ewsfs $WORK/a.img"
+    ./mkfs.ewsfs "$WORK/b.img" >/dev/null || fail "mkfs.ewsfs $WORK/b.img"
+    "$FUSE" "$WORK/a.img,$WORK/b.img" "$MNT2" -o "$1" || fail "mounting two images with $1"
+    timeout 60 cp "$WORK/data" "$MNT2/data" || fail "writing a file to two images with $1"
+    timeout 60 cmp -s "$WORK/data" "$MNT2/data" || fail "reading a file from two images with $1"
+    fusermount -u "$MNT2" || fail "unmounting two images with $1"
+    "$FUSE" "$WORK/a.img,$WORK/b.img" "$MNT2" -o "$1" || fail "mounting two images with $1 again"
+    timeout 60 cmp -s "$WORK/data" "$MNT2/data" || fail "the file on two images with $1 changed after a remount"
+    fusermount -u "$MNT2" || fail "unmounting two images with $1"
+}
+
+two_images_check stripe=4
+echo "A file on two striped images survives a remount"
+
+# Every write to a mirror goes to both images
+two_images_check mirror
+echo "A file on two mirrored images survives a remount"
+
+echo "OK"